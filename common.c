@@ -33,6 +33,7 @@
 /*   see AUTHORS and source files for details                               */
 /****************************************************************************/
 
+#define _GNU_SOURCE /* accept4 */
 #include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
@@ -151,17 +152,26 @@ int tcp_listen_nonblock(const struct sockaddr *addr, socklen_t len)
 
 int accept_nonblock(int fd)
 {
-    int sock = accept(fd, NULL, 0);
+#ifdef SOCK_NONBLOCK
+    int sock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int sock = accept(fd, NULL, NULL);
+#endif
 
     if (sock < 0) {
-        UNIXERR("accept");
+        /* An empty backlog is not an error for a non-blocking socket */
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            UNIXERR("accept");
+        }
         return -1;
     }
 
+#ifndef SOCK_NONBLOCK
     if (setnonblock(sock)) {
         close(sock);
         return -1;
     }
+#endif
 
     return sock;
 }
@@ -263,6 +273,14 @@ int pidfile_refresh(void)
     return 0;
 }
 
+void pidfile_release(void)
+{
+    if (pidfile) {
+        fclose(pidfile);
+        pidfile = NULL;
+    }
+}
+
 static void pidfile_close(void)
 {
     if (pidfile) {
@@ -148,6 +148,10 @@ int drop_privileges(const char *user, const char *group);
 int pidfile_open(const char *name);
 int pidfile_refresh(void);
 
+/** Close the pidfile without clearing it: it belongs to another process.
+ */
+void pidfile_release(void);
+
 int common_setup(const char* pidfile, bool unsafe, const char* runas_user,
                  const char* runas_group, bool daemonize);
 
@@ -36,11 +36,15 @@
 __DIR__:=$(realpath $(dir $(lastword $(MAKEFILE_LIST))))
 
 include $(__DIR__)/cflags.mk
+include $(__DIR__)/pcre.mk
+include $(__DIR__)/io_uring.mk
 
 prefix      ?= /usr/local
 LDFLAGSBASE += $(if $(DARWIN),,-Wl,-warn-common)
 LDFLAGSBASE += $(if $(FREEBSD),-L/usr/local/lib)
 CFLAGSBASE  += --std=gnu99 -I../ -I../common
+CFLAGSBASE  += -pthread
+LDFLAGSBASE += -pthread
 ASCIIDOC     = asciidoc -f $(__DIR__)/asciidoc.conf -d manpage \
 	       -apft_version=$(shell git describe)
 XMLTO        = xmlto -m $(__DIR__)/callouts.xsl
@@ -73,7 +77,7 @@ $(INSTALL_PROGS): install-%:
 	install $* $(DESTDIR)$(prefix)/sbin
 
 clean:
-	$(RM) $(LIBS:=.a) $(PROGRAMS) $(TESTS) .*.o .*.dep
+	$(RM) $(LIBS:=.a) $(PROGRAMS) $(TESTS) $(CHECKS) $(BENCHES) .*.o .*.dep
 	$(RM) $(DOCS) $(DOCS_XML) $(DOCS_HTML)
 
 distclean: clean
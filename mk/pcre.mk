@@ -0,0 +1,48 @@
+############################################################################
+#          pfixtools: a collection of postfix related tools                #
+#          ~~~~~~~~~                                                       #
+#  ______________________________________________________________________  #
+#                                                                          #
+#  Redistribution and use in source and binary forms, with or without      #
+#  modification, are permitted provided that the following conditions      #
+#  are met:                                                                #
+#                                                                          #
+#  1. Redistributions of source code must retain the above copyright       #
+#     notice, this list of conditions and the following disclaimer.        #
+#  2. Redistributions in binary form must reproduce the above copyright    #
+#     notice, this list of conditions and the following disclaimer in      #
+#     the documentation and/or other materials provided with the           #
+#     distribution.                                                        #
+#  3. The names of its contributors may not be used to endorse or promote  #
+#     products derived from this software without specific prior written   #
+#     permission.                                                          #
+#                                                                          #
+#  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         #
+#  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       #
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      #
+#  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   #
+#  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            #
+#  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    #
+#  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         #
+#  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   #
+#  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    #
+#  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       #
+#  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      #
+#                                                                          #
+#   Copyright (c) 2006-2014 the Authors                                    #
+#   see AUTHORS and source files for details                               #
+############################################################################
+
+ifneq ($(pcre2),)
+    ifeq ('','$(shell pkg-config libpcre2-8 || echo failed)')
+        PCRE_CFLAGS:=$(shell pkg-config --cflags libpcre2-8) -DHAVE_PCRE2
+        PCRE_LIBS:=$(shell pkg-config --libs libpcre2-8)
+    else
+        $(error libpcre2-8 library not found)
+    endif
+else
+    PCRE_CFLAGS:=
+    PCRE_LIBS:=-lpcre
+endif
+
+CFLAGSBASE += $(PCRE_CFLAGS)
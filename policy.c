@@ -0,0 +1,292 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+
+#include "policy.h"
+
+static const clstr_t policy_names_g[POLICY_ATTR_count] = {
+    [POLICY_ATTR_REQUEST]                 = CLSTR_IMMED("request"),
+    [POLICY_ATTR_PROTOCOL_STATE]          = CLSTR_IMMED("protocol_state"),
+    [POLICY_ATTR_PROTOCOL_NAME]           = CLSTR_IMMED("protocol_name"),
+    [POLICY_ATTR_HELO_NAME]               = CLSTR_IMMED("helo_name"),
+    [POLICY_ATTR_QUEUE_ID]                = CLSTR_IMMED("queue_id"),
+    [POLICY_ATTR_SENDER]                  = CLSTR_IMMED("sender"),
+    [POLICY_ATTR_RECIPIENT]               = CLSTR_IMMED("recipient"),
+    [POLICY_ATTR_RECIPIENT_COUNT]         = CLSTR_IMMED("recipient_count"),
+    [POLICY_ATTR_CLIENT_ADDRESS]          = CLSTR_IMMED("client_address"),
+    [POLICY_ATTR_CLIENT_NAME]             = CLSTR_IMMED("client_name"),
+    [POLICY_ATTR_REVERSE_CLIENT_NAME]     = CLSTR_IMMED("reverse_client_name"),
+    [POLICY_ATTR_INSTANCE]                = CLSTR_IMMED("instance"),
+    [POLICY_ATTR_SASL_METHOD]             = CLSTR_IMMED("sasl_method"),
+    [POLICY_ATTR_SASL_USERNAME]           = CLSTR_IMMED("sasl_username"),
+    [POLICY_ATTR_SASL_SENDER]             = CLSTR_IMMED("sasl_sender"),
+    [POLICY_ATTR_SIZE]                    = CLSTR_IMMED("size"),
+    [POLICY_ATTR_CCERT_SUBJECT]           = CLSTR_IMMED("ccert_subject"),
+    [POLICY_ATTR_CCERT_ISSUER]            = CLSTR_IMMED("ccert_issuer"),
+    [POLICY_ATTR_CCERT_FINGERPRINT]       = CLSTR_IMMED("ccert_fingerprint"),
+    [POLICY_ATTR_ENCRYPTION_PROTOCOL]     = CLSTR_IMMED("encryption_protocol"),
+    [POLICY_ATTR_ENCRYPTION_CIPHER]       = CLSTR_IMMED("encryption_cipher"),
+    [POLICY_ATTR_ENCRYPTION_KEYSIZE]      = CLSTR_IMMED("encryption_keysize"),
+    [POLICY_ATTR_ETRN_DOMAIN]             = CLSTR_IMMED("etrn_domain"),
+    [POLICY_ATTR_STRESS]                  = CLSTR_IMMED("stress"),
+    [POLICY_ATTR_CCERT_PUBKEY_FINGERPRINT]= CLSTR_IMMED("ccert_pubkey_fingerprint"),
+    [POLICY_ATTR_CLIENT_PORT]             = CLSTR_IMMED("client_port"),
+    [POLICY_ATTR_POLICY_CONTEXT]          = CLSTR_IMMED("policy_context"),
+    [POLICY_ATTR_SERVER_ADDRESS]          = CLSTR_IMMED("server_address"),
+    [POLICY_ATTR_SERVER_PORT]             = CLSTR_IMMED("server_port"),
+    [POLICY_ATTR_COMPATIBILITY_LEVEL]     = CLSTR_IMMED("compatibility_level"),
+    [POLICY_ATTR_MAIL_VERSION]            = CLSTR_IMMED("mail_version"),
+};
+
+/* Perfect hash of the attribute names: the constants were searched so that
+ * the known names fall in distinct slots. An unknown name may fall in the
+ * slot of a known one, the name is always compared.
+ */
+#define POLICY_HASH_SIZE  64
+
+static inline int policy_hash(const char *s, int len)
+{
+    return (len * 4 + s[0] * 23 + s[len - 1] * 32 + s[len / 2])
+         & (POLICY_HASH_SIZE - 1);
+}
+
+static const int8_t policy_slots_g[POLICY_HASH_SIZE] = {
+    -1,
+    -1,
+    -1,
+    -1,
+    -1,
+    POLICY_ATTR_CLIENT_PORT,
+    POLICY_ATTR_ENCRYPTION_CIPHER,
+    -1,
+    -1,
+    -1,
+    -1,
+    -1,
+    POLICY_ATTR_CCERT_SUBJECT,
+    POLICY_ATTR_ENCRYPTION_PROTOCOL,
+    POLICY_ATTR_SERVER_ADDRESS,
+    POLICY_ATTR_REQUEST,
+    POLICY_ATTR_INSTANCE,
+    POLICY_ATTR_SENDER,
+    POLICY_ATTR_RECIPIENT,
+    POLICY_ATTR_PROTOCOL_NAME,
+    POLICY_ATTR_PROTOCOL_STATE,
+    -1,
+    POLICY_ATTR_REVERSE_CLIENT_NAME,
+    POLICY_ATTR_CCERT_FINGERPRINT,
+    -1,
+    -1,
+    -1,
+    -1,
+    POLICY_ATTR_SASL_USERNAME,
+    POLICY_ATTR_COMPATIBILITY_LEVEL,
+    POLICY_ATTR_CLIENT_ADDRESS,
+    -1,
+    POLICY_ATTR_MAIL_VERSION,
+    -1,
+    -1,
+    POLICY_ATTR_ETRN_DOMAIN,
+    POLICY_ATTR_CCERT_PUBKEY_FINGERPRINT,
+    POLICY_ATTR_CLIENT_NAME,
+    -1,
+    -1,
+    POLICY_ATTR_RECIPIENT_COUNT,
+    POLICY_ATTR_ENCRYPTION_KEYSIZE,
+    -1,
+    POLICY_ATTR_POLICY_CONTEXT,
+    POLICY_ATTR_QUEUE_ID,
+    -1,
+    POLICY_ATTR_SASL_METHOD,
+    -1,
+    -1,
+    -1,
+    POLICY_ATTR_STRESS,
+    POLICY_ATTR_SERVER_PORT,
+    POLICY_ATTR_SASL_SENDER,
+    -1,
+    -1,
+    -1,
+    -1,
+    -1,
+    -1,
+    POLICY_ATTR_HELO_NAME,
+    -1,
+    -1,
+    POLICY_ATTR_CCERT_ISSUER,
+    POLICY_ATTR_SIZE,
+};
+
+policy_attr_t policy_attr_from_str(const clstr_t *name)
+{
+    int attr;
+
+    if (name->len <= 0 || name->len > 32) {
+        return POLICY_ATTR_UNKNOWN;
+    }
+    attr = policy_slots_g[policy_hash(name->str, name->len)];
+    if (attr < 0 || policy_names_g[attr].len != name->len
+    ||  memcmp(policy_names_g[attr].str, name->str, name->len) != 0) {
+        return POLICY_ATTR_UNKNOWN;
+    }
+    return attr;
+}
+
+const char *policy_attr_name(policy_attr_t attr)
+{
+    if (attr < 0 || attr >= POLICY_ATTR_count) {
+        return NULL;
+    }
+    return policy_names_g[attr].str;
+}
+
+/** Find the end of the request: the new line of the first empty line.
+ */
+static const char *policy_find_end(const char *start, const char *p,
+                                   const char *end)
+{
+    while (p < end) {
+        p = memchr(p, '\n', end - p);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (p == start || p[-1] == '\n') {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+int policy_parse(policy_request_t *req, const clstr_t *input)
+{
+    const char *start = input->str;
+    const char *end;
+    const char *p;
+
+    if (req->scanned > input->len) {
+        req->scanned = 0;
+    }
+    end = policy_find_end(start, start + req->scanned, start + input->len);
+    if (end == NULL) {
+        if (input->len > POLICY_REQUEST_MAX) {
+            return -1;
+        }
+        req->scanned = input->len;
+        return 0;
+    }
+    req->scanned = 0;
+    if (end + 1 - start > POLICY_REQUEST_MAX) {
+        return -1;
+    }
+
+    /* Only reset the attributes of the previous request */
+    for (uint64_t present = req->present ; present != 0 ;
+         present &= present - 1) {
+        req->attrs[__builtin_ctzll(present)] = (clstr_t)CLSTR_NULL;
+    }
+    req->present = 0;
+    req->unknown = 0;
+
+    for (p = start ; p < end ; ) {
+        const char *eol = memchr(p, '\n', end - p + 1);
+        const char *eq  = memchr(p, '=', eol - p);
+        clstr_t name;
+        int attr;
+
+        if (eq == NULL) {
+            return -1;
+        }
+        name.str = p;
+        name.len = eq - p;
+        attr = policy_attr_from_str(&name);
+        if (attr == POLICY_ATTR_UNKNOWN) {
+            req->unknown++;
+        } else {
+            req->attrs[attr].str = eq + 1;
+            req->attrs[attr].len = eol - eq - 1;
+            req->present |= 1ULL << attr;
+        }
+        p = eol + 1;
+    }
+    return end + 1 - start;
+}
+
+/** Append a string, the new lines replaced by spaces.
+ */
+static void policy_answer_add(buffer_t *out, const clstr_t *str)
+{
+    char *dst = out->data + out->len;
+    const char *nl;
+
+    memcpy(dst, str->str, str->len);
+    for (nl = memchr(dst, '\n', str->len) ; nl != NULL ;
+         nl = memchr(nl, '\n', dst + str->len - nl)) {
+        *(char *)nl = ' ';
+    }
+    out->len += str->len;
+}
+
+void policy_answer_str(buffer_t *out, const clstr_t *action,
+                       const clstr_t *text)
+{
+    static const char prefix[] = "action=";
+    int len = sizeof(prefix) - 1 + action->len + 2;
+
+    if (text != NULL && text->len > 0) {
+        len += 1 + text->len;
+    }
+    buffer_ensure(out, len);
+    memcpy(out->data + out->len, prefix, sizeof(prefix) - 1);
+    out->len += sizeof(prefix) - 1;
+    policy_answer_add(out, action);
+    if (text != NULL && text->len > 0) {
+        out->data[out->len++] = ' ';
+        policy_answer_add(out, text);
+    }
+    out->data[out->len++] = '\n';
+    out->data[out->len++] = '\n';
+    out->data[out->len]   = '\0';
+}
+
+void policy_answer(buffer_t *out, const char *action, const char *text)
+{
+    clstr_t a = { action, m_strlen(action) };
+    clstr_t t = { text, m_strlen(text) };
+
+    policy_answer_str(out, &a, text ? &t : NULL);
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,154 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+
+#ifndef PFIXTOOLS_POLICY_H
+#define PFIXTOOLS_POLICY_H
+
+#include "str.h"
+#include "buffer.h"
+
+/* Postfix policy delegation protocol.
+ *
+ * A request is a list of name=value lines terminated by an empty line, the
+ * response is a single action=... line terminated by an empty line. The
+ * parser works in place: the values are views into the input, several
+ * requests may be pipelined in the same input.
+ *
+ * Usage with the server:
+ *
+ *   for (;;) {
+ *       clstr_t in = client_input_str(client);
+ *       int len = policy_parse(&req, &in);
+ *
+ *       if (len <= 0) {
+ *           break;          (incomplete request, or -1 on error)
+ *       }
+ *       ... use req.attrs[POLICY_ATTR_SENDER] ...
+ *       policy_answer(client_output_buffer(client), "DUNNO", NULL);
+ *       client_input_consume(client, len);
+ *   }
+ */
+
+/** Attributes sent by Postfix (up to version 3.8).
+ */
+typedef enum policy_attr_t {
+    POLICY_ATTR_UNKNOWN = -1,
+    POLICY_ATTR_REQUEST,
+    POLICY_ATTR_PROTOCOL_STATE,
+    POLICY_ATTR_PROTOCOL_NAME,
+    POLICY_ATTR_HELO_NAME,
+    POLICY_ATTR_QUEUE_ID,
+    POLICY_ATTR_SENDER,
+    POLICY_ATTR_RECIPIENT,
+    POLICY_ATTR_RECIPIENT_COUNT,
+    POLICY_ATTR_CLIENT_ADDRESS,
+    POLICY_ATTR_CLIENT_NAME,
+    POLICY_ATTR_REVERSE_CLIENT_NAME,
+    POLICY_ATTR_INSTANCE,
+    POLICY_ATTR_SASL_METHOD,
+    POLICY_ATTR_SASL_USERNAME,
+    POLICY_ATTR_SASL_SENDER,
+    POLICY_ATTR_SIZE,
+    POLICY_ATTR_CCERT_SUBJECT,
+    POLICY_ATTR_CCERT_ISSUER,
+    POLICY_ATTR_CCERT_FINGERPRINT,
+    POLICY_ATTR_ENCRYPTION_PROTOCOL,
+    POLICY_ATTR_ENCRYPTION_CIPHER,
+    POLICY_ATTR_ENCRYPTION_KEYSIZE,
+    POLICY_ATTR_ETRN_DOMAIN,
+    POLICY_ATTR_STRESS,
+    POLICY_ATTR_CCERT_PUBKEY_FINGERPRINT,
+    POLICY_ATTR_CLIENT_PORT,
+    POLICY_ATTR_POLICY_CONTEXT,
+    POLICY_ATTR_SERVER_ADDRESS,
+    POLICY_ATTR_SERVER_PORT,
+    POLICY_ATTR_COMPATIBILITY_LEVEL,
+    POLICY_ATTR_MAIL_VERSION,
+    POLICY_ATTR_count,
+} policy_attr_t;
+
+/** Longest request accepted by the parser.
+ */
+#define POLICY_REQUEST_MAX  (64 << 10)
+
+typedef struct policy_request_t {
+    /** Value of each attribute, { NULL, 0 } if it was not sent. The values
+     * point into the input, and are valid as long as it is.
+     */
+    clstr_t  attrs[POLICY_ATTR_count];
+    uint64_t present;           /**< bit i is set if attribute i was sent */
+    int      unknown;           /**< number of unknown attributes */
+
+    int      scanned;           /**< input known not to hold a full request */
+} policy_request_t;
+
+/** Parse the first request of the input.
+ *
+ * @c req must be zeroed before its first use. The same @c req must be used
+ * for the successive calls on a stream: when the request is incomplete, the
+ * next call only scans the new input.
+ *
+ * \return the length of the request (to be consumed), 0 if the request is
+ * incomplete, -1 if the input is not a valid request or is longer than
+ * POLICY_REQUEST_MAX.
+ */
+__attribute__((nonnull))
+int policy_parse(policy_request_t *req, const clstr_t *input);
+
+/** Get the attribute with the given name.
+ */
+__attribute__((nonnull))
+policy_attr_t policy_attr_from_str(const clstr_t *name);
+
+/** Get the name of an attribute.
+ */
+const char *policy_attr_name(policy_attr_t attr);
+
+/** Append the response to a request to @c out: action=<action> <text>.
+ * The new lines of the action and text are replaced by spaces.
+ *
+ * \param text may be NULL.
+ */
+__attribute__((nonnull(1,2)))
+void policy_answer_str(buffer_t *out, const clstr_t *action,
+                       const clstr_t *text);
+
+__attribute__((nonnull(1,2)))
+void policy_answer(buffer_t *out, const char *action, const char *text);
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
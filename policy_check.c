@@ -0,0 +1,283 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Differential check of the policy delegation parser.
+ *
+ * Streams of random requests, with unknown, malformed and oversized
+ * attributes, are fed to policy_parse in random chunks as they would be
+ * read from a client, and each parsed request is compared with the result
+ * of a naive parser of the whole input. A mismatch can be replayed with the
+ * same arguments:
+ *
+ *     policy_check [seed [streams]]
+ */
+
+#include "regexp_check.h"
+#include "policy.h"
+
+
+/* Reference {{{1
+ */
+
+static policy_attr_t check_attr(const char *name, int len)
+{
+    for (int i = 0 ; i < POLICY_ATTR_count ; ++i) {
+        if (m_strlen(policy_attr_name(i)) == len
+        &&  memcmp(policy_attr_name(i), name, len) == 0) {
+            return i;
+        }
+    }
+    return POLICY_ATTR_UNKNOWN;
+}
+
+/** Naive parser of the first request of the input, with the same result as
+ * policy_parse.
+ */
+static int check_parse(const char *str, int len, clstr_t *attrs,
+                       int *unknown)
+{
+    const char *end = NULL;
+
+    for (int i = 0 ; i < len ; ++i) {
+        if (str[i] == '\n' && (i == 0 || str[i - 1] == '\n')) {
+            end = str + i;
+            break;
+        }
+    }
+    if (end == NULL) {
+        return len > POLICY_REQUEST_MAX ? -1 : 0;
+    }
+    if (end + 1 - str > POLICY_REQUEST_MAX) {
+        return -1;
+    }
+
+    *unknown = 0;
+    for (int i = 0 ; i < POLICY_ATTR_count ; ++i) {
+        attrs[i] = (clstr_t)CLSTR_NULL;
+    }
+    for (const char *p = str ; p < end ; ) {
+        const char *eol = p;
+        const char *eq  = NULL;
+        policy_attr_t attr;
+
+        while (*eol != '\n') {
+            if (*eol == '=' && eq == NULL) {
+                eq = eol;
+            }
+            eol++;
+        }
+        if (eq == NULL) {
+            return -1;
+        }
+        attr = check_attr(p, eq - p);
+        if (attr == POLICY_ATTR_UNKNOWN) {
+            ++*unknown;
+        } else {
+            attrs[attr].str = eq + 1;
+            attrs[attr].len = eol - eq - 1;
+        }
+        p = eol + 1;
+    }
+    return end + 1 - str;
+}
+
+
+/* Generation {{{1
+ */
+
+static void check_gen_attr(buffer_t *stream)
+{
+    int len;
+
+    if (check_rand(4) != 0) {
+        buffer_addstr(stream, policy_attr_name(check_rand(POLICY_ATTR_count)));
+    } else {
+        /* Unknown names, and lines without '=' */
+        len = check_rand(6);
+        for (int i = 0 ; i < len ; ++i) {
+            buffer_addch(stream, "ab_c\n=x"[check_rand(check_rand(50) ? 4
+                                                                     : 7)]);
+        }
+    }
+    if (check_rand(60) != 0) {
+        buffer_addch(stream, '=');
+    }
+    len = check_rand(12);
+    for (int i = 0 ; i < len ; ++i) {
+        buffer_addch(stream, "xyz@.=: "[check_rand(8)]);
+    }
+    buffer_addch(stream, '\n');
+}
+
+/** Generate a request around the size limit.
+ */
+static void check_gen_large(buffer_t *stream)
+{
+    static const char prefix[] = "sender=";
+    const int len = POLICY_REQUEST_MAX - 1 + check_rand(3);
+
+    buffer_addstr(stream, prefix);
+    for (int i = sizeof(prefix) - 1 ; i < len - 2 ; ++i) {
+        buffer_addch(stream, 'x');
+    }
+    buffer_addstr(stream, "\n\n");
+}
+
+static void check_gen(buffer_t *stream)
+{
+    int requests = 1 + check_rand(5);
+
+    for (int r = 0 ; r < requests ; ++r) {
+        int attrs = check_rand(8);
+
+        if (check_rand(100) == 0) {
+            check_gen_large(stream);
+            continue;
+        }
+        for (int a = 0 ; a < attrs ; ++a) {
+            check_gen_attr(stream);
+        }
+        buffer_addch(stream, '\n');
+    }
+}
+
+
+/* Checks {{{1
+ */
+
+static void check_names(void)
+{
+    char name[40];
+
+    for (int i = 0 ; i < POLICY_ATTR_count ; ++i) {
+        const char *attr = policy_attr_name(i);
+        const clstr_t s = { attr, m_strlen(attr) };
+
+        CHECK(policy_attr_from_str(&s) == (policy_attr_t)i);
+    }
+    CHECK(policy_attr_name(POLICY_ATTR_count) == NULL);
+
+    for (int k = 0 ; k < 100000 ; ++k) {
+        const clstr_t s = { name, 1 + check_rand(sizeof(name) - 1) };
+
+        for (int j = 0 ; j < s.len ; ++j) {
+            name[j] = "abcdefghijklmnopqrstuvwxyz_="[check_rand(28)];
+        }
+        CHECK(policy_attr_from_str(&s) == check_attr(s.str, s.len));
+    }
+}
+
+/** Feed a stream in random chunks, and compare each request.
+ *
+ * \return the number of requests parsed.
+ */
+static int check_stream(const buffer_t *stream)
+{
+    buffer_t in = BUFFER_INIT;
+    policy_request_t req;
+    int pos = 0, off = 0, requests = 0;
+    bool done = false;
+
+    p_clear(&req, 1);
+    while (!done && pos < (int)stream->len) {
+        int chunk = 1 + check_rand(stream->len > 4096 ? 4096 : 20);
+
+        chunk = MIN(chunk, (int)stream->len - pos);
+        buffer_add(&in, stream->data + pos, chunk);
+        pos += chunk;
+
+        for (;;) {
+            const clstr_t s = { in.data + off, in.len - off };
+            clstr_t attrs[POLICY_ATTR_count];
+            int unknown = 0;
+            int got  = policy_parse(&req, &s);
+            int want = check_parse(s.str, s.len, attrs, &unknown);
+
+            if (got != want) {
+                printf("request at %d: %d, expected %d\n", off, got, want);
+                check_failures_g++;
+                done = true;
+                break;
+            }
+            if (got <= 0) {
+                /* An invalid request closes the connection */
+                done = got < 0;
+                break;
+            }
+            for (int i = 0 ; i < POLICY_ATTR_count ; ++i) {
+                CHECK(!!(req.present & (1ULL << i)) == (attrs[i].str != NULL));
+                CHECK(clstr_equals(req.attrs[i], attrs[i]));
+            }
+            CHECK(req.unknown == unknown);
+            requests++;
+            off += got;
+        }
+    }
+    buffer_wipe(&in);
+    return requests;
+}
+
+static void check_answers(void)
+{
+    buffer_t out = BUFFER_INIT;
+
+    policy_answer(&out, "DUNNO", NULL);
+    policy_answer(&out, "REJECT", "bad\nguy");
+    CHECK(strcmp(out.data, "action=DUNNO\n\naction=REJECT bad guy\n\n") == 0);
+    buffer_wipe(&out);
+}
+
+int main(int argc, char *argv[])
+{
+    buffer_t stream = BUFFER_INIT;
+    int streams = argc > 2 ? atoi(argv[2]) : 20000;
+    int requests = 0;
+
+    check_seed(argc, argv);
+    check_names();
+    check_answers();
+    for (int i = 0 ; i < streams ; ++i) {
+        buffer_reset(&stream);
+        check_gen(&stream);
+        requests += check_stream(&stream);
+    }
+
+    printf("policy: %d streams, %d requests, %d failures\n", streams,
+           requests, check_failures_g);
+    buffer_wipe(&stream);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
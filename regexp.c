@@ -33,7 +33,1074 @@
 /*   see AUTHORS and source files for details                               */
 /****************************************************************************/
 
+#include <pthread.h>
 #include "regexp.h"
+#include "regexp_dfa.h"
+#include "file.h"
+
+/* Bounds of the per-thread JIT stack. The machine stack is used for
+ * patterns that fit in 32K.
+ */
+#define REGEXP_JIT_STACK_MIN  (32 * 1024)
+#define REGEXP_JIT_STACK_MAX  (512 * 1024)
+
+/* Compiled code of a regexp. The code is reference counted: interned codes
+ * are shared by all the regexps compiled from the same pattern with the
+ * same flags.
+ */
+struct regexp_code_t {
+#ifdef HAVE_PCRE2
+    pcre2_code *re;
+#else
+    pcre *re;
+    pcre_extra *extra;
+#endif
+
+    regexp_code_t *next;
+    uint32_t hash;
+    int      refcount;
+    int      state;
+    bool     cs;
+    bool     interned;
+    uint8_t  kind;
+
+    /* Literal of the pattern (lower-cased if case insensitive) when the
+     * pattern is not matched by the engine.
+     */
+    char    *literal;
+    int      literal_len;
+
+    /* Automaton of the pattern when it is matched by the DFA. The engine
+     * code is then only built on demand, to extract the captures: engine
+     * is set once it is available.
+     */
+    regexp_dfa_t *dfa;
+    bool     engine;
+
+    /* Number of capture groups */
+    int      captures;
+
+    /* Profiling counters */
+    uint64_t executions;
+    uint64_t limit_hits;
+    uint64_t total_nsec;
+    uint64_t max_nsec;
+
+    /* List of the live codes, for the profiling */
+    regexp_code_t  *live_next;
+    regexp_code_t **live_pprev;
+
+    size_t   memory;
+    ssize_t  len;
+    char     source[];
+};
+
+/* The state of a code is only updated with build_lock held. Once it is no
+ * longer pending, it never changes again: matching threads read it without
+ * locking.
+ */
+enum {
+    REGEXP_CODE_PENDING,
+    REGEXP_CODE_READY,
+    REGEXP_CODE_FAILED,
+};
+
+/* Match counters of a thread. The counters are only written by their
+ * thread, but read by regexp_get_stats: they are updated with relaxed
+ * atomic stores rather than atomic increments.
+ */
+typedef struct regexp_counters_t regexp_counters_t;
+struct regexp_counters_t {
+    uint64_t matches[REGEXP_KIND_count];
+    regexp_counters_t *next;
+};
+
+static __thread regexp_counters_t *regexp_counters_g;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_mutex_t build_lock;
+
+    regexp_code_t **buckets;
+    uint32_t        buckets_len;
+
+    regexp_stats_t  stats;
+
+    pthread_t       warmup;
+    bool            warmup_running;
+    int             warmup_stop;
+
+    file_map_t      cache_map;
+    const struct regexp_cache_entry_t **cache;
+    uint32_t        cache_len;
+
+    regexp_counters_t *counters;
+    uint64_t        retired_matches[REGEXP_KIND_count];
+
+    regexp_code_t  *live;
+    uint32_t        match_limit;
+    uint32_t        depth_limit;
+    int             profiling;
+} regexp_g = {
+    .lock       = PTHREAD_MUTEX_INITIALIZER,
+    .build_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+#define _G  regexp_g
+
+/* Compilation error of a regexp.
+ */
+typedef struct regexp_error_t {
+    char msg[256];
+    int  offset;
+} regexp_error_t;
+
+#ifdef HAVE_PCRE2
+static __thread pcre2_match_data    *regexp_match_data_g;
+static __thread pcre2_match_context *regexp_match_context_g;
+static __thread pcre2_jit_stack     *regexp_jit_stack_g;
+static __thread int                  regexp_match_data_len_g;
+
+/* Limits currently set in the match context, and library defaults */
+static __thread uint32_t regexp_match_limit_g;
+static __thread uint32_t regexp_depth_limit_g;
+static __thread uint32_t regexp_default_match_limit_g;
+static __thread uint32_t regexp_default_depth_limit_g;
+#else
+static __thread int                 *regexp_ovector_g;
+static __thread int                  regexp_ovector_len_g;
+#  ifdef PCRE_STUDY_JIT_COMPILE
+static __thread pcre_jit_stack      *regexp_jit_stack_g;
+#  endif
+#endif
+
+void regexp_thread_wipe(void)
+{
+    if (regexp_counters_g) {
+        regexp_counters_t **pos = &_G.counters;
+
+        pthread_mutex_lock(&_G.lock);
+        while (*pos != regexp_counters_g) {
+            pos = &(*pos)->next;
+        }
+        *pos = regexp_counters_g->next;
+        for (int i = 0 ; i < REGEXP_KIND_count ; ++i) {
+            _G.retired_matches[i] += regexp_counters_g->matches[i];
+        }
+        pthread_mutex_unlock(&_G.lock);
+        p_delete(&regexp_counters_g);
+    }
+#ifdef HAVE_PCRE2
+    if (regexp_match_data_g) {
+        pcre2_match_data_free(regexp_match_data_g);
+        regexp_match_data_g = NULL;
+    }
+    if (regexp_match_context_g) {
+        pcre2_match_context_free(regexp_match_context_g);
+        regexp_match_context_g = NULL;
+    }
+    if (regexp_jit_stack_g) {
+        pcre2_jit_stack_free(regexp_jit_stack_g);
+        regexp_jit_stack_g = NULL;
+    }
+    regexp_match_data_len_g = 0;
+#else
+    p_delete(&regexp_ovector_g);
+    regexp_ovector_len_g = 0;
+#  ifdef PCRE_STUDY_JIT_COMPILE
+    if (regexp_jit_stack_g) {
+        pcre_jit_stack_free(regexp_jit_stack_g);
+        regexp_jit_stack_g = NULL;
+    }
+#  endif
+#endif
+}
+
+static void regexp_shutdown(void)
+{
+    __atomic_store_n(&_G.warmup_stop, true, __ATOMIC_RELAXED);
+    regexp_warmup_wait();
+    regexp_cache_close();
+    regexp_thread_wipe();
+    if (_G.stats.interned == 0) {
+        p_delete(&_G.buckets);
+        _G.buckets_len = 0;
+    }
+}
+module_exit(regexp_shutdown);
+
+static uint64_t regexp_now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Result of the execution of a regexp */
+enum {
+    REGEXP_EXEC_NOMATCH,
+    REGEXP_EXEC_MATCH,
+    REGEXP_EXEC_LIMIT,
+};
+
+
+/* Engine {{{1
+ */
+
+#ifdef HAVE_PCRE2
+
+#if PCRE2_MAJOR > 10 || PCRE2_MINOR >= 30
+#  define regexp_set_depth_limit(ctx, l)  pcre2_set_depth_limit(ctx, l)
+#  define REGEXP_CONFIG_DEPTHLIMIT        PCRE2_CONFIG_DEPTHLIMIT
+#  define REGEXP_ERROR_DEPTHLIMIT         PCRE2_ERROR_DEPTHLIMIT
+#else
+#  define regexp_set_depth_limit(ctx, l)  pcre2_set_recursion_limit(ctx, l)
+#  define REGEXP_CONFIG_DEPTHLIMIT        PCRE2_CONFIG_RECURSIONLIMIT
+#  define REGEXP_ERROR_DEPTHLIMIT         PCRE2_ERROR_RECURSIONLIMIT
+#endif
+
+/** Allocate the matching resources of the current thread.
+ */
+static void regexp_thread_init(void)
+{
+    regexp_match_data_g     = pcre2_match_data_create(1, NULL);
+    regexp_match_data_len_g = 1;
+    regexp_match_context_g  = pcre2_match_context_create(NULL);
+    regexp_jit_stack_g      = pcre2_jit_stack_create(REGEXP_JIT_STACK_MIN,
+                                                    REGEXP_JIT_STACK_MAX,
+                                                    NULL);
+    if (regexp_match_data_g == NULL || regexp_match_context_g == NULL) {
+        abort();
+    }
+    if (regexp_jit_stack_g != NULL) {
+        pcre2_jit_stack_assign(regexp_match_context_g, NULL,
+                               regexp_jit_stack_g);
+    }
+    pcre2_config(PCRE2_CONFIG_MATCHLIMIT, &regexp_default_match_limit_g);
+    pcre2_config(REGEXP_CONFIG_DEPTHLIMIT, &regexp_default_depth_limit_g);
+    regexp_match_limit_g = regexp_default_match_limit_g;
+    regexp_depth_limit_g = regexp_default_depth_limit_g;
+}
+
+/** JIT compile a code and account for its memory.
+ */
+static void regexp_code_finish(regexp_code_t *code)
+{
+    size_t size = 0;
+    uint32_t captures = 0;
+
+    if (pcre2_jit_compile(code->re, PCRE2_JIT_COMPLETE) != 0) {
+        debug("regexp JIT compilation failed, using the interpreter");
+    }
+    if (pcre2_pattern_info(code->re, PCRE2_INFO_CAPTURECOUNT,
+                           &captures) == 0) {
+        code->captures = captures;
+    }
+    if (pcre2_pattern_info(code->re, PCRE2_INFO_SIZE, &size) == 0) {
+        code->memory += size;
+    }
+    if (pcre2_pattern_info(code->re, PCRE2_INFO_JITSIZE, &size) == 0) {
+        code->memory += size;
+    }
+}
+
+static bool regexp_code_build(regexp_code_t *code, regexp_error_t *error)
+{
+    PCRE2_SIZE erroffset = 0;
+    int errcode = 0;
+
+    uint32_t flags = (code->cs ? 0 : PCRE2_CASELESS);
+
+    debug("compiling regexp: %s", code->source);
+    code->re = pcre2_compile((PCRE2_SPTR)code->source, (PCRE2_SIZE)code->len,
+                             flags, &errcode, &erroffset, NULL);
+    if (code->re == NULL) {
+        pcre2_get_error_message(errcode, (PCRE2_UCHAR *)error->msg,
+                                sizeof(error->msg));
+        error->offset = (int)erroffset;
+        return false;
+    }
+    regexp_code_finish(code);
+    return true;
+}
+
+static bool regexp_code_thaw(regexp_code_t *code, const void *data, size_t len)
+{
+    if (pcre2_serialize_decode(&code->re, 1, data, NULL) != 1) {
+        code->re = NULL;
+        return false;
+    }
+    regexp_code_finish(code);
+    return true;
+}
+
+static bool regexp_code_freeze(const regexp_code_t *code, buffer_t *out)
+{
+    const pcre2_code *codes[1] = { code->re };
+    uint8_t *bytes = NULL;
+    PCRE2_SIZE size = 0;
+
+    if (pcre2_serialize_encode(codes, 1, &bytes, &size, NULL) != 1) {
+        return false;
+    }
+    buffer_add(out, bytes, (int)size);
+    pcre2_serialize_free(bytes);
+    return true;
+}
+
+static void regexp_engine_id(char *buf, int size)
+{
+    char version[32] = "";
+
+    pcre2_config(PCRE2_CONFIG_VERSION, version);
+    snprintf(buf, size, "pcre2 %s", version);
+}
+
+static void regexp_code_unbuild(regexp_code_t *code)
+{
+    pcre2_code_free(code->re);
+    code->re = NULL;
+}
+
+/** Run the code of a regexp, with the limits of the regexp. If @c captures
+ * is not NULL, it is filled with the first @c count capture slices
+ * (\ref regexp_exec_captures).
+ */
+static inline int regexp_code_exec(const regexp_t *re, const clstr_t *str,
+                                   clstr_t *captures, int count)
+{
+    const regexp_code_t *code = re->code;
+    uint32_t match_limit, depth_limit;
+    int res;
+
+    if (unlikely(regexp_match_data_g == NULL)) {
+        regexp_thread_init();
+    }
+    if (unlikely(count > regexp_match_data_len_g)) {
+        /* Grow the match data of the thread, it is then reused for all the
+         * following executions.
+         */
+        pcre2_match_data_free(regexp_match_data_g);
+        regexp_match_data_g = pcre2_match_data_create(count, NULL);
+        if (regexp_match_data_g == NULL) {
+            abort();
+        }
+        regexp_match_data_len_g = count;
+    }
+    match_limit = re->match_limit ?: regexp_default_match_limit_g;
+    depth_limit = re->depth_limit ?: regexp_default_depth_limit_g;
+    if (unlikely(match_limit != regexp_match_limit_g)) {
+        pcre2_set_match_limit(regexp_match_context_g, match_limit);
+        regexp_match_limit_g = match_limit;
+    }
+    if (unlikely(depth_limit != regexp_depth_limit_g)) {
+        regexp_set_depth_limit(regexp_match_context_g, depth_limit);
+        regexp_depth_limit_g = depth_limit;
+    }
+
+    res = pcre2_match(code->re, (PCRE2_SPTR)str->str, (PCRE2_SIZE)str->len,
+                      0, 0, regexp_match_data_g, regexp_match_context_g);
+    if (res >= 0) {
+        if (captures != NULL) {
+            const PCRE2_SIZE *ovector;
+
+            ovector = pcre2_get_ovector_pointer(regexp_match_data_g);
+            for (int i = 0 ; i < count ; ++i) {
+                if (ovector[2 * i] == PCRE2_UNSET) {
+                    captures[i].str = NULL;
+                    captures[i].len = 0;
+                } else {
+                    captures[i].str = str->str + ovector[2 * i];
+                    captures[i].len = ovector[2 * i + 1] - ovector[2 * i];
+                }
+            }
+        }
+        return REGEXP_EXEC_MATCH;
+    }
+    if (res == PCRE2_ERROR_MATCHLIMIT || res == REGEXP_ERROR_DEPTHLIMIT
+    ||  res == PCRE2_ERROR_JIT_STACKLIMIT) {
+        return REGEXP_EXEC_LIMIT;
+    }
+    return REGEXP_EXEC_NOMATCH;
+}
+
+#else
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+/** JIT stack callback: each thread gets its own stack.
+ */
+static pcre_jit_stack *regexp_jit_stack(void *data)
+{
+    if (unlikely(regexp_jit_stack_g == NULL)) {
+        regexp_jit_stack_g = pcre_jit_stack_alloc(REGEXP_JIT_STACK_MIN,
+                                                  REGEXP_JIT_STACK_MAX);
+    }
+    return regexp_jit_stack_g;
+}
+#  define REGEXP_STUDY_FLAGS  PCRE_STUDY_JIT_COMPILE
+#else
+#  define REGEXP_STUDY_FLAGS  0
+#endif
+
+/** Study a code and account for its memory.
+ */
+static void regexp_code_finish(regexp_code_t *code)
+{
+    const char *msg = NULL;
+    size_t size = 0;
+
+    code->extra = pcre_study(code->re, REGEXP_STUDY_FLAGS, &msg);
+    if (code->extra == NULL && msg != NULL) {
+        warn("regexp inspection failed: %s", msg);
+    }
+#ifdef PCRE_STUDY_JIT_COMPILE
+    if (code->extra != NULL) {
+        pcre_assign_jit_stack(code->extra, regexp_jit_stack, NULL);
+    }
+#endif
+    if (pcre_fullinfo(code->re, NULL, PCRE_INFO_CAPTURECOUNT,
+                      &code->captures) != 0) {
+        code->captures = 0;
+    }
+    if (pcre_fullinfo(code->re, NULL, PCRE_INFO_SIZE, &size) == 0) {
+        code->memory += size;
+    }
+    if (code->extra != NULL) {
+        if (pcre_fullinfo(code->re, code->extra, PCRE_INFO_STUDYSIZE,
+                          &size) == 0) {
+            code->memory += size;
+        }
+#ifdef PCRE_STUDY_JIT_COMPILE
+        if (pcre_fullinfo(code->re, code->extra, PCRE_INFO_JITSIZE,
+                          &size) == 0) {
+            code->memory += size;
+        }
+#endif
+    }
+}
+
+static bool regexp_code_build(regexp_code_t *code, regexp_error_t *error)
+{
+    const char *msg = NULL;
+    int erroffset = 0;
+
+    int flags = (code->cs ? 0 : PCRE_CASELESS);
+
+    /* The source is NUL-terminated, no copy is needed */
+    debug("compiling regexp: %s", code->source);
+    code->re = pcre_compile(code->source, flags, &msg, &erroffset, NULL);
+    if (code->re == NULL) {
+        snprintf(error->msg, sizeof(error->msg), "%s", msg);
+        error->offset = erroffset;
+        return false;
+    }
+    regexp_code_finish(code);
+    return true;
+}
+
+/** The compiled pattern of libpcre is a single block of memory that can be
+ * saved and reloaded as is. The study data is rebuilt on load.
+ */
+static bool regexp_code_thaw(regexp_code_t *code, const void *data, size_t len)
+{
+    size_t size = 0;
+
+    code->re = pcre_malloc(len);
+    if (code->re == NULL) {
+        return false;
+    }
+    memcpy(code->re, data, len);
+    if (pcre_pattern_to_host_byte_order(code->re, NULL, NULL) != 0
+    ||  pcre_fullinfo(code->re, NULL, PCRE_INFO_SIZE, &size) != 0
+    ||  size != len) {
+        pcre_free(code->re);
+        code->re = NULL;
+        return false;
+    }
+    regexp_code_finish(code);
+    return true;
+}
+
+static bool regexp_code_freeze(const regexp_code_t *code, buffer_t *out)
+{
+    size_t size = 0;
+
+    if (pcre_fullinfo(code->re, NULL, PCRE_INFO_SIZE, &size) != 0) {
+        return false;
+    }
+    buffer_add(out, code->re, (int)size);
+    return true;
+}
+
+static void regexp_engine_id(char *buf, int size)
+{
+    snprintf(buf, size, "pcre %s", pcre_version());
+}
+
+static void regexp_code_unbuild(regexp_code_t *code)
+{
+    pcre_free(code->re);
+#  ifdef PCRE_STUDY_JIT_COMPILE
+    pcre_free_study(code->extra);
+#  else
+    pcre_free(code->extra);
+#  endif
+    code->re    = NULL;
+    code->extra = NULL;
+}
+
+/** Run the code of a regexp, with the limits of the regexp. If @c captures
+ * is not NULL, it is filled with the first @c count capture slices
+ * (\ref regexp_exec_captures).
+ */
+static inline int regexp_code_exec(const regexp_t *re, const clstr_t *str,
+                                   clstr_t *captures, int count)
+{
+    const regexp_code_t *code = re->code;
+    const pcre_extra *extra = code->extra;
+    pcre_extra limits;
+    int res;
+
+    /* The study data is shared by the regexps of the code: the limits go
+     * in a copy.
+     */
+    if (unlikely(re->match_limit != 0 || re->depth_limit != 0)) {
+        if (code->extra != NULL) {
+            limits = *code->extra;
+        } else {
+            p_clear(&limits, 1);
+        }
+        if (re->match_limit != 0) {
+            limits.flags      |= PCRE_EXTRA_MATCH_LIMIT;
+            limits.match_limit = re->match_limit;
+        }
+        if (re->depth_limit != 0) {
+            limits.flags |= PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+            limits.match_limit_recursion = re->depth_limit;
+        }
+        extra = &limits;
+    }
+    if (captures == NULL) {
+        res = pcre_exec(code->re, extra, str->str, str->len,
+                        0, 0, NULL, 0);
+    } else {
+        /* The ovector of the thread is reused for all the executions */
+        if (unlikely(3 * count > regexp_ovector_len_g)) {
+            p_realloc(&regexp_ovector_g, 3 * count);
+            regexp_ovector_len_g = 3 * count;
+        }
+        res = pcre_exec(code->re, extra, str->str, str->len,
+                        0, 0, regexp_ovector_g, 3 * count);
+    }
+    if (res >= 0) {
+        for (int i = 0 ; captures != NULL && i < count ; ++i) {
+            const int *ovector = regexp_ovector_g + 2 * i;
+
+            if (i >= res && res != 0) {
+                captures[i].str = NULL;
+                captures[i].len = 0;
+            } else if (ovector[0] < 0) {
+                captures[i].str = NULL;
+                captures[i].len = 0;
+            } else {
+                captures[i].str = str->str + ovector[0];
+                captures[i].len = ovector[1] - ovector[0];
+            }
+        }
+        return REGEXP_EXEC_MATCH;
+    }
+    if (res == PCRE_ERROR_MATCHLIMIT || res == PCRE_ERROR_RECURSIONLIMIT
+#ifdef PCRE_ERROR_JIT_STACKLIMIT
+    ||  res == PCRE_ERROR_JIT_STACKLIMIT
+#endif
+    ) {
+        return REGEXP_EXEC_LIMIT;
+    }
+    return REGEXP_EXEC_NOMATCH;
+}
+
+#endif
+
+
+/* Literals {{{1
+ */
+
+static inline bool regexp_is_meta(int c)
+{
+    return c == '.' || c == '^' || c == '$' || c == '|' || c == '?'
+        || c == '*' || c == '+' || c == '(' || c == ')' || c == '['
+        || c == ']' || c == '{' || c == '}' || c == '\\' || c == '\0';
+}
+
+/** Detect the patterns that are a plain literal, optionally anchored.
+ *
+ * Escaped non-alphanumeric characters are literals, anything else with a
+ * special meaning (including all the alphanumeric escapes) leaves the
+ * pattern to the engine. Without UTF support, the case folding of the
+ * engine only applies to ASCII letters.
+ */
+static bool regexp_code_classify(regexp_code_t *code)
+{
+    const char *p   = code->source;
+    const char *end = p + code->len;
+    bool start = false, stop = false;
+    char *literal;
+    int len = 0;
+
+    if (p < end && *p == '^') {
+        start = true;
+        ++p;
+    }
+    literal = p_new(char, end - p + 1);
+    while (p < end) {
+        int c = *p++;
+
+        if (c == '$' && p == end) {
+            stop = true;
+            break;
+        }
+        if (c == '\\' && p < end && !isalnum(*p) && !(*p & 0x80)
+        &&  *p != '\0') {
+            c = *p++;
+        } else if (regexp_is_meta(c)) {
+            p_delete(&literal);
+            return false;
+        }
+        literal[len++] = code->cs ? c : ascii_tolower(c);
+    }
+
+    if (start && stop) {
+        code->kind = REGEXP_KIND_EXACT;
+    } else if (start) {
+        code->kind = REGEXP_KIND_PREFIX;
+    } else if (stop) {
+        code->kind = REGEXP_KIND_SUFFIX;
+    } else {
+        code->kind = REGEXP_KIND_SUBSTRING;
+    }
+    if (!code->cs) {
+        code->kind++;
+    }
+    code->literal     = literal;
+    code->literal_len = len;
+    code->memory     += len + 1;
+    return true;
+}
+
+static inline bool regexp_memeq_ci(const char *s, const char *lit, int len)
+{
+    for (int i = 0 ; i < len ; ++i) {
+        if (ascii_tolower(s[i]) != lit[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline bool regexp_memeq(const regexp_code_t *code, const char *s)
+{
+    if (code->cs) {
+        return memcmp(s, code->literal, code->literal_len) == 0;
+    }
+    return regexp_memeq_ci(s, code->literal, code->literal_len);
+}
+
+/** Find the literal anywhere in the string. Candidates are located with
+ * memchr on the first character (in both cases if the literal is case
+ * insensitive), and checked with memcmp.
+ */
+static const char *regexp_literal_find(const regexp_code_t *code,
+                                       const char *s, const char *end)
+{
+    const int len = code->literal_len;
+    int first, other;
+
+    if (len == 0) {
+        return s;
+    }
+    first = code->literal[0];
+    other = code->cs ? first : ascii_toupper(first);
+    end  -= len - 1;
+    while (s < end) {
+        const char *pos = memchr(s, first, end - s);
+
+        if (other != first) {
+            const char *up = memchr(s, other, (pos ? pos : end) - s);
+            if (up != NULL) {
+                pos = up;
+            }
+        }
+        if (pos == NULL) {
+            return NULL;
+        }
+        if (regexp_memeq(code, pos)) {
+            return pos;
+        }
+        s = pos + 1;
+    }
+    return NULL;
+}
+
+/** Match a literal pattern. As in the engine, '$' matches at the end of the
+ * string or before a final newline.
+ *
+ * \return the start of the matched literal, NULL if it does not match.
+ */
+static const char *regexp_literal_match(const regexp_code_t *code,
+                                        const clstr_t *str)
+{
+    const int len = code->literal_len;
+    ssize_t slen  = str->len;
+
+    switch (code->kind) {
+      case REGEXP_KIND_EXACT:
+      case REGEXP_KIND_EXACT_CI:
+        if (slen == len + 1 && str->str[len] == '\n') {
+            --slen;
+        }
+        return slen == len && regexp_memeq(code, str->str) ? str->str : NULL;
+
+      case REGEXP_KIND_PREFIX:
+      case REGEXP_KIND_PREFIX_CI:
+        return slen >= len && regexp_memeq(code, str->str) ? str->str : NULL;
+
+      case REGEXP_KIND_SUFFIX:
+      case REGEXP_KIND_SUFFIX_CI:
+        /* The engine reports the leftmost match: before the final newline
+         * first.
+         */
+        if (slen > len && str->str[slen - 1] == '\n'
+        &&  regexp_memeq(code, str->str + slen - 1 - len)) {
+            return str->str + slen - 1 - len;
+        }
+        if (slen >= len && regexp_memeq(code, str->str + slen - len)) {
+            return str->str + slen - len;
+        }
+        return NULL;
+
+      default:
+        return regexp_literal_find(code, str->str, str->str + slen);
+    }
+}
+
+
+/* Compiled code management {{{1
+ */
+
+/** Select the DFA for the patterns in its subset.
+ */
+static bool regexp_code_dfa(regexp_code_t *code)
+{
+    code->dfa = regexp_dfa_new(code->source, code->len, code->cs);
+    if (code->dfa == NULL) {
+        return false;
+    }
+    code->kind     = REGEXP_KIND_DFA;
+    code->captures = regexp_dfa_captures(code->dfa);
+    code->memory  += regexp_dfa_memory(code->dfa);
+    return true;
+}
+
+static uint32_t regexp_hash(const clstr_t *str, bool cs)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261U;
+    for (ssize_t i = 0 ; i < str->len ; ++i) {
+        hash = (hash ^ (uint8_t)str->str[i]) * 16777619U;
+    }
+    return cs ? hash : ~hash;
+}
+
+static void regexp_error_log(const regexp_error_t *error)
+{
+    err("cannot compile regexp: %s (at %d)", error->msg, error->offset);
+}
+
+static void regexp_code_release(regexp_code_t **code);
+static bool regexp_cache_thaw(regexp_code_t *code);
+
+/** Allocate a code in pending state. The code is not registered yet
+ * (\ref regexp_code_register).
+ */
+static regexp_code_t *regexp_code_alloc(const clstr_t *str, bool cs,
+                                        uint32_t hash)
+{
+    regexp_code_t *code = xmalloc(ssizeof(regexp_code_t) + str->len + 1);
+
+    p_clear(code, 1);
+    code->refcount = 1;
+    code->state    = REGEXP_CODE_PENDING;
+    code->cs       = cs;
+    code->hash     = hash;
+    code->len      = str->len;
+    memcpy(code->source, str->str, str->len);
+    code->source[str->len] = '\0';
+    code->memory   = sizeof(regexp_code_t) + str->len + 1;
+    return code;
+}
+
+/** Add a new code to the live codes. Must be called with the lock held.
+ */
+static void regexp_code_register(regexp_code_t *code)
+{
+    code->live_next   = _G.live;
+    code->live_pprev  = &_G.live;
+    if (_G.live != NULL) {
+        _G.live->live_pprev = &code->live_next;
+    }
+    _G.live = code;
+    _G.stats.regexps++;
+    _G.stats.pending++;
+    _G.stats.memory += code->memory;
+}
+
+/** Compile a pending code. Must be called with build_lock held, or on a
+ * code that is not shared yet.
+ */
+static bool regexp_code_compile(regexp_code_t *code, regexp_error_t *error)
+{
+    uint64_t start  = regexp_now_nsec();
+    size_t   memory = code->memory;
+    bool     literal = regexp_code_classify(code);
+    bool     dfa    = !literal && regexp_code_dfa(code);
+    bool     cached = !literal && !dfa && regexp_cache_thaw(code);
+    bool     ok     = literal || dfa || cached
+                   || regexp_code_build(code, error);
+
+    pthread_mutex_lock(&_G.lock);
+    _G.stats.pending--;
+    if (ok) {
+        if (cached) {
+            _G.stats.cache_hits++;
+        } else {
+            _G.stats.compiled++;
+        }
+        _G.stats.compile_usec += (regexp_now_nsec() - start) / 1000;
+        _G.stats.memory       += code->memory - memory;
+    }
+    pthread_mutex_unlock(&_G.lock);
+    code->engine = ok && code->kind == REGEXP_KIND_PCRE;
+    __atomic_store_n(&code->state,
+                     ok ? REGEXP_CODE_READY : REGEXP_CODE_FAILED,
+                     __ATOMIC_RELEASE);
+    return ok;
+}
+
+static regexp_code_t *regexp_code_new(const clstr_t *str, bool cs,
+                                      regexp_error_t *error)
+{
+    regexp_code_t *code = regexp_code_alloc(str, cs, regexp_hash(str, cs));
+
+    pthread_mutex_lock(&_G.lock);
+    regexp_code_register(code);
+    pthread_mutex_unlock(&_G.lock);
+    if (!regexp_code_compile(code, error)) {
+        regexp_code_release(&code);
+        return NULL;
+    }
+    return code;
+}
+
+/** Ensure a code is compiled, compiling it if it is still pending. The
+ * compilation errors of lazy regexps are logged once, by the thread that
+ * tried to compile them.
+ */
+static bool regexp_code_ensure_slow(regexp_code_t *code)
+{
+    int state;
+
+    pthread_mutex_lock(&_G.build_lock);
+    state = __atomic_load_n(&code->state, __ATOMIC_ACQUIRE);
+    if (state == REGEXP_CODE_PENDING) {
+        regexp_error_t error;
+
+        if (regexp_code_compile(code, &error)) {
+            state = REGEXP_CODE_READY;
+        } else {
+            regexp_error_log(&error);
+            state = REGEXP_CODE_FAILED;
+        }
+    }
+    pthread_mutex_unlock(&_G.build_lock);
+    return state == REGEXP_CODE_READY;
+}
+
+static inline bool regexp_code_ensure(regexp_code_t *code)
+{
+    int state = __atomic_load_n(&code->state, __ATOMIC_ACQUIRE);
+
+    if (likely(state == REGEXP_CODE_READY)) {
+        return true;
+    }
+    if (state == REGEXP_CODE_FAILED) {
+        return false;
+    }
+    return regexp_code_ensure_slow(code);
+}
+
+/** Ensure a code is compiled, as \ref regexp_code_ensure, but report the
+ * compilation error to the caller instead of logging it. The error of a
+ * code that already failed to compile is rebuilt.
+ */
+static bool regexp_code_ensure_error(regexp_code_t *code,
+                                     regexp_error_t *error)
+{
+    int state = __atomic_load_n(&code->state, __ATOMIC_ACQUIRE);
+
+    if (state == REGEXP_CODE_PENDING) {
+        pthread_mutex_lock(&_G.build_lock);
+        state = __atomic_load_n(&code->state, __ATOMIC_ACQUIRE);
+        if (state == REGEXP_CODE_PENDING) {
+            bool ok = regexp_code_compile(code, error);
+
+            pthread_mutex_unlock(&_G.build_lock);
+            return ok;
+        }
+        pthread_mutex_unlock(&_G.build_lock);
+    }
+    if (state == REGEXP_CODE_FAILED) {
+        const clstr_t source = { code->source, code->len };
+        regexp_code_t *tmp = regexp_code_alloc(&source, code->cs, code->hash);
+
+        if (regexp_code_build(tmp, error)) {
+            regexp_code_unbuild(tmp);
+        }
+        p_delete(&tmp);
+        return false;
+    }
+    return true;
+}
+
+/** Ensure the engine code of a ready code is built: the patterns matched
+ * by the DFA only build it when their captures are needed.
+ */
+static bool regexp_code_ensure_engine(regexp_code_t *code)
+{
+    if (likely(__atomic_load_n(&code->engine, __ATOMIC_ACQUIRE))) {
+        return true;
+    }
+    if (code->kind != REGEXP_KIND_DFA) {
+        return false;
+    }
+    pthread_mutex_lock(&_G.build_lock);
+    if (!code->engine) {
+        regexp_error_t error;
+        size_t memory = code->memory;
+
+        if (regexp_code_build(code, &error)) {
+            pthread_mutex_lock(&_G.lock);
+            _G.stats.compiled++;
+            _G.stats.memory += code->memory - memory;
+            pthread_mutex_unlock(&_G.lock);
+            __atomic_store_n(&code->engine, true, __ATOMIC_RELEASE);
+        } else {
+            regexp_error_log(&error);
+        }
+    }
+    pthread_mutex_unlock(&_G.build_lock);
+    return code->engine;
+}
+
+/** Must be called with the lock held.
+ */
+static regexp_code_t **regexp_code_find(const clstr_t *str, bool cs,
+                                        uint32_t hash)
+{
+    regexp_code_t **code;
+
+    if (_G.buckets_len == 0) {
+        return NULL;
+    }
+    code = &_G.buckets[hash & (_G.buckets_len - 1)];
+    while (*code != NULL) {
+        if ((*code)->hash == hash && (*code)->cs == cs
+            && (*code)->len == str->len
+            && memcmp((*code)->source, str->str, str->len) == 0) {
+            return code;
+        }
+        code = &(*code)->next;
+    }
+    return code;
+}
+
+/** Must be called with the lock held.
+ */
+static void regexp_code_insert(regexp_code_t *code)
+{
+    regexp_code_t **bucket;
+
+    if (_G.stats.interned >= _G.buckets_len) {
+        uint32_t len = MAX(2 * _G.buckets_len, 64);
+        regexp_code_t **buckets = p_new(regexp_code_t *, len);
+
+        for (uint32_t i = 0 ; i < _G.buckets_len ; ++i) {
+            regexp_code_t *c = _G.buckets[i];
+            while (c != NULL) {
+                regexp_code_t *next = c->next;
+                c->next = buckets[c->hash & (len - 1)];
+                buckets[c->hash & (len - 1)] = c;
+                c = next;
+            }
+        }
+        p_delete(&_G.buckets);
+        _G.buckets     = buckets;
+        _G.buckets_len = len;
+    }
+    bucket = &_G.buckets[code->hash & (_G.buckets_len - 1)];
+    code->next     = *bucket;
+    code->interned = true;
+    *bucket = code;
+    _G.stats.interned++;
+}
+
+static void regexp_code_release(regexp_code_t **code)
+{
+    if (*code == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&_G.lock);
+    if (--(*code)->refcount > 0) {
+        pthread_mutex_unlock(&_G.lock);
+        *code = NULL;
+        return;
+    }
+    if ((*code)->interned) {
+        const clstr_t source = { (*code)->source, (*code)->len };
+        regexp_code_t **pos = regexp_code_find(&source, (*code)->cs,
+                                               (*code)->hash);
+        assert (pos != NULL && *pos == *code);
+        *pos = (*code)->next;
+        _G.stats.interned--;
+    }
+    if ((*code)->state == REGEXP_CODE_PENDING) {
+        _G.stats.pending--;
+    }
+    *(*code)->live_pprev = (*code)->live_next;
+    if ((*code)->live_next != NULL) {
+        (*code)->live_next->live_pprev = (*code)->live_pprev;
+    }
+    _G.stats.regexps--;
+    _G.stats.memory -= (*code)->memory;
+    pthread_mutex_unlock(&_G.lock);
+
+    regexp_code_unbuild(*code);
+    regexp_dfa_delete(&(*code)->dfa);
+    p_delete(&(*code)->literal);
+    p_delete(code);
+}
+
+
+/* Public API {{{1
+ */
+
+/** Give a new regexp the default limits (\ref regexp_set_default_limits).
+ */
+static void regexp_init_limits(regexp_t *re)
+{
+    pthread_mutex_lock(&_G.lock);
+    re->match_limit = _G.match_limit;
+    re->depth_limit = _G.depth_limit;
+    pthread_mutex_unlock(&_G.lock);
+}
 
 regexp_t *regexp_new(void)
 {
@@ -42,8 +1109,7 @@ regexp_t *regexp_new(void)
 
 void regexp_wipe(regexp_t *re)
 {
-    pcre_free(re->re);
-    pcre_free(re->extra);
+    regexp_code_release(&re->code);
 }
 
 void regexp_delete(regexp_t **re)
@@ -54,43 +1120,586 @@ void regexp_delete(regexp_t **re)
     }
 }
 
+bool regexp_compile_str(regexp_t *re, const clstr_t *str, bool cs)
+{
+    regexp_error_t error;
+
+    regexp_init_limits(re);
+    re->code = regexp_code_new(str, cs, &error);
+    if (re->code == NULL) {
+        regexp_error_log(&error);
+        return false;
+    }
+    return true;
+}
+
 bool regexp_compile(regexp_t *re, const char *str, bool cs)
 {
-    const char *error = NULL;
-    int erroffset = 0;
+    clstr_t s = { str, m_strlen(str) };
+    return regexp_compile_str(re, &s, cs);
+}
+
+static bool regexp_intern_aux(regexp_t *re, const clstr_t *str, bool cs,
+                              bool lazy, regexp_error_t *error)
+{
+    const uint32_t hash = regexp_hash(str, cs);
+    regexp_code_t **pos;
+    regexp_code_t *code;
 
-    int flags = (cs ? 0 : PCRE_CASELESS);
+    regexp_init_limits(re);
+    pthread_mutex_lock(&_G.lock);
+    pos = regexp_code_find(str, cs, hash);
+    if (pos != NULL && *pos != NULL) {
+        (*pos)->refcount++;
+        _G.stats.intern_hits++;
+        re->code = *pos;
+        pthread_mutex_unlock(&_G.lock);
+
+        /* The pattern may have been interned lazily: an eager intern must
+         * compile it, and fail if it does not compile.
+         */
+        if (!lazy && !regexp_code_ensure_error(re->code, error)) {
+            regexp_code_release(&re->code);
+            return false;
+        }
+        return true;
+    }
+    if (lazy) {
+        /* Nothing to compile: the pattern is only copied in the new code,
+         * inserted before the lock is released.
+         */
+        code = regexp_code_alloc(str, cs, hash);
+        regexp_code_register(code);
+        regexp_code_insert(code);
+        re->code = code;
+        pthread_mutex_unlock(&_G.lock);
+        return true;
+    }
+    pthread_mutex_unlock(&_G.lock);
 
-    debug("compiling regexp: %s", str);
-    re->re = pcre_compile(str, flags, &error, &erroffset, NULL);
-    if (re->re == NULL) {
-        err("cannot compile regexp: %s (at %d)", error, erroffset);
+    /* Compile without holding the lock, another thread may have interned
+     * the same pattern in the meantime.
+     */
+    code = regexp_code_new(str, cs, error);
+    if (code == NULL) {
         return false;
     }
-    re->extra = pcre_study(re->re, 0, &error);
-    if (re->extra == NULL && error != NULL) {
-        warn("regexp inspection failed: %s", error);
+    pthread_mutex_lock(&_G.lock);
+    pos = regexp_code_find(str, cs, hash);
+    if (pos != NULL && *pos != NULL) {
+        (*pos)->refcount++;
+        _G.stats.intern_hits++;
+        re->code = *pos;
+        pthread_mutex_unlock(&_G.lock);
+        regexp_code_release(&code);
+        return true;
     }
+    regexp_code_insert(code);
+    re->code = code;
+    pthread_mutex_unlock(&_G.lock);
     return true;
 }
 
-bool regexp_compile_str(regexp_t *re, const clstr_t *str, bool cs)
+bool regexp_intern_str(regexp_t *re, const clstr_t *str, bool cs)
+{
+    regexp_error_t error;
+
+    if (!regexp_intern_aux(re, str, cs, false, &error)) {
+        regexp_error_log(&error);
+        return false;
+    }
+    return true;
+}
+
+bool regexp_intern(regexp_t *re, const char *str, bool cs)
+{
+    clstr_t s = { str, m_strlen(str) };
+    return regexp_intern_str(re, &s, cs);
+}
+
+void regexp_intern_lazy_str(regexp_t *re, const clstr_t *str, bool cs)
+{
+    regexp_intern_aux(re, str, cs, true, NULL);
+}
+
+void regexp_intern_lazy(regexp_t *re, const char *str, bool cs)
+{
+    clstr_t s = { str, m_strlen(str) };
+    regexp_intern_lazy_str(re, &s, cs);
+}
+
+
+/* Bulk compilation {{{1
+ */
+
+/* Below this number of regexps, the bulk compilation is done in the
+ * calling thread.
+ */
+#define REGEXP_BULK_MIN_PER_THREAD  32
+#define REGEXP_BULK_MAX_THREADS     16
+
+typedef struct regexp_bulk_t {
+    regexp_t        *res;
+    const clstr_t   *regexps;
+    regexp_error_t **errors;
+    int   len;
+    bool  cs;
+    bool  intern;
+
+    int   next;
+} regexp_bulk_t;
+
+static void *regexp_bulk_worker(void *data)
+{
+    regexp_bulk_t *bulk = data;
+    regexp_error_t error;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&bulk->next, 1)) < bulk->len) {
+        bool ok;
+
+        if (bulk->intern) {
+            ok = regexp_intern_aux(&bulk->res[i], &bulk->regexps[i],
+                                   bulk->cs, false, &error);
+        } else {
+            regexp_init_limits(&bulk->res[i]);
+            bulk->res[i].code = regexp_code_new(&bulk->regexps[i], bulk->cs,
+                                                &error);
+            ok = bulk->res[i].code != NULL;
+        }
+        if (!ok) {
+            bulk->res[i].code = NULL;
+            bulk->errors[i] = p_dup(&error, 1);
+        }
+    }
+    return NULL;
+}
+
+int regexp_compile_many(regexp_t *res, const clstr_t *regexps, int len,
+                        bool cs, bool intern)
+{
+    regexp_bulk_t bulk = {
+        .res     = res,
+        .regexps = regexps,
+        .errors  = p_new(regexp_error_t *, len),
+        .len     = len,
+        .cs      = cs,
+        .intern  = intern,
+    };
+    pthread_t threads[REGEXP_BULK_MAX_THREADS];
+    int threads_len = sysconf(_SC_NPROCESSORS_ONLN);
+    int failures = 0;
+
+    threads_len = MIN(threads_len, len / REGEXP_BULK_MIN_PER_THREAD);
+    threads_len = MIN(threads_len, REGEXP_BULK_MAX_THREADS);
+
+    /* The calling thread is a worker too: a pool of threads_len workers
+     * requires threads_len - 1 new threads.
+     */
+    for (int i = 0 ; i < threads_len - 1 ; ++i) {
+        if (pthread_create(&threads[i], NULL, regexp_bulk_worker,
+                           &bulk) != 0) {
+            UNIXERR("pthread_create");
+            threads_len = i + 1;
+            break;
+        }
+    }
+    regexp_bulk_worker(&bulk);
+    for (int i = 0 ; i < threads_len - 1 ; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* Report the errors in the order of the input.
+     */
+    for (int i = 0 ; i < len ; ++i) {
+        if (bulk.errors[i] != NULL) {
+            regexp_error_log(bulk.errors[i]);
+            p_delete(&bulk.errors[i]);
+            ++failures;
+        }
+    }
+    p_delete(&bulk.errors);
+    return failures;
+}
+
+
+/* Lazy compilation {{{1
+ */
+
+void regexp_warmup(void)
+{
+    regexp_code_t **codes;
+    uint32_t len = 0;
+
+    /* Take a reference on the pending codes, so that they can be compiled
+     * without holding the table lock.
+     */
+    pthread_mutex_lock(&_G.lock);
+    codes = p_new(regexp_code_t *, _G.stats.pending + 1);
+    for (uint32_t i = 0 ; i < _G.buckets_len ; ++i) {
+        for (regexp_code_t *code = _G.buckets[i] ; code ; code = code->next) {
+            if (len <= _G.stats.pending
+            &&  __atomic_load_n(&code->state, __ATOMIC_RELAXED)
+                == REGEXP_CODE_PENDING) {
+                code->refcount++;
+                codes[len++] = code;
+            }
+        }
+    }
+    pthread_mutex_unlock(&_G.lock);
+
+    debug("warming up %u lazy regexps", len);
+    for (uint32_t i = 0 ; i < len ; ++i) {
+        if (!__atomic_load_n(&_G.warmup_stop, __ATOMIC_RELAXED)) {
+            regexp_code_ensure(codes[i]);
+        }
+        regexp_code_release(&codes[i]);
+    }
+    p_delete(&codes);
+}
+
+static void *regexp_warmup_thread(void *data)
+{
+    regexp_warmup();
+    return NULL;
+}
+
+bool regexp_warmup_start(void)
+{
+    if (_G.warmup_running) {
+        return true;
+    }
+    _G.warmup_stop = false;
+    if (pthread_create(&_G.warmup, NULL, regexp_warmup_thread, NULL) != 0) {
+        UNIXERR("pthread_create");
+        return false;
+    }
+    _G.warmup_running = true;
+    return true;
+}
+
+void regexp_warmup_wait(void)
+{
+    if (_G.warmup_running) {
+        pthread_join(_G.warmup, NULL);
+        _G.warmup_running = false;
+    }
+}
+
+
+/* Cache {{{1
+ */
+
+#define REGEXP_CACHE_MAGIC    "pfxre\0\0"
+#define REGEXP_CACHE_VERSION  1
+#define REGEXP_CACHE_ALIGN(x) (((x) + 7) & ~7)
+
+/* A cache file is a header followed by the entries. Each entry is 8-byte
+ * aligned, and holds the NUL-terminated source of a regexp followed by its
+ * compiled code (8-byte aligned too) in the format of the engine.
+ */
+typedef struct regexp_cache_header_t {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+    char     engine[64];
+} regexp_cache_header_t;
+
+typedef struct regexp_cache_entry_t {
+    uint32_t hash;
+    uint32_t len;
+    uint32_t code_len;
+    uint8_t  cs;
+    uint8_t  padding[3];
+    char     source[];
+} regexp_cache_entry_t;
+
+typedef const regexp_cache_entry_t *regexp_cache_ref_t;
+
+static inline const char *regexp_cache_code(const regexp_cache_entry_t *entry)
+{
+    return (const char *)entry
+         + REGEXP_CACHE_ALIGN(sizeof(*entry) + entry->len + 1);
+}
+
+/** Identify the engine that produced a cache: the compiled code can only
+ * be reused by the same version of the library on the same architecture.
+ */
+static void regexp_cache_engine(char *buf, int size)
+{
+    char engine[48];
+
+    regexp_engine_id(engine, sizeof(engine));
+    snprintf(buf, size, "%s/%d/%s", engine, (int)sizeof(void *),
+             __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? "le" : "be");
+}
+
+/** Load the code of a regexp from the cache.
+ */
+static bool regexp_cache_thaw(regexp_code_t *code)
+{
+    uint32_t low = 0, high = _G.cache_len;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (_G.cache[mid]->hash < code->hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (; low < _G.cache_len && _G.cache[low]->hash == code->hash ; ++low) {
+        const regexp_cache_entry_t *entry = _G.cache[low];
+
+        if (entry->cs == code->cs && (ssize_t)entry->len == code->len
+        &&  memcmp(entry->source, code->source, code->len) == 0) {
+            if (!regexp_code_thaw(code, regexp_cache_code(entry),
+                                  entry->code_len)) {
+                debug("cannot load regexp from the cache: %s",
+                      code->source);
+                return false;
+            }
+            debug("regexp loaded from the cache: %s", code->source);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool regexp_cache_load(const char *file)
+{
+    const regexp_cache_header_t *header;
+    const char *pos;
+    char engine[64];
+
+    regexp_cache_close();
+    if (access(file, R_OK) != 0) {
+        debug("no regexp cache in %s", file);
+        return false;
+    }
+    if (!file_map_open(&_G.cache_map, file, false)) {
+        return false;
+    }
+    header = (const regexp_cache_header_t *)_G.cache_map.map;
+    pos    = _G.cache_map.map + sizeof(*header);
+    if (pos > _G.cache_map.end
+    ||  memcmp(header->magic, REGEXP_CACHE_MAGIC, sizeof(header->magic)) != 0
+    ||  header->version != REGEXP_CACHE_VERSION) {
+        warn("%s: not a regexp cache, ignored", file);
+        goto error;
+    }
+    regexp_cache_engine(engine, sizeof(engine));
+    if (strncmp(header->engine, engine, sizeof(engine)) != 0) {
+        notice("%s: regexp cache built for %.*s, ignored", file,
+               (int)sizeof(header->engine), header->engine);
+        goto error;
+    }
+
+    /* Check the count against the size of the file before trusting it
+     * for an allocation: each entry takes more than its header.
+     */
+    if (header->count
+        > (_G.cache_map.end - pos) / sizeof(regexp_cache_entry_t)) {
+        warn("%s: truncated regexp cache, ignored", file);
+        goto error;
+    }
+    _G.cache = p_new(regexp_cache_ref_t, header->count);
+    for (uint32_t i = 0 ; i < header->count ; ++i) {
+        const regexp_cache_entry_t *entry = (const void *)pos;
+
+        if (_G.cache_map.end - pos < ssizeof(*entry)
+        ||  _G.cache_map.end - pos - ssizeof(*entry) <= entry->len
+        ||  _G.cache_map.end - regexp_cache_code(entry) < entry->code_len) {
+            warn("%s: truncated regexp cache, ignored", file);
+            goto error;
+        }
+        _G.cache[_G.cache_len++] = entry;
+        pos = regexp_cache_code(entry) + REGEXP_CACHE_ALIGN(entry->code_len);
+    }
+
+    /* A cache saved without any regexp is valid, and qsort.c does not
+     * support 0 elements.
+     */
+    if (_G.cache_len > 0) {
+#       define QSORT_TYPE regexp_cache_ref_t
+#       define QSORT_BASE _G.cache
+#       define QSORT_NELT _G.cache_len
+#       define QSORT_LT(a,b) (*(a))->hash < (*(b))->hash
+#       include "qsort.c"
+#       undef QSORT_TYPE
+#       undef QSORT_BASE
+#       undef QSORT_NELT
+#       undef QSORT_LT
+    }
+    info("%s: %u compiled regexps in the cache", file, _G.cache_len);
+    return true;
+
+  error:
+    regexp_cache_close();
+    return false;
+}
+
+void regexp_cache_close(void)
+{
+    p_delete(&_G.cache);
+    _G.cache_len = 0;
+    file_map_close(&_G.cache_map);
+}
+
+bool regexp_cache_save(const char *file)
+{
+    regexp_cache_header_t header;
+    buffer_t buf = BUFFER_INIT;
+    char tmp[PATH_MAX];
+    bool ok = false;
+    int fd;
+
+    p_clear(&header, 1);
+    memcpy(header.magic, REGEXP_CACHE_MAGIC, sizeof(header.magic));
+    header.version = REGEXP_CACHE_VERSION;
+    regexp_cache_engine(header.engine, sizeof(header.engine));
+    buffer_add(&buf, &header, sizeof(header));
+
+    pthread_mutex_lock(&_G.lock);
+    for (uint32_t i = 0 ; i < _G.buckets_len ; ++i) {
+        for (regexp_code_t *code = _G.buckets[i] ; code ; code = code->next) {
+            regexp_cache_entry_t entry;
+            int entry_pos = buf.len, code_pos;
+
+            if (__atomic_load_n(&code->state, __ATOMIC_ACQUIRE)
+                != REGEXP_CODE_READY || code->kind != REGEXP_KIND_PCRE) {
+                continue;
+            }
+            p_clear(&entry, 1);
+            entry.hash = code->hash;
+            entry.len  = code->len;
+            entry.cs   = code->cs;
+            buffer_add(&buf, &entry, sizeof(entry));
+            buffer_add(&buf, code->source, code->len + 1);
+            buffer_extendch(&buf, REGEXP_CACHE_ALIGN(buf.len) - buf.len, 0);
+
+            code_pos = buf.len;
+            if (!regexp_code_freeze(code, &buf)) {
+                buf.len = entry_pos;
+                continue;
+            }
+            ((regexp_cache_entry_t *)(buf.data + entry_pos))->code_len
+                = buf.len - code_pos;
+            buffer_extendch(&buf, REGEXP_CACHE_ALIGN(buf.len) - buf.len, 0);
+            ((regexp_cache_header_t *)buf.data)->count++;
+        }
+    }
+    pthread_mutex_unlock(&_G.lock);
+
+    /* Write a temporary file, and move it over the cache, so that the cache
+     * is never seen partially written.
+     */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        UNIXERR("open");
+    } else {
+        if (xwrite(fd, buf.data, buf.len) < 0) {
+            UNIXERR("write");
+        } else if (rename(tmp, file) < 0) {
+            UNIXERR("rename");
+        } else {
+            ok = true;
+        }
+        close(fd);
+        if (!ok) {
+            unlink(tmp);
+        }
+    }
+    buffer_wipe(&buf);
+    return ok;
+}
+
+
+/* Matching {{{1
+ */
+
+static inline void regexp_count_match(int kind)
+{
+    regexp_counters_t *counters = regexp_counters_g;
+
+    if (unlikely(counters == NULL)) {
+        counters = regexp_counters_g = p_new(regexp_counters_t, 1);
+        pthread_mutex_lock(&_G.lock);
+        counters->next = _G.counters;
+        _G.counters    = counters;
+        pthread_mutex_unlock(&_G.lock);
+    }
+    __atomic_store_n(&counters->matches[kind], counters->matches[kind] + 1,
+                     __ATOMIC_RELAXED);
+}
+
+static void regexp_profile(regexp_code_t *code, uint64_t start)
+{
+    uint64_t elapsed = regexp_now_nsec() - start;
+    uint64_t max = __atomic_load_n(&code->max_nsec, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&code->executions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&code->total_nsec, elapsed, __ATOMIC_RELAXED);
+    while (elapsed > max
+    &&  !__atomic_compare_exchange_n(&code->max_nsec, &max, elapsed, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/** Run a regexp, through the engine, the DFA or the literal matcher. The
+ * DFA rejects the strings that do not match before the engine extracts
+ * the captures.
+ */
+static inline bool regexp_exec(const regexp_t *re, const clstr_t *str,
+                               clstr_t *captures, int count)
 {
-    if (str->str[str->len] == '\0') {
-        return regexp_compile(re, str->str, cs);
+    regexp_code_t *code = re->code;
+    uint64_t start = 0;
+    int res;
+
+    regexp_count_match(code->kind);
+    if (unlikely(__atomic_load_n(&_G.profiling, __ATOMIC_RELAXED))) {
+        start = regexp_now_nsec();
+    }
+    if (code->kind == REGEXP_KIND_PCRE) {
+        res = regexp_code_exec(re, str, captures, count);
+    } else if (code->kind == REGEXP_KIND_DFA) {
+        if (!regexp_dfa_match(code->dfa, str->str, str->len)) {
+            res = REGEXP_EXEC_NOMATCH;
+        } else if (captures == NULL) {
+            res = REGEXP_EXEC_MATCH;
+        } else if (regexp_code_ensure_engine(code)) {
+            res = regexp_code_exec(re, str, captures, count);
+        } else {
+            res = REGEXP_EXEC_NOMATCH;
+        }
     } else {
-        // TODO: Use a buffer to avoid stupid allocations
-        char *cpy = p_dupstr(str->str, str->len);
-        bool ok = regexp_compile(re, cpy, cs);
-        p_delete(&cpy);
-        return ok;
+        const char *pos = regexp_literal_match(code, str);
+
+        res = pos ? REGEXP_EXEC_MATCH : REGEXP_EXEC_NOMATCH;
+        if (pos != NULL && captures != NULL) {
+            captures[0].str = pos;
+            captures[0].len = code->literal_len;
+        }
+    }
+    if (unlikely(start != 0)) {
+        regexp_profile(code, start);
+    }
+    if (unlikely(res == REGEXP_EXEC_LIMIT)) {
+        __atomic_fetch_add(&code->limit_hits, 1, __ATOMIC_RELAXED);
+        debug("regexp execution limit reached: %s", code->source);
+        return false;
     }
+    return res == REGEXP_EXEC_MATCH;
 }
 
 bool regexp_match_str(const regexp_t *re, const clstr_t *str)
 {
-    return 0 == pcre_exec(re->re, re->extra, str->str, str->len,
-                          0, 0, NULL, 0);
+    if (unlikely(!regexp_code_ensure(re->code))) {
+        return false;
+    }
+    return regexp_exec(re, str, NULL, 0);
 }
 
 bool regexp_match(const regexp_t *re, const char *str)
@@ -99,6 +1708,153 @@ bool regexp_match(const regexp_t *re, const char *str)
     return regexp_match_str(re, &s);
 }
 
+int regexp_exec_captures(const regexp_t *re, const clstr_t *str,
+                         clstr_t *captures, int count)
+{
+    regexp_code_t *code = re->code;
+
+    assert (count > 0);
+    if (unlikely(!regexp_code_ensure(code))) {
+        return 0;
+    }
+    count = MIN(count, code->captures + 1);
+    if (!regexp_exec(re, str, captures, count)) {
+        return 0;
+    }
+    return count;
+}
+
+int regexp_capture_count(const regexp_t *re)
+{
+    if (!regexp_code_ensure(re->code)) {
+        return 0;
+    }
+    return re->code->captures;
+}
+
+int regexp_capture_index(const regexp_t *re, const char *name)
+{
+    int index;
+
+    /* The subset of the DFA has no named group */
+    if (!regexp_code_ensure(re->code) || re->code->kind != REGEXP_KIND_PCRE) {
+        return -1;
+    }
+#ifdef HAVE_PCRE2
+    index = pcre2_substring_number_from_name(re->code->re, (PCRE2_SPTR)name);
+#else
+    index = pcre_get_stringnumber(re->code->re, name);
+#endif
+    return index > 0 ? index : -1;
+}
+
+void regexp_get_stats(regexp_stats_t *stats)
+{
+    pthread_mutex_lock(&_G.lock);
+    *stats = _G.stats;
+    for (int i = 0 ; i < REGEXP_KIND_count ; ++i) {
+        stats->matches[i] = _G.retired_matches[i];
+        for (regexp_counters_t *c = _G.counters ; c ; c = c->next) {
+            stats->matches[i] += __atomic_load_n(&c->matches[i],
+                                                 __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&_G.lock);
+}
+
+
+/* Limits and profiling {{{1
+ */
+
+void regexp_set_limits(regexp_t *re, uint32_t match_limit,
+                       uint32_t depth_limit)
+{
+    re->match_limit = match_limit;
+    re->depth_limit = depth_limit;
+}
+
+void regexp_set_default_limits(uint32_t match_limit, uint32_t depth_limit)
+{
+    pthread_mutex_lock(&_G.lock);
+    _G.match_limit = match_limit;
+    _G.depth_limit = depth_limit;
+    pthread_mutex_unlock(&_G.lock);
+}
+
+void regexp_set_profiling(bool enable)
+{
+    __atomic_store_n(&_G.profiling, enable, __ATOMIC_RELAXED);
+}
+
+void regexp_profile_reset(void)
+{
+    pthread_mutex_lock(&_G.lock);
+    for (regexp_code_t *code = _G.live ; code ; code = code->live_next) {
+        __atomic_store_n(&code->executions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&code->limit_hits, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&code->total_nsec, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&code->max_nsec,   0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&_G.lock);
+}
+
+static inline bool regexp_profile_lt(const regexp_code_t *a,
+                                     const regexp_code_t *b)
+{
+    /* Most expensive first, the patterns reaching the limits on top */
+    if (a->limit_hits != b->limit_hits) {
+        return a->limit_hits > b->limit_hits;
+    }
+    return a->total_nsec > b->total_nsec;
+}
+
+void regexp_profile_dump(buffer_t *out, int count)
+{
+    typedef regexp_code_t *regexp_code_ptr_t;
+    regexp_code_ptr_t *codes;
+    uint32_t len = 0;
+
+    pthread_mutex_lock(&_G.lock);
+    codes = p_new(regexp_code_ptr_t, _G.stats.regexps + 1);
+    for (regexp_code_t *code = _G.live ; code ; code = code->live_next) {
+        if (code->executions != 0 || code->limit_hits != 0) {
+            codes[len++] = code;
+        }
+    }
+    if (len > 1) {
+#       define QSORT_TYPE regexp_code_ptr_t
+#       define QSORT_BASE codes
+#       define QSORT_NELT len
+#       define QSORT_LT(a,b) regexp_profile_lt(*(a), *(b))
+#       include "qsort.c"
+#       undef QSORT_TYPE
+#       undef QSORT_BASE
+#       undef QSORT_NELT
+#       undef QSORT_LT
+    }
+
+    buffer_addf(out, "%10s %12s %10s %10s %8s  %s\n", "calls", "total(ms)",
+                "avg(us)", "max(us)", "limits", "regexp");
+    for (uint32_t i = 0 ; i < len && (int)i < count ; ++i) {
+        const regexp_code_t *code = codes[i];
+
+        buffer_addf(out, "%10llu %12.3f %10.3f %10.3f %8llu  /%s/%s\n",
+                    (unsigned long long)code->executions,
+                    code->total_nsec / 1e6,
+                    code->executions ? code->total_nsec / 1e3
+                                       / code->executions : 0.,
+                    code->max_nsec / 1e3,
+                    (unsigned long long)code->limit_hits,
+                    code->source, code->cs ? "" : "i");
+    }
+    pthread_mutex_unlock(&_G.lock);
+    p_delete(&codes);
+}
+
+
+/* Parsing {{{1
+ */
+
 /** Returns true if the character has a special meaning in regexp when
  * non escaped.
  */
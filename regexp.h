@@ -36,19 +36,62 @@
 #ifndef PFIXTOOLS_REGEXP_H
 #define PFIXTOOLS_REGEXP_H
 
-#include <pcre.h>
+#ifdef HAVE_PCRE2
+#  define PCRE2_CODE_UNIT_WIDTH 8
+#  include <pcre2.h>
+#else
+#  include <pcre.h>
+#endif
 #include "str.h"
 #include "array.h"
 #include "buffer.h"
 
+/* The regexp engine is selected at build time: libpcre2 (with JIT) when
+ * HAVE_PCRE2 is defined (make pcre2=1), legacy libpcre otherwise.
+ */
+typedef struct regexp_code_t regexp_code_t;
+
 struct regexp_t {
-    pcre *re;
-    pcre_extra *extra;
+    regexp_code_t *code;
+    uint32_t match_limit;       /**< 0 for the library default */
+    uint32_t depth_limit;
 };
 
 typedef struct regexp_t regexp_t;
 ARRAY(regexp_t);
 
+/** How a regexp is matched: by the engine, by the built-in DFA when the
+ * pattern is in its subset (\ref regexp_dfa.h), or by a literal comparison
+ * when the pattern has no metacharacter (the _CI kinds are the case
+ * insensitive variants).
+ */
+typedef enum regexp_kind_t {
+    REGEXP_KIND_PCRE,
+    REGEXP_KIND_DFA,
+    REGEXP_KIND_EXACT,          /**< /^literal$/ */
+    REGEXP_KIND_EXACT_CI,
+    REGEXP_KIND_PREFIX,         /**< /^literal/ */
+    REGEXP_KIND_PREFIX_CI,
+    REGEXP_KIND_SUFFIX,         /**< /literal$/ */
+    REGEXP_KIND_SUFFIX_CI,
+    REGEXP_KIND_SUBSTRING,      /**< /literal/ */
+    REGEXP_KIND_SUBSTRING_CI,
+    REGEXP_KIND_count,
+} regexp_kind_t;
+
+typedef struct regexp_stats_t {
+    uint32_t regexps;       /**< compiled regexps currently alive */
+    uint32_t interned;      /**< distinct interned patterns */
+    uint32_t pending;       /**< lazy regexps not compiled yet */
+    uint64_t compiled;      /**< number of compilations */
+    uint64_t intern_hits;   /**< compilations avoided by interning */
+    uint64_t cache_hits;    /**< compilations avoided by the cache */
+    uint64_t compile_usec;  /**< time spent compiling regexps */
+    size_t   memory;        /**< memory used by the compiled regexps */
+
+    uint64_t matches[REGEXP_KIND_count]; /**< match calls per kind */
+} regexp_stats_t;
+
 regexp_t *regexp_new(void);
 void regexp_wipe(regexp_t *re);
 void regexp_delete(regexp_t **re);
@@ -63,6 +106,111 @@ bool regexp_compile_str(regexp_t *re, const clstr_t *str, bool cs);
 __attribute__((nonnull))
 bool regexp_compile(regexp_t *re, const char *str, bool cs);
 
+/** Compile a regexp and fill the @c re structure, sharing the compiled
+ * code with the other interned regexps with the same pattern and flags.
+ *
+ * The compiled code is reference counted, and released by regexp_wipe
+ * when its last user is gone.
+ */
+__attribute__((nonnull))
+bool regexp_intern_str(regexp_t *re, const clstr_t *str, bool cs);
+
+__attribute__((nonnull))
+bool regexp_intern(regexp_t *re, const char *str, bool cs);
+
+/** Intern a regexp without compiling it.
+ *
+ * The regexp is compiled by the first match that reaches it (or by the
+ * warm-up), atomically with respect to the other threads. A regexp that
+ * fails to compile logs the error once and never matches.
+ */
+__attribute__((nonnull))
+void regexp_intern_lazy_str(regexp_t *re, const clstr_t *str, bool cs);
+
+__attribute__((nonnull))
+void regexp_intern_lazy(regexp_t *re, const char *str, bool cs);
+
+/** Compile all the lazy regexps that are still pending.
+ */
+void regexp_warmup(void);
+
+/** Run regexp_warmup in a background thread.
+ * \ref regexp_warmup_wait
+ */
+bool regexp_warmup_start(void);
+
+/** Wait for the end of the background warm-up, if any.
+ */
+void regexp_warmup_wait(void);
+
+/** Match the given string against the regexp, and extract the capture
+ * groups.
+ *
+ * captures[0] is set to the part of the string matched by the whole
+ * regexp, and captures[i] to the part matched by the i-th group. Groups
+ * that did not participate in the match are set to { NULL, 0 }. The slices
+ * point into @c str. The matching data is kept per thread and reused, no
+ * allocation is done once it is large enough.
+ *
+ * \param count number of slices in @c captures (at least 1).
+ * \return the number of slices that were set, 0 if the regexp does not
+ * match.
+ */
+__attribute__((nonnull))
+int regexp_exec_captures(const regexp_t *re, const clstr_t *str,
+                         clstr_t *captures, int count);
+
+/** Number of capture groups of the regexp.
+ */
+__attribute__((nonnull))
+int regexp_capture_count(const regexp_t *re);
+
+/** Get the index of a named capture group, to be resolved once when the
+ * regexp is compiled rather than at each match.
+ *
+ * \return the index of the group, -1 if the regexp has no such group.
+ */
+__attribute__((nonnull))
+int regexp_capture_index(const regexp_t *re, const char *name);
+
+/** Compile a list of regexps on a pool of worker threads.
+ *
+ * res[i] is filled with the compiled regexps[i] whatever the thread that
+ * compiled it. Once all the regexps are processed, the compilation errors
+ * are reported in the order of the input, with the same messages as
+ * regexp_compile. The failed regexps are left empty.
+ *
+ * \param intern if true, the regexps are interned (\ref regexp_intern).
+ * \return the number of regexps that could not be compiled.
+ */
+__attribute__((nonnull))
+int regexp_compile_many(regexp_t *res, const clstr_t *regexps, int len,
+                        bool cs, bool intern);
+
+/** Load a cache of compiled regexps.
+ *
+ * While the cache is loaded, the compilation of a regexp whose pattern and
+ * flags are found in the cache reuses the compiled code instead of
+ * compiling the pattern. A cache built by another version of the library
+ * is ignored, and the regexps are then compiled as usual.
+ *
+ * The cache must be loaded and closed when no regexp is being compiled
+ * (e.g. around the loading of the configuration).
+ *
+ * \return false if no usable cache could be loaded.
+ */
+__attribute__((nonnull))
+bool regexp_cache_load(const char *file);
+
+/** Release the loaded cache.
+ */
+void regexp_cache_close(void);
+
+/** Write the compiled code of the interned regexps in a cache file.
+ */
+__attribute__((nonnull))
+bool regexp_cache_save(const char *file);
+
 /** Match the given string against the regexp.
  */
 __attribute__((nonnull))
@@ -73,6 +221,49 @@ bool regexp_match_str(const regexp_t *re, const clstr_t *str);
 __attribute__((nonnull))
 bool regexp_match(const regexp_t *re, const char *str);
 
+/** Release the per-thread matching resources (JIT stack, match data).
+ * Must be called by threads that ran regexps before they exit.
+ */
+void regexp_thread_wipe(void);
+
+/** Get the memory and compilation statistics of the regexps.
+ */
+__attribute__((nonnull))
+void regexp_get_stats(regexp_stats_t *stats);
+
+/** Bound the cost of the executions of a regexp.
+ *
+ * \param match_limit  maximum number of backtracking steps of a match.
+ * \param depth_limit  maximum depth of the backtracking.
+ *
+ * A limit of 0 stands for the library default. An execution that reaches
+ * a limit does not match, and is counted in the profile of the pattern. The
+ * limits only apply to @c re, not to the other regexps interned with the
+ * same pattern. They must not be changed while another thread matches
+ * with @c re.
+ */
+__attribute__((nonnull))
+void regexp_set_limits(regexp_t *re, uint32_t match_limit,
+                       uint32_t depth_limit);
+
+/** Set the limits of the regexps compiled from now on.
+ */
+void regexp_set_default_limits(uint32_t match_limit, uint32_t depth_limit);
+
+/** Enable the measurement of the execution time of the regexps.
+ */
+void regexp_set_profiling(bool enable);
+
+/** Reset the execution counters of all the regexps.
+ */
+void regexp_profile_reset(void);
+
+/** Dump the profile of the @c count most expensive regexps: the regexps
+ * that reached their limits come first, then by total execution time.
+ */
+__attribute__((nonnull))
+void regexp_profile_dump(buffer_t *out, int count);
+
 /** Parse a string and extract the regexp.
  * The string format must bee /regexp/modifier
  *  * the delimiter can be any character.
@@ -0,0 +1,216 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Check of the cache of compiled regexps: a saved cache is reused by the
+ * compilation, and a missing, truncated or corrupt cache is ignored, the
+ * regexps being compiled as usual.
+ *
+ *     regexp_cache_check
+ */
+
+#include "regexp_check.h"
+#include "file.h"
+
+#define CHECK_PATTERNS  50
+
+/* Layout of the file, see regexp.c */
+#define CHECK_HEADER_COUNT     12
+#define CHECK_HEADER_SIZE      80
+#define CHECK_ENTRY_HASH       (CHECK_HEADER_SIZE + 0)
+#define CHECK_ENTRY_LEN        (CHECK_HEADER_SIZE + 4)
+#define CHECK_ENTRY_CODE_LEN   (CHECK_HEADER_SIZE + 8)
+#define CHECK_ALIGN            8
+
+static char check_file_g[PATH_MAX];
+
+static uint64_t check_cache_hits(void)
+{
+    regexp_stats_t stats;
+
+    regexp_get_stats(&stats);
+    return stats.cache_hits;
+}
+
+static void check_intern(regexp_t res[CHECK_PATTERNS])
+{
+    for (int i = 0 ; i < CHECK_PATTERNS ; ++i) {
+        char pattern[64];
+
+        /* Patterns that are neither literals nor in the subset of the
+         * DFA: they are compiled by the engine, and cached.
+         */
+        snprintf(pattern, sizeof(pattern), "^c%d(?=[a-c])\\w{1,3}$", i);
+        CHECK(regexp_intern(&res[i], pattern, i % 2));
+    }
+}
+
+/** Intern the patterns, check their matches, and release them.
+ * \return the number of patterns found in the cache.
+ */
+static int check_patterns(void)
+{
+    const uint64_t hits = check_cache_hits();
+    regexp_t res[CHECK_PATTERNS];
+
+    check_intern(res);
+    for (int i = 0 ; i < CHECK_PATTERNS ; ++i) {
+        char subject[32];
+
+        snprintf(subject, sizeof(subject), "c%dAb", i);
+        CHECK(regexp_match(&res[i], subject) == !(i % 2));
+        snprintf(subject, sizeof(subject), "c%dab", i);
+        CHECK(regexp_match(&res[i], subject));
+        snprintf(subject, sizeof(subject), "c%dd", i);
+        CHECK(!regexp_match(&res[i], subject));
+        regexp_wipe(&res[i]);
+    }
+    return check_cache_hits() - hits;
+}
+
+static void check_write(const void *data, uint32_t len)
+{
+    int fd = open(check_file_g, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    CHECK(fd >= 0 && xwrite(fd, data, len) == 0);
+    close(fd);
+}
+
+/** Write a copy of the cache with a 32 bits field changed, and load it.
+ * \return the number of patterns found in the cache, -1 if it is ignored.
+ */
+static int check_corrupt(const buffer_t *cache, int offset, uint32_t value)
+{
+    buffer_t copy = BUFFER_INIT;
+    int hits = -1;
+
+    buffer_add(&copy, cache->data, cache->len);
+    memcpy(copy.data + offset, &value, sizeof(value));
+    check_write(copy.data, copy.len);
+    if (regexp_cache_load(check_file_g)) {
+        hits = check_patterns();
+    } else {
+        CHECK(check_patterns() == 0);
+    }
+    regexp_cache_close();
+    buffer_wipe(&copy);
+    return hits;
+}
+
+int main(void)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    buffer_t cache = BUFFER_INIT;
+    regexp_t res[CHECK_PATTERNS];
+    uint32_t count;
+    int fd;
+
+    /* The corrupt caches are reported */
+    log_level = LOG_CRIT;
+
+    snprintf(check_file_g, sizeof(check_file_g), "%s/regexp_cache.XXXXXX",
+             tmpdir ? tmpdir : "/tmp");
+    fd = mkstemp(check_file_g);
+    if (fd < 0) {
+        UNIXERR("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    unlink(check_file_g);
+
+    /* No cache */
+    CHECK(!regexp_cache_load(check_file_g));
+    CHECK(check_patterns() == 0);
+
+    /* Empty cache */
+    CHECK(regexp_cache_save(check_file_g));
+    CHECK(regexp_cache_load(check_file_g));
+    CHECK(check_patterns() == 0);
+    regexp_cache_close();
+
+    /* Round trip */
+    check_intern(res);
+    CHECK(regexp_cache_save(check_file_g));
+    for (int i = 0 ; i < CHECK_PATTERNS ; ++i) {
+        regexp_wipe(&res[i]);
+    }
+    CHECK(regexp_cache_load(check_file_g));
+    CHECK(check_patterns() == CHECK_PATTERNS);
+    regexp_cache_close();
+
+    fd = open(check_file_g, O_RDONLY);
+    CHECK(fd >= 0);
+    while (fd >= 0 && buffer_read(&cache, fd, -1) > 0) {
+    }
+    close(fd);
+    CHECK(cache.len > CHECK_HEADER_SIZE);
+    memcpy(&count, cache.data + CHECK_HEADER_COUNT, sizeof(count));
+    CHECK(count == CHECK_PATTERNS);
+
+    /* Truncated caches: only the padding of the last entry may be lost */
+    for (uint32_t len = 0 ; len < cache.len ; len += len < 512 ? 1 : 13) {
+        check_write(cache.data, len);
+        if (regexp_cache_load(check_file_g)) {
+            CHECK(len > cache.len - CHECK_ALIGN);
+            CHECK(check_patterns() == CHECK_PATTERNS);
+        } else {
+            CHECK(check_patterns() == 0);
+        }
+        regexp_cache_close();
+    }
+
+    /* Corrupt header */
+    CHECK(check_corrupt(&cache, 0, 0x12345678) < 0);
+    CHECK(check_corrupt(&cache, 8, 0xffffffff) < 0);
+    CHECK(check_corrupt(&cache, 16, 0x12345678) < 0);
+    CHECK(check_corrupt(&cache, CHECK_HEADER_COUNT, 0xffffffff) < 0);
+    CHECK(check_corrupt(&cache, CHECK_HEADER_COUNT, count + 1) < 0);
+    CHECK(check_corrupt(&cache, CHECK_HEADER_COUNT, count - 1)
+          == CHECK_PATTERNS - 1);
+
+    /* Corrupt first entry */
+    CHECK(check_corrupt(&cache, CHECK_ENTRY_LEN, 0xffffffff) < 0);
+    CHECK(check_corrupt(&cache, CHECK_ENTRY_LEN, cache.len) < 0);
+    CHECK(check_corrupt(&cache, CHECK_ENTRY_CODE_LEN, 0xffffffff) < 0);
+    CHECK(check_corrupt(&cache, CHECK_ENTRY_CODE_LEN, cache.len) < 0);
+    CHECK(check_corrupt(&cache, CHECK_ENTRY_HASH, 0x12345678)
+          == CHECK_PATTERNS - 1);
+
+    unlink(check_file_g);
+    buffer_wipe(&cache);
+    printf("regexp cache: %d failures\n", check_failures_g);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,295 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Differential check of the capture groups.
+ *
+ * Random patterns with capturing, non-capturing and named groups are
+ * matched against random subjects by regexp_exec_captures and by the PCRE
+ * engine, which must report the same offsets for the whole match and for
+ * each group, whatever the number of slices given by the caller. Some of
+ * the patterns use constructs (back-references, lookaheads) that only the
+ * engine supports, the others are matched by the DFA or as literals. A
+ * mismatch can be replayed with the same arguments:
+ *
+ *     regexp_capture_check [seed [patterns]]
+ */
+
+#include "regexp_check.h"
+
+#define CHECK_SUBJECTS     40
+#define CHECK_SUBJECT_LEN  12
+
+/* Only the first groups fit in the slices compared with the engine */
+#define CHECK_GROUPS       (CHECK_CAPTURES - 1)
+
+
+/* Generation {{{1
+ */
+
+static void check_gen(buffer_t *pat, int depth, int *groups)
+{
+    static const char * const atoms[] = {
+        "a", "b", "ab", ".", "\\n", "[ab]", "$", "^", "(?=a)", "(?!b)",
+    };
+    int k = check_rand(depth > 3 ? 3 : 10);
+
+    if (k < 3 || depth > 5) {
+        if (*groups > 0 && check_rand(8) == 0) {
+            buffer_addf(pat, "\\%d", 1 + check_rand(*groups));
+        } else {
+            buffer_addstr(pat, atoms[check_rand(countof(atoms))]);
+        }
+        return;
+    }
+    if (k < 5) {
+        check_gen(pat, depth + 1, groups);
+        check_gen(pat, depth + 1, groups);
+        return;
+    }
+
+    if (*groups >= CHECK_GROUPS || check_rand(4) == 0) {
+        buffer_addstr(pat, "(?:");
+    } else
+    if (check_rand(3) == 0) {
+        buffer_addf(pat, "(?<g%d>", ++*groups);
+    } else {
+        buffer_addch(pat, '(');
+        ++*groups;
+    }
+    check_gen(pat, depth + 1, groups);
+    if (k < 7) {
+        buffer_addch(pat, '|');
+        check_gen(pat, depth + 1, groups);
+    }
+    buffer_addch(pat, ')');
+    if (k >= 7) {
+        static const char * const quantifiers[] = {
+            "*", "+", "?", "??", "*?", "{0,2}",
+        };
+
+        buffer_addstr(pat, quantifiers[check_rand(countof(quantifiers))]);
+    }
+}
+
+
+/* Checks {{{1
+ */
+
+static void check_mismatch(const char *what, const char *pat, bool cs,
+                           const char *str, int len, int got, int expected)
+{
+    printf("%s mismatch: /%s/%s on \"", what, pat, cs ? "" : "i");
+    check_print(str, len);
+    printf("\": %d, pcre %d\n", got, expected);
+}
+
+/** Match a subject with both the regexp and the engine, with a random
+ * number of slices.
+ *
+ * \return false if the engine gave up.
+ */
+static bool check_subject(const regexp_t *re, check_code_t *code,
+                          const char *pat, bool cs, const clstr_t *s)
+{
+    clstr_t captures[CHECK_CAPTURES];
+    int ovector[2 * CHECK_CAPTURES];
+    int count = 1 + check_rand(CHECK_CAPTURES);
+    int e, n;
+
+    e = check_exec(code, s->str, s->len, ovector);
+    if (e < 0) {
+        return false;
+    }
+
+    /* The slices past the count given by the caller are left untouched */
+    for (int i = 0 ; i < countof(captures) ; ++i) {
+        captures[i].str = s->str;
+        captures[i].len = -1;
+    }
+    n = regexp_exec_captures(re, s, captures, count);
+    if ((n > 0) != (e > 0)
+    ||  (n > 0 && (n > count || n != MIN(count, regexp_capture_count(re) + 1)
+                || !check_captures(s->str, captures, n, ovector,
+                                   MIN(e, n))))) {
+        check_mismatch("captures", pat, cs, s->str, s->len, n, e);
+        check_failures_g++;
+    }
+    for (int i = count ; i < countof(captures) ; ++i) {
+        if (captures[i].str != s->str || captures[i].len != -1) {
+            check_mismatch("overflow", pat, cs, s->str, s->len, i, count);
+            check_failures_g++;
+            break;
+        }
+    }
+    return true;
+}
+
+/** Check the named groups of a pattern: "g<n>" is the group n.
+ */
+static void check_names(const regexp_t *re, const char *pat, int groups)
+{
+    char name[16], group[16];
+
+    for (int i = 1 ; i <= groups ; ++i) {
+        int index;
+
+        snprintf(name, sizeof(name), "g%d", i);
+        snprintf(group, sizeof(group), "(?<g%d>", i);
+        index = regexp_capture_index(re, name);
+        if (strstr(pat, group) ? index != i : index != -1) {
+            printf("named group g%d of /%s/: %d\n", i, pat, index);
+            check_failures_g++;
+        }
+    }
+}
+
+/* Fixed cases, where the leftmost match is not the obvious one */
+static const struct {
+    const char *pattern;
+    bool cs;
+    const char *subject;
+    int start;                  /**< -1 if the pattern does not match */
+    int len;
+} check_cases_g[] = {
+    { "$",        true,  "ab\n",   2, 0 },
+    { "\\n$",     true,  "\n\n",   0, 1 },
+    { "a$",       true,  "a\na\n", 2, 1 },
+    { "^$",       true,  "\n",     0, 0 },
+    { "^a$",      false, "A\n",    0, 1 },
+    { "^a$",      true,  "a\n\n", -1, 0 },
+    { "b",        false, "aBb",    1, 1 },
+    { "(a)|b",    true,  "b",      0, 1 },
+    { "(a)(b)?",  true,  "ac",     0, 1 },
+};
+
+static void check_cases(void)
+{
+    for (int i = 0 ; i < countof(check_cases_g) ; ++i) {
+        const clstr_t s = {
+            check_cases_g[i].subject, m_strlen(check_cases_g[i].subject)
+        };
+        clstr_t captures[CHECK_CAPTURES];
+        regexp_t re;
+        int n;
+
+        p_clear(&re, 1);
+        if (!regexp_compile(&re, check_cases_g[i].pattern,
+                            check_cases_g[i].cs)) {
+            printf("rejected by regexp_compile: /%s/\n",
+                   check_cases_g[i].pattern);
+            check_failures_g++;
+            continue;
+        }
+        n = regexp_exec_captures(&re, &s, captures, countof(captures));
+        if (check_cases_g[i].start < 0 ? n != 0
+            : n == 0 || captures[0].str != s.str + check_cases_g[i].start
+                     || captures[0].len != check_cases_g[i].len) {
+            check_mismatch("case", check_cases_g[i].pattern,
+                           check_cases_g[i].cs, s.str, s.len,
+                           n > 0 ? (int)(captures[0].str - s.str) : -1,
+                           check_cases_g[i].start);
+            check_failures_g++;
+        }
+        for (int j = 1 ; j < n ; ++j) {
+            if (captures[j].str == NULL && captures[j].len != 0) {
+                printf("unset group %d of /%s/ has a length\n", j,
+                       check_cases_g[i].pattern);
+                check_failures_g++;
+            }
+        }
+        regexp_wipe(&re);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const char subject_chars[] = "abAB\n";
+    buffer_t pat = BUFFER_INIT;
+    int patterns = argc > 2 ? atoi(argv[2]) : 3000;
+    int checks = 0, undecided = 0;
+
+    check_seed(argc, argv);
+    check_cases();
+    for (int i = 0 ; i < patterns ; ++i) {
+        const bool cs = check_rand(2);
+        check_code_t *code;
+        int groups = 0;
+        regexp_t re;
+
+        buffer_reset(&pat);
+        check_gen(&pat, 0, &groups);
+
+        code = check_compile(pat.data, cs);
+        p_clear(&re, 1);
+        if (code == NULL || !regexp_compile(&re, pat.data, cs)) {
+            printf("rejected by %s: /%s/%s\n",
+                   code ? "regexp_compile" : "pcre", pat.data, cs ? "" : "i");
+            check_failures_g++;
+            if (code != NULL) {
+                check_free(&code);
+            }
+            continue;
+        }
+        if (regexp_capture_count(&re) != groups) {
+            printf("/%s/ has %d groups, not %d\n", pat.data,
+                   regexp_capture_count(&re), groups);
+            check_failures_g++;
+        }
+        check_names(&re, pat.data, groups);
+
+        for (int j = 0 ; j < CHECK_SUBJECTS ; ++j) {
+            char str[CHECK_SUBJECT_LEN];
+            const clstr_t s = { str, check_rand(CHECK_SUBJECT_LEN) };
+
+            for (int c = 0 ; c < s.len ; ++c) {
+                str[c] = subject_chars[check_rand(sizeof(subject_chars) - 1)];
+            }
+            if (check_subject(&re, code, pat.data, cs, &s)) {
+                checks++;
+            } else {
+                undecided++;
+            }
+        }
+        regexp_wipe(&re);
+        check_free(&code);
+    }
+
+    printf("%d patterns, %d subjects, %d given up by the engine, "
+           "%d failures\n", patterns, checks, undecided, check_failures_g);
+    buffer_wipe(&pat);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
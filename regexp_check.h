@@ -0,0 +1,216 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#ifndef PFIXTOOLS_REGEXP_CHECK_H
+#define PFIXTOOLS_REGEXP_CHECK_H
+
+#include "regexp.h"
+
+/* Helpers of the "make check" programs that compare the regexps with the
+ * PCRE engine the library is built with (the checks of the other modules
+ * share the random generator). They are not part of the library.
+ */
+
+/* Nested quantifiers make the engine backtrack a lot: the subjects on
+ * which it gives up are not checked.
+ */
+#define CHECK_MATCH_LIMIT  100000
+
+/* Maximum number of capture groups compared with the engine */
+#define CHECK_CAPTURES     10
+
+static int check_failures_g;
+
+#define CHECK(Expr)                                                          \
+    do {                                                                     \
+        if (!(Expr)) {                                                       \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #Expr);  \
+            check_failures_g++;                                              \
+        }                                                                    \
+    } while (0)
+
+static uint32_t check_seed_g;
+
+static inline void check_seed(int argc, char *argv[])
+{
+    check_seed_g = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : 1;
+    if (check_seed_g == 0) {
+        check_seed_g = 1;
+    }
+}
+
+static inline int check_rand(int n)
+{
+    /* xorshift32: the sequence is the same on every platform */
+    check_seed_g ^= check_seed_g << 13;
+    check_seed_g ^= check_seed_g >> 17;
+    check_seed_g ^= check_seed_g << 5;
+    return (int)(check_seed_g % (uint32_t)n);
+}
+
+static inline void check_print(const char *str, int len)
+{
+    for (int i = 0 ; i < len ; ++i) {
+        if (str[i] == '\n') {
+            fputs("\\n", stdout);
+        } else {
+            putchar(str[i]);
+        }
+    }
+}
+
+
+/* Engine {{{1
+ */
+
+#ifdef HAVE_PCRE2
+typedef pcre2_code check_code_t;
+
+static inline check_code_t *check_compile(const char *pattern, bool cs)
+{
+    PCRE2_SIZE erroffset;
+    int errcode;
+
+    return pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED,
+                         cs ? 0 : PCRE2_CASELESS, &errcode, &erroffset, NULL);
+}
+
+/** Match a subject with the engine. The offsets of the whole match and of
+ * the groups are stored by pairs in \p ovector (-1 for an unset group).
+ *
+ * \return the number of pairs set on match, 0 on no match, -1 if the
+ * engine gave up.
+ */
+static inline int check_exec(check_code_t *code, const char *str, int len,
+                             int ovector[2 * CHECK_CAPTURES])
+{
+    pcre2_match_data *data = pcre2_match_data_create(CHECK_CAPTURES, NULL);
+    pcre2_match_context *ctx = pcre2_match_context_create(NULL);
+    const PCRE2_SIZE *ov = pcre2_get_ovector_pointer(data);
+    int res;
+
+    pcre2_set_match_limit(ctx, CHECK_MATCH_LIMIT);
+    res = pcre2_match(code, (PCRE2_SPTR)str, len, 0, 0, data, ctx);
+    if (res == 0) {
+        res = CHECK_CAPTURES;
+    }
+    for (int i = 0 ; i < 2 * res ; ++i) {
+        ovector[i] = ov[i] == PCRE2_UNSET ? -1 : (int)ov[i];
+    }
+    pcre2_match_context_free(ctx);
+    pcre2_match_data_free(data);
+    return res >= 0 ? res : res == PCRE2_ERROR_NOMATCH ? 0 : -1;
+}
+
+static inline void check_free(check_code_t **code)
+{
+    pcre2_code_free(*code);
+    *code = NULL;
+}
+#else
+typedef pcre check_code_t;
+
+static inline check_code_t *check_compile(const char *pattern, bool cs)
+{
+    const char *error;
+    int erroffset;
+
+    return pcre_compile(pattern, cs ? 0 : PCRE_CASELESS, &error, &erroffset,
+                        NULL);
+}
+
+/** Match a subject with the engine. The offsets of the whole match and of
+ * the groups are stored by pairs in \p ovector (-1 for an unset group).
+ *
+ * \return the number of pairs set on match, 0 on no match, -1 if the
+ * engine gave up.
+ */
+static inline int check_exec(check_code_t *code, const char *str, int len,
+                             int ovector[2 * CHECK_CAPTURES])
+{
+    pcre_extra extra = {
+        .flags       = PCRE_EXTRA_MATCH_LIMIT,
+        .match_limit = CHECK_MATCH_LIMIT,
+    };
+    int ov[3 * CHECK_CAPTURES];
+    int res = pcre_exec(code, &extra, str, len, 0, 0, ov, countof(ov));
+
+    if (res == 0) {
+        res = CHECK_CAPTURES;
+    }
+    for (int i = 0 ; i < 2 * res ; ++i) {
+        ovector[i] = ov[i];
+    }
+    return res >= 0 ? res : res == PCRE_ERROR_NOMATCH ? 0 : -1;
+}
+
+static inline void check_free(check_code_t **code)
+{
+    pcre_free(*code);
+    *code = NULL;
+}
+#endif
+
+/** Compare the \p count captures of a regexp with the \p pairs offsets
+ * set by the engine: the engine does not report the unset groups at the
+ * end.
+ *
+ * \return true if they are the same.
+ */
+static inline bool check_captures(const char *str, const clstr_t *captures,
+                                  int count, const int *ovector, int pairs)
+{
+    if (count < pairs) {
+        return false;
+    }
+    for (int i = 0 ; i < count ; ++i) {
+        const int start = i < pairs ? ovector[2 * i] : -1;
+
+        if (start < 0) {
+            if (captures[i].str != NULL || captures[i].len != 0) {
+                return false;
+            }
+        } else
+        if (captures[i].str != str + start
+        ||  captures[i].len != ovector[2 * i + 1] - start) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,854 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include <pthread.h>
+#include "regexp_dfa.h"
+
+#define REGEXP_DFA_MAX_NODES   256
+#define REGEXP_DFA_MAX_STATES  512
+#define REGEXP_DFA_CHUNK       32
+
+/* Nodes of the NFA */
+enum {
+    REGEXP_DFA_SET,     /**< consumes a byte of the set, then goes to out */
+    REGEXP_DFA_SPLIT,   /**< goes to both out and out1 */
+    REGEXP_DFA_JUMP,    /**< goes to out */
+    REGEXP_DFA_MATCH,
+};
+
+typedef struct regexp_dfa_node_t {
+    uint8_t type;
+    int     set;
+    int     out;
+    int     out1;
+} regexp_dfa_node_t;
+
+typedef struct regexp_dfa_set_t {
+    uint32_t bits[8];
+} regexp_dfa_set_t;
+
+/* A state of the DFA is the set of NFA nodes (consuming or matching nodes
+ * only) reachable after reading the input so far. Its transitions are
+ * computed on demand: -1 stands for an unknown transition.
+ */
+typedef struct regexp_dfa_state_t {
+    int32_t *next;
+    uint32_t hash;
+    bool     match;
+    int      len;
+    int      nodes[];
+} regexp_dfa_state_t;
+
+struct regexp_dfa_t {
+    regexp_dfa_node_t *nodes;
+    int                nodes_len;
+    regexp_dfa_set_t  *sets;
+    int                sets_len;
+    int                start;
+    int                captures;
+    bool               anchored_start;
+    bool               anchored_end;
+
+    /* Bytes are mapped to classes of bytes that are not distinguished by
+     * any set of the pattern.
+     */
+    uint8_t            classes[256];
+    uint8_t            class_byte[256];
+    int                classes_len;
+
+    /* State cache. The states are only created with the lock held, and
+     * published by the release store of the transition that leads to
+     * them: the lookups are lock free.
+     */
+    pthread_mutex_t     lock;
+    regexp_dfa_state_t **chunks[REGEXP_DFA_MAX_STATES / REGEXP_DFA_CHUNK];
+    int                 states_len;
+    size_t              memory;
+};
+
+static inline bool regexp_dfa_set_has(const regexp_dfa_set_t *set, int c)
+{
+    return set->bits[c >> 5] & (1U << (c & 31));
+}
+
+static inline void regexp_dfa_set_add(regexp_dfa_set_t *set, int c)
+{
+    set->bits[c >> 5] |= 1U << (c & 31);
+}
+
+static inline regexp_dfa_state_t *regexp_dfa_state(const regexp_dfa_t *dfa,
+                                                   int id)
+{
+    return dfa->chunks[id / REGEXP_DFA_CHUNK][id % REGEXP_DFA_CHUNK];
+}
+
+
+/* Parsing {{{1
+ */
+
+/* A fragment of the NFA being built: its entry node, and the list of the
+ * dangling exits to patch. An exit is encoded as 2 * node + (0 for out, 1
+ * for out1), and the list is chained through the patch array.
+ */
+typedef struct regexp_dfa_frag_t {
+    int start;
+    int exits;
+} regexp_dfa_frag_t;
+
+typedef struct regexp_dfa_parser_t {
+    regexp_dfa_t *dfa;
+    const char   *p;
+    const char   *end;
+    bool          cs;
+    int           depth;
+    bool          top_alt;
+    int           patch[2 * REGEXP_DFA_MAX_NODES];
+} regexp_dfa_parser_t;
+
+static int regexp_dfa_node(regexp_dfa_parser_t *ps, int type, int set,
+                           int out, int out1)
+{
+    regexp_dfa_t *dfa = ps->dfa;
+    regexp_dfa_node_t *node;
+
+    if (dfa->nodes_len >= REGEXP_DFA_MAX_NODES) {
+        return -1;
+    }
+    node = &dfa->nodes[dfa->nodes_len];
+    node->type = type;
+    node->set  = set;
+    node->out  = out;
+    node->out1 = out1;
+    ps->patch[2 * dfa->nodes_len]     = -1;
+    ps->patch[2 * dfa->nodes_len + 1] = -1;
+    return dfa->nodes_len++;
+}
+
+static int regexp_dfa_new_set(regexp_dfa_parser_t *ps)
+{
+    regexp_dfa_t *dfa = ps->dfa;
+
+    if (dfa->sets_len >= REGEXP_DFA_MAX_NODES) {
+        return -1;
+    }
+    p_clear(&dfa->sets[dfa->sets_len], 1);
+    return dfa->sets_len++;
+}
+
+static void regexp_dfa_patch(regexp_dfa_parser_t *ps, int exits, int target)
+{
+    while (exits >= 0) {
+        regexp_dfa_node_t *node = &ps->dfa->nodes[exits / 2];
+        int next = ps->patch[exits];
+
+        if (exits % 2 == 0) {
+            node->out = target;
+        } else {
+            node->out1 = target;
+        }
+        exits = next;
+    }
+}
+
+static int regexp_dfa_append(regexp_dfa_parser_t *ps, int l1, int l2)
+{
+    int pos = l1;
+
+    if (l1 < 0) {
+        return l2;
+    }
+    while (ps->patch[pos] >= 0) {
+        pos = ps->patch[pos];
+    }
+    ps->patch[pos] = l2;
+    return l1;
+}
+
+/** Add the set matched by the escape sequence \c, if supported.
+ */
+static bool regexp_dfa_escape(regexp_dfa_set_t *set, int c)
+{
+    regexp_dfa_set_t tmp;
+    bool negate = false;
+
+    p_clear(&tmp, 1);
+    switch (c) {
+      case 'D': negate = true; /* FALLTHROUGH */
+      case 'd':
+        for (int i = '0' ; i <= '9' ; ++i) {
+            regexp_dfa_set_add(&tmp, i);
+        }
+        break;
+
+      case 'W': negate = true; /* FALLTHROUGH */
+      case 'w':
+        for (int i = 0 ; i < 256 ; ++i) {
+            if (i < 128 && (isalnum(i) || i == '_')) {
+                regexp_dfa_set_add(&tmp, i);
+            }
+        }
+        break;
+
+      case 'S': negate = true; /* FALLTHROUGH */
+      case 's':
+        regexp_dfa_set_add(&tmp, ' ');
+        for (int i = '\t' ; i <= '\r' ; ++i) {
+            regexp_dfa_set_add(&tmp, i);
+        }
+        break;
+
+      case 't': regexp_dfa_set_add(&tmp, '\t'); break;
+      case 'n': regexp_dfa_set_add(&tmp, '\n'); break;
+      case 'r': regexp_dfa_set_add(&tmp, '\r'); break;
+      case 'f': regexp_dfa_set_add(&tmp, '\f'); break;
+
+      default:
+        /* Other alphanumeric escapes are either assertions, back
+         * references or code points: out of the subset.
+         */
+        if (isalnum(c) || c >= 128 || c == '\0') {
+            return false;
+        }
+        regexp_dfa_set_add(&tmp, c);
+        break;
+    }
+    for (int i = 0 ; i < 8 ; ++i) {
+        set->bits[i] |= negate ? ~tmp.bits[i] : tmp.bits[i];
+    }
+    return true;
+}
+
+static void regexp_dfa_fold(regexp_dfa_set_t *set)
+{
+    for (int c = 'a' ; c <= 'z' ; ++c) {
+        if (regexp_dfa_set_has(set, c) || regexp_dfa_set_has(set, c - 32)) {
+            regexp_dfa_set_add(set, c);
+            regexp_dfa_set_add(set, c - 32);
+        }
+    }
+}
+
+/** Parse a bracket expression, p is just after the opening bracket.
+ */
+static int regexp_dfa_parse_class(regexp_dfa_parser_t *ps)
+{
+    int id = regexp_dfa_new_set(ps);
+    regexp_dfa_set_t *set;
+    bool negate = false, first = true;
+
+    if (id < 0) {
+        return -1;
+    }
+    set = &ps->dfa->sets[id];
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = true;
+        ++ps->p;
+    }
+    for (;;) {
+        int lo, hi;
+
+        if (ps->p >= ps->end) {
+            return -1;
+        }
+        lo = (uint8_t)*ps->p++;
+        if (lo == ']' && !first) {
+            break;
+        }
+        first = false;
+        if (lo == '[' && ps->p < ps->end && *ps->p == ':') {
+            return -1;
+        }
+        if (lo == '\\') {
+            if (ps->p >= ps->end) {
+                return -1;
+            }
+            lo = (uint8_t)*ps->p++;
+            if (isalpha(lo)) {
+                if (!regexp_dfa_escape(set, lo)) {
+                    return -1;
+                }
+                continue;
+            }
+            if (isdigit(lo) || lo == '\0') {
+                return -1;
+            }
+        }
+        if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+            hi = (uint8_t)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' || hi == '[' || hi < lo) {
+                return -1;
+            }
+            for (int c = lo ; c <= hi ; ++c) {
+                regexp_dfa_set_add(set, c);
+            }
+        } else {
+            regexp_dfa_set_add(set, lo);
+        }
+    }
+    if (!ps->cs) {
+        regexp_dfa_fold(set);
+    }
+    if (negate) {
+        for (int i = 0 ; i < 8 ; ++i) {
+            set->bits[i] = ~set->bits[i];
+        }
+    }
+    return id;
+}
+
+static bool regexp_dfa_parse_alt(regexp_dfa_parser_t *ps,
+                                 regexp_dfa_frag_t *frag);
+
+static bool regexp_dfa_parse_atom(regexp_dfa_parser_t *ps,
+                                  regexp_dfa_frag_t *frag)
+{
+    int c = (uint8_t)*ps->p++;
+    int set = -1, node;
+
+    switch (c) {
+      case '(':
+        if (ps->p < ps->end && *ps->p == '?') {
+            if (ps->end - ps->p < 2 || ps->p[1] != ':') {
+                return false;
+            }
+            ps->p += 2;
+        } else {
+            ps->dfa->captures++;
+        }
+        ps->depth++;
+        if (!regexp_dfa_parse_alt(ps, frag)
+        ||  ps->p >= ps->end || *ps->p != ')') {
+            return false;
+        }
+        ps->depth--;
+        ++ps->p;
+        return true;
+
+      case '[':
+        set = regexp_dfa_parse_class(ps);
+        break;
+
+      case '.':
+        set = regexp_dfa_new_set(ps);
+        if (set >= 0) {
+            for (int i = 0 ; i < 8 ; ++i) {
+                ps->dfa->sets[set].bits[i] = ~0U;
+            }
+            ps->dfa->sets[set].bits['\n' >> 5] &= ~(1U << ('\n' & 31));
+        }
+        break;
+
+      case '\\':
+        if (ps->p >= ps->end) {
+            return false;
+        }
+        set = regexp_dfa_new_set(ps);
+        if (set < 0 || !regexp_dfa_escape(&ps->dfa->sets[set],
+                                          (uint8_t)*ps->p++)) {
+            return false;
+        }
+        if (!ps->cs) {
+            regexp_dfa_fold(&ps->dfa->sets[set]);
+        }
+        break;
+
+      case '^': case '$': case '*': case '+': case '?': case '{':
+      case ')': case '|': case '\0':
+        return false;
+
+      default:
+        set = regexp_dfa_new_set(ps);
+        if (set >= 0) {
+            regexp_dfa_set_add(&ps->dfa->sets[set], c);
+            if (!ps->cs) {
+                regexp_dfa_fold(&ps->dfa->sets[set]);
+            }
+        }
+        break;
+    }
+    if (set < 0) {
+        return false;
+    }
+    node = regexp_dfa_node(ps, REGEXP_DFA_SET, set, -1, -1);
+    if (node < 0) {
+        return false;
+    }
+    frag->start = node;
+    frag->exits = 2 * node;
+    return true;
+}
+
+static bool regexp_dfa_parse_repeat(regexp_dfa_parser_t *ps,
+                                    regexp_dfa_frag_t *frag)
+{
+    int split;
+
+    if (!regexp_dfa_parse_atom(ps, frag)) {
+        return false;
+    }
+    if (ps->p >= ps->end) {
+        return true;
+    }
+    switch (*ps->p) {
+      case '*':
+      case '+':
+      case '?':
+        split = regexp_dfa_node(ps, REGEXP_DFA_SPLIT, -1, frag->start, -1);
+        if (split < 0) {
+            return false;
+        }
+        if (*ps->p == '*') {
+            regexp_dfa_patch(ps, frag->exits, split);
+            frag->start = split;
+            frag->exits = 2 * split + 1;
+        } else if (*ps->p == '+') {
+            regexp_dfa_patch(ps, frag->exits, split);
+            frag->exits = 2 * split + 1;
+        } else {
+            frag->start = split;
+            frag->exits = regexp_dfa_append(ps, frag->exits, 2 * split + 1);
+        }
+        ++ps->p;
+        break;
+
+      case '{':
+        return false;
+
+      default:
+        return true;
+    }
+
+    /* A lazy quantifier does not change whether the pattern matches, any
+     * other quantifier is out of the subset.
+     */
+    if (ps->p < ps->end && *ps->p == '?') {
+        ++ps->p;
+    }
+    return ps->p >= ps->end || (*ps->p != '*' && *ps->p != '+'
+                                && *ps->p != '?' && *ps->p != '{');
+}
+
+static bool regexp_dfa_parse_concat(regexp_dfa_parser_t *ps,
+                                    regexp_dfa_frag_t *frag)
+{
+    bool empty = true;
+
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        regexp_dfa_frag_t next;
+
+        if (!regexp_dfa_parse_repeat(ps, &next)) {
+            return false;
+        }
+        if (empty) {
+            *frag = next;
+            empty = false;
+        } else {
+            regexp_dfa_patch(ps, frag->exits, next.start);
+            frag->exits = next.exits;
+        }
+    }
+    if (empty) {
+        int node = regexp_dfa_node(ps, REGEXP_DFA_JUMP, -1, -1, -1);
+        if (node < 0) {
+            return false;
+        }
+        frag->start = node;
+        frag->exits = 2 * node;
+    }
+    return true;
+}
+
+static bool regexp_dfa_parse_alt(regexp_dfa_parser_t *ps,
+                                 regexp_dfa_frag_t *frag)
+{
+    if (!regexp_dfa_parse_concat(ps, frag)) {
+        return false;
+    }
+    while (ps->p < ps->end && *ps->p == '|') {
+        regexp_dfa_frag_t other;
+        int split;
+
+        ++ps->p;
+        ps->top_alt |= ps->depth == 0;
+        if (!regexp_dfa_parse_concat(ps, &other)) {
+            return false;
+        }
+        split = regexp_dfa_node(ps, REGEXP_DFA_SPLIT, -1, frag->start,
+                                other.start);
+        if (split < 0) {
+            return false;
+        }
+        frag->start = split;
+        frag->exits = regexp_dfa_append(ps, frag->exits, other.exits);
+    }
+    return true;
+}
+
+/** Compute the byte classes: two bytes are in the same class if no set of
+ * the pattern distinguishes them. Only consecutive bytes are merged.
+ */
+static void regexp_dfa_build_classes(regexp_dfa_t *dfa)
+{
+    int cls = 0;
+
+    dfa->classes[0]    = 0;
+    dfa->class_byte[0] = 0;
+    for (int c = 1 ; c < 256 ; ++c) {
+        for (int i = 0 ; i < dfa->sets_len ; ++i) {
+            if (regexp_dfa_set_has(&dfa->sets[i], c)
+                != regexp_dfa_set_has(&dfa->sets[i], c - 1)) {
+                dfa->class_byte[++cls] = c;
+                break;
+            }
+        }
+        dfa->classes[c] = cls;
+    }
+    dfa->classes_len = cls + 1;
+}
+
+
+/* States {{{1
+ */
+
+/** Add the closure of a node to a list of nodes: only the consuming and
+ * matching nodes are kept. mark/gen identify the nodes already in the list.
+ */
+static int regexp_dfa_closure(const regexp_dfa_t *dfa, int node,
+                              int *list, int len, int *mark, int gen)
+{
+    int stack[REGEXP_DFA_MAX_NODES];
+    int top = 0;
+
+    if (node < 0 || mark[node] == gen) {
+        return len;
+    }
+    mark[node] = gen;
+    stack[top++] = node;
+    while (top > 0) {
+        const regexp_dfa_node_t *n = &dfa->nodes[stack[--top]];
+
+        switch (n->type) {
+          case REGEXP_DFA_SPLIT:
+            if (n->out1 >= 0 && mark[n->out1] != gen) {
+                mark[n->out1] = gen;
+                stack[top++] = n->out1;
+            }
+            /* FALLTHROUGH */
+          case REGEXP_DFA_JUMP:
+            if (n->out >= 0 && mark[n->out] != gen) {
+                mark[n->out] = gen;
+                stack[top++] = n->out;
+            }
+            break;
+
+          default:
+            list[len++] = n - dfa->nodes;
+            break;
+        }
+    }
+    return len;
+}
+
+/** Compute the nodes reached from a list of nodes by reading byte c.
+ */
+static int regexp_dfa_step(const regexp_dfa_t *dfa, const int *nodes,
+                           int len, int c, int *out, int *mark, int gen)
+{
+    int out_len = 0;
+
+    for (int i = 0 ; i < len ; ++i) {
+        const regexp_dfa_node_t *n = &dfa->nodes[nodes[i]];
+
+        if (n->type == REGEXP_DFA_SET
+        &&  regexp_dfa_set_has(&dfa->sets[n->set], c)) {
+            out_len = regexp_dfa_closure(dfa, n->out, out, out_len,
+                                         mark, gen);
+        }
+    }
+    if (!dfa->anchored_start) {
+        out_len = regexp_dfa_closure(dfa, dfa->start, out, out_len,
+                                     mark, gen);
+    }
+    return out_len;
+}
+
+static bool regexp_dfa_has_match(const regexp_dfa_t *dfa, const int *nodes,
+                                 int len)
+{
+    for (int i = 0 ; i < len ; ++i) {
+        if (dfa->nodes[nodes[i]].type == REGEXP_DFA_MATCH) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Find or create the state for a list of nodes. Must be called with the
+ * lock held.
+ *
+ * \return the id of the state, -1 if the cache is full.
+ */
+static int regexp_dfa_intern(regexp_dfa_t *dfa, int *nodes, int len)
+{
+    regexp_dfa_state_t *state;
+    uint32_t hash = 2166136261U;
+    int chunk;
+
+    if (len > 1) {
+#       define QSORT_TYPE int
+#       define QSORT_BASE nodes
+#       define QSORT_NELT len
+#       define QSORT_LT(a,b) *(a) < *(b)
+#       include "qsort.c"
+#       undef QSORT_TYPE
+#       undef QSORT_BASE
+#       undef QSORT_NELT
+#       undef QSORT_LT
+    }
+    for (int i = 0 ; i < len ; ++i) {
+        hash = (hash ^ (uint32_t)nodes[i]) * 16777619U;
+    }
+    for (int id = 0 ; id < dfa->states_len ; ++id) {
+        state = regexp_dfa_state(dfa, id);
+        if (state->hash == hash && state->len == len
+        &&  memcmp(state->nodes, nodes, len * sizeof(int)) == 0) {
+            return id;
+        }
+    }
+    if (dfa->states_len >= REGEXP_DFA_MAX_STATES) {
+        return -1;
+    }
+
+    state = xmalloc(ssizeof(regexp_dfa_state_t) + len * ssizeof(int));
+    state->next  = p_new(int32_t, dfa->classes_len);
+    state->hash  = hash;
+    state->len   = len;
+    state->match = regexp_dfa_has_match(dfa, nodes, len);
+    memcpy(state->nodes, nodes, len * sizeof(int));
+    memset(state->next, 0xff, dfa->classes_len * sizeof(int32_t));
+    dfa->memory += sizeof(*state) + len * sizeof(int)
+                 + dfa->classes_len * sizeof(int32_t);
+
+    chunk = dfa->states_len / REGEXP_DFA_CHUNK;
+    if (dfa->chunks[chunk] == NULL) {
+        dfa->chunks[chunk] = p_new(regexp_dfa_state_t *, REGEXP_DFA_CHUNK);
+        dfa->memory += REGEXP_DFA_CHUNK * sizeof(regexp_dfa_state_t *);
+    }
+    dfa->chunks[chunk][dfa->states_len % REGEXP_DFA_CHUNK] = state;
+    return dfa->states_len++;
+}
+
+/** Compute a missing transition.
+ * \return the id of the next state, -1 if the cache is full.
+ */
+static int regexp_dfa_transition(regexp_dfa_t *dfa, regexp_dfa_state_t *state,
+                                 int cls)
+{
+    int nodes[REGEXP_DFA_MAX_NODES];
+    int mark[REGEXP_DFA_MAX_NODES];
+    int next, len;
+
+    pthread_mutex_lock(&dfa->lock);
+    next = state->next[cls];
+    if (next < 0) {
+        p_clear(mark, dfa->nodes_len);
+        len  = regexp_dfa_step(dfa, state->nodes, state->len,
+                               dfa->class_byte[cls], nodes, mark, 1);
+        next = regexp_dfa_intern(dfa, nodes, len);
+        if (next >= 0) {
+            __atomic_store_n(&state->next[cls], next, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&dfa->lock);
+    return next;
+}
+
+/** Go on matching by simulating the NFA, from the nodes of a state.
+ */
+static bool regexp_dfa_simulate(const regexp_dfa_t *dfa,
+                                const regexp_dfa_state_t *state,
+                                const char *str, ssize_t pos, ssize_t len)
+{
+    int lists[2][REGEXP_DFA_MAX_NODES];
+    int mark[REGEXP_DFA_MAX_NODES];
+    int *cur = lists[0], *next = lists[1];
+    int cur_len = state->len;
+    int gen = 0;
+
+    memcpy(cur, state->nodes, cur_len * sizeof(int));
+    p_clear(mark, dfa->nodes_len);
+    for (; pos < len ; ++pos) {
+        int *tmp;
+
+        if (regexp_dfa_has_match(dfa, cur, cur_len)
+        &&  (!dfa->anchored_end
+             || (pos == len - 1 && str[pos] == '\n'))) {
+            return true;
+        }
+        if (cur_len == 0) {
+            return false;
+        }
+        cur_len = regexp_dfa_step(dfa, cur, cur_len, (uint8_t)str[pos], next,
+                                  mark, ++gen);
+        tmp  = cur;
+        cur  = next;
+        next = tmp;
+    }
+    return regexp_dfa_has_match(dfa, cur, cur_len);
+}
+
+
+/* Public API {{{1
+ */
+
+regexp_dfa_t *regexp_dfa_new(const char *pattern, ssize_t len, bool cs)
+{
+    regexp_dfa_t *dfa = p_new(regexp_dfa_t, 1);
+    regexp_dfa_parser_t *ps = p_new(regexp_dfa_parser_t, 1);
+    int nodes[REGEXP_DFA_MAX_NODES];
+    int mark[REGEXP_DFA_MAX_NODES];
+    regexp_dfa_frag_t frag;
+    int match, start_len;
+
+    dfa->nodes = p_new(regexp_dfa_node_t, REGEXP_DFA_MAX_NODES);
+    dfa->sets  = p_new(regexp_dfa_set_t, REGEXP_DFA_MAX_NODES);
+    pthread_mutex_init(&dfa->lock, NULL);
+
+    ps->dfa = dfa;
+    ps->p   = pattern;
+    ps->end = pattern + len;
+    ps->cs  = cs;
+
+    /* Anchors are only supported at the ends of the pattern */
+    if (ps->p < ps->end && *ps->p == '^') {
+        dfa->anchored_start = true;
+        ++ps->p;
+    }
+    if (ps->end > ps->p && ps->end[-1] == '$') {
+        const char *p = ps->end - 1;
+        while (p > ps->p && p[-1] == '\\') {
+            --p;
+        }
+        if ((ps->end - 1 - p) % 2 == 0) {
+            dfa->anchored_end = true;
+            --ps->end;
+        }
+    }
+
+    /* The anchors only apply to the first and last alternatives of a
+     * top-level alternation: such patterns are left to the engine.
+     */
+    if (!regexp_dfa_parse_alt(ps, &frag) || ps->p != ps->end
+    ||  (ps->top_alt && (dfa->anchored_start || dfa->anchored_end))
+    ||  (match = regexp_dfa_node(ps, REGEXP_DFA_MATCH, -1, -1, -1)) < 0) {
+        p_delete(&ps);
+        regexp_dfa_delete(&dfa);
+        return NULL;
+    }
+    regexp_dfa_patch(ps, frag.exits, match);
+    dfa->start = frag.start;
+    p_delete(&ps);
+
+    p_realloc(&dfa->nodes, dfa->nodes_len);
+    p_realloc(&dfa->sets, MAX(dfa->sets_len, 1));
+    regexp_dfa_build_classes(dfa);
+    dfa->memory = sizeof(*dfa) + dfa->nodes_len * sizeof(regexp_dfa_node_t)
+                + dfa->sets_len * sizeof(regexp_dfa_set_t);
+
+    /* The initial state */
+    p_clear(mark, dfa->nodes_len);
+    start_len = regexp_dfa_closure(dfa, dfa->start, nodes, 0, mark, 1);
+    regexp_dfa_intern(dfa, nodes, start_len);
+    return dfa;
+}
+
+void regexp_dfa_delete(regexp_dfa_t **dfa)
+{
+    if (*dfa == NULL) {
+        return;
+    }
+    for (int id = 0 ; id < (*dfa)->states_len ; ++id) {
+        regexp_dfa_state_t *state = regexp_dfa_state(*dfa, id);
+        p_delete(&state->next);
+        p_delete(&state);
+    }
+    for (int i = 0 ; i < countof((*dfa)->chunks) ; ++i) {
+        p_delete(&(*dfa)->chunks[i]);
+    }
+    pthread_mutex_destroy(&(*dfa)->lock);
+    p_delete(&(*dfa)->nodes);
+    p_delete(&(*dfa)->sets);
+    p_delete(dfa);
+}
+
+bool regexp_dfa_match(regexp_dfa_t *dfa, const char *str, ssize_t len)
+{
+    regexp_dfa_state_t *state = regexp_dfa_state(dfa, 0);
+
+    for (ssize_t pos = 0 ; pos < len ; ++pos) {
+        int cls, next;
+
+        if (state->match
+        &&  (!dfa->anchored_end || (pos == len - 1 && str[pos] == '\n'))) {
+            return true;
+        }
+        if (state->len == 0) {
+            return false;
+        }
+        cls  = dfa->classes[(uint8_t)str[pos]];
+        next = __atomic_load_n(&state->next[cls], __ATOMIC_ACQUIRE);
+        if (unlikely(next < 0)) {
+            next = regexp_dfa_transition(dfa, state, cls);
+            if (next < 0) {
+                return regexp_dfa_simulate(dfa, state, str, pos, len);
+            }
+        }
+        state = regexp_dfa_state(dfa, next);
+    }
+    return state->match;
+}
+
+int regexp_dfa_captures(const regexp_dfa_t *dfa)
+{
+    return dfa->captures;
+}
+
+size_t regexp_dfa_memory(const regexp_dfa_t *dfa)
+{
+    return dfa->memory;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,82 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#ifndef PFIXTOOLS_REGEXP_DFA_H
+#define PFIXTOOLS_REGEXP_DFA_H
+
+#include "common.h"
+
+/* Lazy DFA for the common subset of the regexps.
+ *
+ * The subset is made of literals, character classes (including \d, \w, \s
+ * and their negations), '.', groups, alternation, the '*', '+' and '?'
+ * quantifiers, a '^' at the beginning of the pattern and a '$' at its end.
+ * Patterns in the subset are compiled in a Thompson NFA, whose states are
+ * determinized on demand while matching. Matching is linear in the length
+ * of the subject.
+ *
+ * The determinized states are cached in the DFA, up to a bound. Once the
+ * cache is full, the match goes on by simulating the NFA, which is still
+ * linear. The DFA can be shared by several threads.
+ */
+
+typedef struct regexp_dfa_t regexp_dfa_t;
+
+/** Compile a pattern.
+ * \return NULL if the pattern is not in the supported subset.
+ */
+__attribute__((nonnull))
+regexp_dfa_t *regexp_dfa_new(const char *pattern, ssize_t len, bool cs);
+
+void regexp_dfa_delete(regexp_dfa_t **dfa);
+
+/** Match the given string against the DFA.
+ */
+__attribute__((nonnull))
+bool regexp_dfa_match(regexp_dfa_t *dfa, const char *str, ssize_t len);
+
+/** Number of capture groups of the pattern.
+ */
+__attribute__((nonnull))
+int regexp_dfa_captures(const regexp_dfa_t *dfa);
+
+/** Memory used by the DFA.
+ */
+__attribute__((nonnull))
+size_t regexp_dfa_memory(const regexp_dfa_t *dfa);
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,206 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+
+/* Differential check of the lazy DFA against the PCRE engine.
+ *
+ * Random patterns of the subset of the DFA are matched against random
+ * subjects by both the DFA and the engine the library is built with. The
+ * same patterns are compiled by regexp_compile, which must select the DFA
+ * (or a literal comparison), and its matches and captures are checked
+ * against the engine as well. The patterns and subjects only depend on the
+ * seed, a mismatch can be replayed with the same arguments:
+ *
+ *     regexp_dfa_check [seed [patterns]]
+ */
+
+#include "regexp_check.h"
+#include "regexp_dfa.h"
+
+#define CHECK_SUBJECTS     40
+#define CHECK_SUBJECT_LEN  16
+
+
+/* Generation {{{1
+ */
+
+static void check_gen(buffer_t *pat, int depth)
+{
+    static const char * const atoms[] = {
+        "a", "b", "c", "B", "\\.", ".", "[ab]", "[^a]", "[a-c]", "[^\\n]",
+        "\\d", "\\D", "\\w", "\\W", "\\s", "\\S",
+    };
+    int k = check_rand(depth > 3 ? 3 : 10);
+
+    if (k < 3 || depth > 5) {
+        buffer_addstr(pat, atoms[check_rand(countof(atoms))]);
+    } else
+    if (k < 5) {
+        check_gen(pat, depth + 1);
+        check_gen(pat, depth + 1);
+    } else
+    if (k < 7) {
+        buffer_addch(pat, '(');
+        check_gen(pat, depth + 1);
+        buffer_addch(pat, '|');
+        check_gen(pat, depth + 1);
+        buffer_addch(pat, ')');
+    } else {
+        buffer_addch(pat, '(');
+        check_gen(pat, depth + 1);
+        buffer_addch(pat, ')');
+        buffer_addch(pat, "*+?"[check_rand(3)]);
+    }
+}
+
+static uint64_t check_engine_matches(void)
+{
+    regexp_stats_t stats;
+
+    regexp_get_stats(&stats);
+    return stats.matches[REGEXP_KIND_PCRE];
+}
+
+static void check_mismatch(const char *what, const buffer_t *pat, bool cs,
+                           const char *str, int len, int got, int expected)
+{
+    printf("%s mismatch: /%s/%s on \"", what, pat->data, cs ? "" : "i");
+    check_print(str, len);
+    printf("\": %d, pcre %d\n", got, expected);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char subject_chars[] = "abcAB.1 _\n";
+    buffer_t pat = BUFFER_INIT;
+    int patterns = argc > 2 ? atoi(argv[2]) : 5000;
+    int checks = 0, undecided = 0;
+
+    check_seed(argc, argv);
+    for (int i = 0 ; i < patterns ; ++i) {
+        bool cs = check_rand(2);
+        regexp_dfa_t *dfa;
+        check_code_t *code;
+        regexp_t re;
+        uint64_t engine_matches;
+
+        buffer_reset(&pat);
+        if (check_rand(2)) {
+            buffer_addch(&pat, '^');
+        }
+        check_gen(&pat, 0);
+        if (check_rand(2)) {
+            buffer_addch(&pat, '$');
+        }
+
+        /* The patterns are all in the subset, and valid for the engine */
+        dfa  = regexp_dfa_new(pat.data, pat.len, cs);
+        code = check_compile(pat.data, cs);
+        if (dfa == NULL || code == NULL) {
+            printf("%s: /%s/%s\n", dfa ? "rejected by the engine"
+                                        : "not in the subset of the DFA",
+                   pat.data, cs ? "" : "i");
+            check_failures_g++;
+            regexp_dfa_delete(&dfa);
+            if (code != NULL) {
+                check_free(&code);
+            }
+            continue;
+        }
+        p_clear(&re, 1);
+        if (!regexp_compile(&re, pat.data, cs)) {
+            printf("rejected by regexp_compile: /%s/%s\n", pat.data,
+                   cs ? "" : "i");
+            check_failures_g++;
+            regexp_dfa_delete(&dfa);
+            check_free(&code);
+            continue;
+        }
+
+        engine_matches = check_engine_matches();
+        for (int j = 0 ; j < CHECK_SUBJECTS ; ++j) {
+            char str[CHECK_SUBJECT_LEN];
+            const clstr_t s = { str, check_rand(CHECK_SUBJECT_LEN) };
+            clstr_t captures[CHECK_CAPTURES];
+            int ovector[2 * CHECK_CAPTURES];
+            int e, n;
+            bool d, m;
+
+            for (int c = 0 ; c < s.len ; ++c) {
+                str[c] = subject_chars[check_rand(sizeof(subject_chars) - 1)];
+            }
+            e = check_exec(code, str, s.len, ovector);
+            if (e < 0) {
+                undecided++;
+                continue;
+            }
+            checks++;
+            d = regexp_dfa_match(dfa, str, s.len);
+            if (d != (e > 0)) {
+                check_mismatch("dfa", &pat, cs, str, s.len, d, e > 0);
+                check_failures_g++;
+            }
+            m = regexp_match_str(&re, &s);
+            if (m != (e > 0)) {
+                check_mismatch("regexp", &pat, cs, str, s.len, m, e > 0);
+                check_failures_g++;
+            }
+            n = regexp_exec_captures(&re, &s, captures, countof(captures));
+            if ((n > 0) != (e > 0)
+            ||  (n > 0 && !check_captures(str, captures, n, ovector, e))) {
+                check_mismatch("captures", &pat, cs, str, s.len, n, e);
+                check_failures_g++;
+            }
+        }
+
+        /* regexp_compile must not have selected the engine */
+        if (check_engine_matches() != engine_matches) {
+            printf("matched by the engine: /%s/%s\n", pat.data,
+                   cs ? "" : "i");
+            check_failures_g++;
+        }
+        regexp_wipe(&re);
+        regexp_dfa_delete(&dfa);
+        check_free(&code);
+    }
+
+    printf("%d patterns, %d subjects, %d given up by the engine, "
+           "%d failures\n", patterns, checks, undecided,
+           check_failures_g);
+    buffer_wipe(&pat);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,210 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Check of the interning of the regexps: sharing of the compiled code,
+ * reference counting, and interplay of the lazy and eager interning, from
+ * one thread and from several ones.
+ *
+ *     regexp_intern_check
+ */
+
+#include <pthread.h>
+#include "regexp_check.h"
+
+#define CHECK_THREADS   8
+#define CHECK_ROUNDS    200
+#define CHECK_DISTINCT  16
+
+static regexp_stats_t check_stats(void)
+{
+    regexp_stats_t stats;
+
+    regexp_get_stats(&stats);
+    return stats;
+}
+
+static void check_sharing(void)
+{
+    const regexp_stats_t base = check_stats();
+    const char buf[] = "^a(?=b)\\w+$ and more";
+    const clstr_t slice = { buf, 11 };
+    regexp_t a, b, c, d, e;
+
+    CHECK(regexp_intern(&a, "^a(?=b)\\w+$", true));
+    CHECK(regexp_intern(&b, "^a(?=b)\\w+$", true));
+    CHECK(a.code == b.code);
+
+    /* Same pattern in a string that is not NUL-terminated */
+    CHECK(regexp_intern_str(&c, &slice, true));
+    CHECK(c.code == a.code);
+
+    /* The flags are part of the key */
+    CHECK(regexp_intern(&d, "^a(?=b)\\w+$", false));
+    CHECK(d.code != a.code);
+
+    /* Compiled regexps are not shared */
+    CHECK(regexp_compile(&e, "^a(?=b)\\w+$", true));
+    CHECK(e.code != a.code);
+
+    CHECK(check_stats().regexps == base.regexps + 3);
+    CHECK(check_stats().interned == base.interned + 2);
+    CHECK(check_stats().intern_hits == base.intern_hits + 2);
+
+    /* The code lives as long as one of its users */
+    regexp_wipe(&a);
+    regexp_wipe(&c);
+    CHECK(check_stats().regexps == base.regexps + 3);
+    CHECK(regexp_match(&b, "abc"));
+    CHECK(!regexp_match(&b, "Abc"));
+    CHECK(regexp_match(&d, "Abc"));
+    regexp_wipe(&b);
+    regexp_wipe(&d);
+    regexp_wipe(&e);
+    CHECK(check_stats().regexps == base.regexps);
+    CHECK(check_stats().interned == base.interned);
+}
+
+static void check_lazy(void)
+{
+    const regexp_stats_t base = check_stats();
+    regexp_t a, b, c, d;
+
+    /* A lazy intern does not compile */
+    regexp_intern_lazy(&a, "^x(?=y)\\w{2}", true);
+    CHECK(check_stats().pending == base.pending + 1);
+    CHECK(regexp_intern(&b, "^x(?=y)\\w{2}", true));
+    CHECK(b.code == a.code);
+    CHECK(check_stats().pending == base.pending);
+    CHECK(regexp_match(&a, "xyz"));
+
+    /* An eager intern of a lazily interned invalid pattern fails, the
+     * first time and the next ones.
+     */
+    regexp_intern_lazy(&c, "^x(y", true);
+    CHECK(!regexp_intern(&d, "^x(y", true));
+    CHECK(d.code == NULL);
+    CHECK(!regexp_intern(&d, "^x(y", true));
+    CHECK(!regexp_match(&c, "xy"));
+
+    regexp_wipe(&a);
+    regexp_wipe(&b);
+    regexp_wipe(&c);
+    CHECK(check_stats().regexps == base.regexps);
+    CHECK(check_stats().pending == base.pending);
+}
+
+static void check_bulk(void)
+{
+    const regexp_stats_t base = check_stats();
+    clstr_t patterns[10 * CHECK_DISTINCT];
+    regexp_t res[countof(patterns)];
+    char buf[countof(patterns)][32];
+
+    for (int i = 0 ; i < countof(patterns) ; ++i) {
+        patterns[i].str = buf[i];
+        patterns[i].len = snprintf(buf[i], sizeof(buf[i]), "^p%d(?=q)",
+                                   i % CHECK_DISTINCT);
+    }
+    p_clear(res, countof(res));
+    CHECK(regexp_compile_many(res, patterns, countof(patterns), true,
+                              true) == 0);
+    CHECK(check_stats().interned == base.interned + CHECK_DISTINCT);
+    for (int i = 0 ; i < countof(patterns) ; ++i) {
+        CHECK(res[i].code == res[i % CHECK_DISTINCT].code);
+    }
+    for (int i = 0 ; i < countof(patterns) ; ++i) {
+        regexp_wipe(&res[i]);
+    }
+    CHECK(check_stats().regexps == base.regexps);
+}
+
+static void *check_thread(void *arg)
+{
+    const long id = (long)arg;
+    regexp_t res[CHECK_DISTINCT];
+
+    for (int round = 0 ; round < CHECK_ROUNDS ; ++round) {
+        for (int i = 0 ; i < CHECK_DISTINCT ; ++i) {
+            char pattern[32], subject[32];
+
+            snprintf(pattern, sizeof(pattern), "^t%d(?=u)\\w$", i);
+            snprintf(subject, sizeof(subject), "t%du", i);
+            if ((id + round + i) % 2) {
+                regexp_intern_lazy(&res[i], pattern, true);
+            } else {
+                CHECK(regexp_intern(&res[i], pattern, true));
+            }
+            CHECK(regexp_match(&res[i], subject));
+        }
+        for (int i = 0 ; i < CHECK_DISTINCT ; ++i) {
+            regexp_wipe(&res[i]);
+        }
+    }
+    regexp_thread_wipe();
+    return NULL;
+}
+
+static void check_threads(void)
+{
+    const regexp_stats_t base = check_stats();
+    pthread_t threads[CHECK_THREADS];
+
+    for (long i = 0 ; i < CHECK_THREADS ; ++i) {
+        CHECK(pthread_create(&threads[i], NULL, check_thread,
+                             (void *)i) == 0);
+    }
+    for (int i = 0 ; i < CHECK_THREADS ; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    CHECK(check_stats().regexps == base.regexps);
+    CHECK(check_stats().interned == base.interned);
+    CHECK(check_stats().pending == base.pending);
+}
+
+int main(void)
+{
+    /* Some patterns are invalid on purpose */
+    log_level = LOG_CRIT;
+
+    check_sharing();
+    check_lazy();
+    check_bulk();
+    check_threads();
+
+    printf("regexp interning: %d failures\n", check_failures_g);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
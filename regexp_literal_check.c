@@ -0,0 +1,204 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Differential check of the literal patterns.
+ *
+ * Random literals, anchored or not, are compiled by regexp_compile, and
+ * random subjects are matched by the library and by the PCRE engine: both
+ * must agree on the match and on the matched part of the subject. Each
+ * pattern must also be matched by the literal kind expected from its
+ * anchors and flags, not by the engine or the DFA. A mismatch can be
+ * replayed with the same arguments:
+ *
+ *     regexp_literal_check [seed [patterns]]
+ */
+
+#include "regexp_check.h"
+
+#define CHECK_SUBJECTS     40
+#define CHECK_SUBJECT_LEN  12
+
+static const char check_chars_g[] = "aAbB.$\\/ \n";
+
+/** Generate a literal of the characters the subjects are made of, with its
+ * punctuation escaped or not when it does not need to be.
+ */
+static void check_gen(buffer_t *pat)
+{
+    int len = check_rand(5);
+
+    for (int i = 0 ; i < len ; ++i) {
+        int c = check_chars_g[check_rand(sizeof(check_chars_g) - 1)];
+
+        if (c == '.' || c == '$' || c == '\\') {
+            buffer_addch(pat, '\\');
+        } else
+        if ((c == '/' || c == ' ') && check_rand(2)) {
+            buffer_addch(pat, '\\');
+        }
+        buffer_addch(pat, c);
+    }
+}
+
+static uint64_t check_kind_matches(regexp_kind_t kind)
+{
+    regexp_stats_t stats;
+
+    regexp_get_stats(&stats);
+    return stats.matches[kind];
+}
+
+static void check_mismatch(const char *what, const buffer_t *pat, bool cs,
+                           const char *str, int len, int got, int expected)
+{
+    printf("%s mismatch: /", what);
+    check_print(pat->data, pat->len);
+    printf("/%s on \"", cs ? "" : "i");
+    check_print(str, len);
+    printf("\": %d, pcre %d\n", got, expected);
+}
+
+int main(int argc, char *argv[])
+{
+    buffer_t pat = BUFFER_INIT;
+    int patterns = argc > 2 ? atoi(argv[2]) : 5000;
+    int checks = 0;
+
+    check_seed(argc, argv);
+    for (int i = 0 ; i < patterns ; ++i) {
+        const bool cs    = check_rand(2);
+        const bool start = check_rand(2);
+        const bool stop  = check_rand(2);
+        regexp_kind_t kind;
+        check_code_t *code;
+        uint64_t matches;
+        int calls = 0;
+        regexp_t re;
+
+        buffer_reset(&pat);
+        if (start) {
+            buffer_addch(&pat, '^');
+        }
+        check_gen(&pat);
+        if (stop) {
+            buffer_addch(&pat, '$');
+        }
+        kind = start && stop ? REGEXP_KIND_EXACT
+             : start         ? REGEXP_KIND_PREFIX
+             : stop          ? REGEXP_KIND_SUFFIX
+             :                 REGEXP_KIND_SUBSTRING;
+        if (!cs) {
+            kind++;
+        }
+
+        code = check_compile(pat.data, cs);
+        p_clear(&re, 1);
+        if (code == NULL || !regexp_compile(&re, pat.data, cs)) {
+            printf("rejected by %s: /", code ? "regexp_compile" : "pcre");
+            check_print(pat.data, pat.len);
+            printf("/%s\n", cs ? "" : "i");
+            check_failures_g++;
+            if (code != NULL) {
+                check_free(&code);
+            }
+            continue;
+        }
+
+        matches = check_kind_matches(kind);
+        for (int j = 0 ; j < CHECK_SUBJECTS ; ++j) {
+            char str[CHECK_SUBJECT_LEN];
+            const clstr_t s = { str, check_rand(CHECK_SUBJECT_LEN) };
+            clstr_t captures[CHECK_CAPTURES];
+            int ovector[2 * CHECK_CAPTURES];
+            int e, n;
+            bool m;
+
+            /* Half of the subjects contain the literal */
+            for (int c = 0 ; c < s.len ; ++c) {
+                str[c] = check_chars_g[check_rand(sizeof(check_chars_g) - 1)];
+            }
+            if (check_rand(2)) {
+                const char *lit = pat.data + start;
+                const int lit_len = (int)pat.len - start - stop;
+                int pos = check_rand(s.len + 1);
+
+                for (int c = 0 ; pos < s.len && c < lit_len ; ++c) {
+                    if (lit[c] == '\\') {
+                        ++c;
+                    }
+                    str[pos++] = cs || check_rand(2) ? lit[c]
+                                                     : ascii_toupper(lit[c]);
+                }
+            }
+
+            e = check_exec(code, str, s.len, ovector);
+            if (e < 0) {
+                continue;
+            }
+            checks++;
+            m = regexp_match_str(&re, &s);
+            if (m != (e > 0)) {
+                check_mismatch("regexp", &pat, cs, str, s.len, m, e > 0);
+                check_failures_g++;
+            }
+            n = regexp_exec_captures(&re, &s, captures, countof(captures));
+            if ((n > 0) != (e > 0)
+            ||  (n > 0 && !check_captures(str, captures, n, ovector, e))) {
+                check_mismatch("captures", &pat, cs, str, s.len,
+                               n > 0 ? (int)(captures[0].str - str) : -1,
+                               e > 0 ? ovector[0] : -1);
+                check_failures_g++;
+            }
+            calls += 2;
+        }
+
+        /* regexp_compile must have selected the expected literal kind */
+        if (check_kind_matches(kind) - matches != (uint64_t)calls) {
+            printf("not matched as literal kind %d: /", kind);
+            check_print(pat.data, pat.len);
+            printf("/%s\n", cs ? "" : "i");
+            check_failures_g++;
+        }
+        regexp_wipe(&re);
+        check_free(&code);
+    }
+
+    printf("%d literals, %d subjects, %d failures\n", patterns, checks,
+           check_failures_g);
+    buffer_wipe(&pat);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
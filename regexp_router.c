@@ -0,0 +1,548 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include "regexp_router.h"
+#include "trie.h"
+
+typedef struct regexp_router_pattern_t {
+    regexp_t re;
+    int      id;
+} regexp_router_pattern_t;
+ARRAY(regexp_router_pattern_t)
+
+/* A distinct literal and the patterns it indexes.
+ */
+typedef struct regexp_router_group_t {
+    uint32_t offset;
+    uint32_t len;
+    uint32_t patterns_offset;
+    uint32_t patterns_len;
+} regexp_router_group_t;
+ARRAY(regexp_router_group_t)
+
+typedef struct regexp_router_index_t {
+    trie_t *trie;
+    A(regexp_router_group_t) groups;
+    A(uint32_t)              patterns;
+} regexp_router_index_t;
+
+struct regexp_router_t {
+    A(regexp_router_pattern_t) patterns;
+    A(char)                    literals;
+
+    regexp_router_index_t      prefixes;
+    regexp_router_index_t      suffixes;
+    A(uint32_t)                residual;
+
+    bool compiled;
+};
+
+DO_INIT(regexp_router_t, regexp_router)
+regexp_router_t *regexp_router_new(void)
+{
+    return regexp_router_init(p_new(regexp_router_t, 1));
+}
+
+static void regexp_router_pattern_wipe(regexp_router_pattern_t *pattern)
+{
+    regexp_wipe(&pattern->re);
+}
+
+static void regexp_router_index_wipe(regexp_router_index_t *index)
+{
+    trie_delete(&index->trie);
+    array_wipe(index->groups);
+    array_wipe(index->patterns);
+}
+
+static void regexp_router_wipe(regexp_router_t *router)
+{
+    array_deep_wipe(router->patterns, regexp_router_pattern_wipe);
+    array_wipe(router->literals);
+    regexp_router_index_wipe(&router->prefixes);
+    regexp_router_index_wipe(&router->suffixes);
+    array_wipe(router->residual);
+}
+
+void regexp_router_delete(regexp_router_t **router)
+{
+    if (*router) {
+        regexp_router_wipe(*router);
+        p_delete(router);
+    }
+}
+
+
+/* Building {{{1
+ */
+
+/* Escape sequences that match a single character, or nothing. The other
+ * escapes of alphanumerics (\x41, \101, \p{L}, \Q...\E...) may span the
+ * characters that follow them.
+ */
+#define REGEXP_ROUTER_SHORT_ESCAPES  "dDsSwWhHvVbBAzZGRXK"
+
+/** Skip a character class, \p p points after its opening bracket.
+ * \return the position after the class, or NULL if its end is not found.
+ */
+static const char *regexp_router_skip_class(const char *p, const char *end)
+{
+    if (p < end && *p == '^') {
+        ++p;
+    }
+    if (p < end && *p == ']') {
+        ++p;
+    }
+    while (p < end) {
+        if (*p == '\\') {
+            if (p + 1 < end && p[1] == 'Q') {
+                return NULL;
+            }
+            p += 2;
+        } else
+        if (*p == '[' && p + 1 < end && strchr(":.=", p[1])) {
+            const char *close = memchr(p + 2, p[1], end - p - 2);
+            if (close == NULL || close + 1 >= end || close[1] != ']') {
+                return NULL;
+            }
+            p = close + 2;
+        } else
+        if (*p == ']') {
+            return p + 1;
+        } else {
+            ++p;
+        }
+    }
+    return NULL;
+}
+
+/** Extract the literal anchors of a regexp.
+ *
+ * The prefix is the sequence of literal characters following a leading
+ * '^', the suffix the sequence of literal characters preceding a final
+ * '$'. Only plain characters and escaped punctuation are literals; a
+ * literal followed by a quantifier is not. The regexps with an alternation,
+ * an inline option or group construct ((?...)), or an escape that may span
+ * several characters before the suffix have no reliable anchor.
+ *
+ * \return false if the regexp has no reliable anchor.
+ */
+static bool regexp_router_literal(const buffer_t *re, buffer_t *prefix,
+                                  buffer_t *suffix)
+{
+    const char *p   = re->data;
+    const char *end = re->data + re->len;
+    bool in_prefix  = (p < end && *p == '^');
+
+    buffer_reset(prefix);
+    buffer_reset(suffix);
+    if (memchr(re->data, '|', re->len) != NULL) {
+        return false;
+    }
+    if (in_prefix) {
+        ++p;
+    }
+    while (p < end) {
+        const char c = *p++;
+        int lit = -1;
+
+        switch (c) {
+          case '\\':
+            if (p == end) {
+                return false;
+            }
+            if (!isalnum(*p)) {
+                lit = *p++;
+            } else
+            if (strchr(REGEXP_ROUTER_SHORT_ESCAPES, *p)) {
+                ++p;
+            } else {
+                /* The end of the escape is unknown: none of the following
+                 * characters can be trusted.
+                 */
+                buffer_reset(suffix);
+                return true;
+            }
+            break;
+
+          case '(':
+            if (p < end && *p == '?') {
+                return false;
+            }
+            break;
+
+          case '[':
+            p = regexp_router_skip_class(p, end);
+            if (p == NULL) {
+                return false;
+            }
+            break;
+
+          case '{': {
+            /* A {n,m} quantifier, or a '{' that is not a literal */
+            const char *q = p;
+
+            while (q < end && (isdigit(*q) || *q == ',')) {
+                ++q;
+            }
+            if (q < end && *q == '}') {
+                p = q + 1;
+            }
+          }
+            /* FALLTHROUGH */
+
+          case '*': case '+': case '?':
+            /* The quantified literal is optional or repeated */
+            if (in_prefix && prefix->len > 0) {
+                prefix->data[--prefix->len] = '\0';
+            }
+            in_prefix = false;
+            buffer_reset(suffix);
+            continue;
+
+          case '$':
+            if (p == end) {
+                /* Final anchor: keep the suffix */
+                return true;
+            }
+            break;
+
+          case ')': case '.': case '^': case '\0':
+            break;
+
+          default:
+            lit = c;
+            break;
+        }
+        if (lit <= 0) {
+            in_prefix = false;
+            buffer_reset(suffix);
+            continue;
+        }
+        if (in_prefix) {
+            buffer_addch(prefix, lit);
+        }
+        buffer_addch(suffix, lit);
+    }
+
+    /* No final anchor */
+    buffer_reset(suffix);
+    return true;
+}
+
+static void regexp_router_add_literal(regexp_router_t *router,
+                                      regexp_router_index_t *index,
+                                      const buffer_t *literal, bool reverse)
+{
+    /* Until the compilation, patterns_offset is the index of the pattern.
+     */
+    const regexp_router_group_t group = {
+        .offset          = router->literals.len,
+        .len             = literal->len,
+        .patterns_offset = router->patterns.len,
+        .patterns_len    = 1,
+    };
+
+    for (uint32_t i = 0 ; i < literal->len ; ++i) {
+        const uint32_t pos = reverse ? literal->len - i - 1 : i;
+        array_add(router->literals, ascii_tolower(array_elt(*literal, pos)));
+    }
+    array_add(index->groups, group);
+}
+
+bool regexp_router_add_str(regexp_router_t *router, const clstr_t *str,
+                           int id)
+{
+    buffer_t prefix = BUFFER_INIT;
+    buffer_t suffix = BUFFER_INIT;
+    buffer_t re     = BUFFER_INIT;
+    regexp_router_pattern_t pattern = { .id = id };
+    bool cs = true;
+    bool ok = false;
+
+    assert(!router->compiled && "Regexp router already compiled");
+    if (!regexp_parse_str(str, NULL, &re, NULL, &cs)
+    ||  !regexp_intern(&pattern.re, re.data, cs)) {
+        goto end;
+    }
+
+    if (!regexp_router_literal(&re, &prefix, &suffix)) {
+        array_add(router->residual, router->patterns.len);
+    } else if (prefix.len > 0) {
+        regexp_router_add_literal(router, &router->prefixes, &prefix, false);
+    } else if (suffix.len > 0) {
+        regexp_router_add_literal(router, &router->suffixes, &suffix, true);
+    } else {
+        array_add(router->residual, router->patterns.len);
+    }
+    array_add(router->patterns, pattern);
+    ok = true;
+
+  end:
+    buffer_wipe(&prefix);
+    buffer_wipe(&suffix);
+    buffer_wipe(&re);
+    return ok;
+}
+
+bool regexp_router_add(regexp_router_t *router, const char *str, int id)
+{
+    clstr_t s = { str, m_strlen(str) };
+    return regexp_router_add_str(router, &s, id);
+}
+
+static inline clstr_t group_literal(const regexp_router_t *router,
+                                    const regexp_router_group_t *group)
+{
+    clstr_t literal = { array_ptr(router->literals, group->offset),
+                        group->len };
+    return literal;
+}
+
+/** Order the groups by literal, then by pattern.
+ */
+static inline int group_cmp(const regexp_router_t *router,
+                            const regexp_router_group_t *a,
+                            const regexp_router_group_t *b)
+{
+    const clstr_t la = group_literal(router, a);
+    const clstr_t lb = group_literal(router, b);
+    int cmp = memcmp(la.str, lb.str, MIN(la.len, lb.len));
+
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (la.len != lb.len) {
+        return la.len < lb.len ? -1 : 1;
+    }
+    return a->patterns_offset < b->patterns_offset ? -1
+         : a->patterns_offset > b->patterns_offset;
+}
+
+static bool regexp_router_index_compile(regexp_router_t *router,
+                                        regexp_router_index_t *index,
+                                        bool memlock)
+{
+    uint32_t groups = 0;
+
+    if (index->groups.len == 0) {
+        return true;
+    }
+
+    {
+#       define QSORT_TYPE regexp_router_group_t
+#       define QSORT_BASE index->groups.data
+#       define QSORT_NELT index->groups.len
+#       define QSORT_LT(a,b) group_cmp(router, a, b) < 0
+#       include "qsort.c"
+#       undef QSORT_TYPE
+#       undef QSORT_BASE
+#       undef QSORT_NELT
+#       undef QSORT_LT
+    }
+
+    /* Merge the groups sharing the same literal.
+     */
+    index->trie = trie_new();
+    for (uint32_t i = 0 ; i < index->groups.len ; ++i) {
+        regexp_router_group_t group = array_elt(index->groups, i);
+        const clstr_t literal = group_literal(router, &group);
+
+        array_add(index->patterns, group.patterns_offset);
+        if (groups > 0) {
+            regexp_router_group_t *last = array_ptr(index->groups,
+                                                    groups - 1);
+            if (clstr_equals(group_literal(router, last), literal)) {
+                ++last->patterns_len;
+                continue;
+            }
+        }
+        group.patterns_offset = index->patterns.len - 1;
+        array_elt(index->groups, groups++) = group;
+        if (!trie_insert_str(index->trie, &literal)) {
+            return false;
+        }
+    }
+    index->groups.len = groups;
+    array_adjust(index->groups);
+    array_adjust(index->patterns);
+    return trie_compile(index->trie, memlock);
+}
+
+bool regexp_router_compile(regexp_router_t *router, bool memlock)
+{
+    assert(!router->compiled && "Regexp router already compiled");
+    if (!regexp_router_index_compile(router, &router->prefixes, memlock)
+    ||  !regexp_router_index_compile(router, &router->suffixes, memlock)) {
+        return false;
+    }
+    array_adjust(router->patterns);
+    array_adjust(router->residual);
+    router->compiled = true;
+    return true;
+}
+
+
+/* Matching {{{1
+ */
+
+typedef struct regexp_router_lookup_t {
+    const regexp_router_t       *router;
+    const regexp_router_index_t *index;
+    const char                  *key;
+    A(int)                      *candidates;
+} regexp_router_lookup_t;
+
+static void regexp_router_lookup_cb(const trie_match_t *match, void *data)
+{
+    const regexp_router_lookup_t *lookup = data;
+    const regexp_router_index_t *index = lookup->index;
+    const clstr_t literal = { lookup->key, match->match_len };
+    uint32_t start = 0;
+    uint32_t end   = index->groups.len;
+
+    while (start < end) {
+        const uint32_t mid = (start + end) >> 1;
+        const regexp_router_group_t *group = array_ptr(index->groups, mid);
+        const clstr_t glit = group_literal(lookup->router, group);
+        int cmp = memcmp(literal.str, glit.str, MIN(literal.len, glit.len));
+
+        if (cmp == 0) {
+            cmp = literal.len < glit.len ? -1 : literal.len > glit.len;
+        }
+        if (cmp == 0) {
+            for (uint32_t i = 0 ; i < group->patterns_len ; ++i) {
+                array_add(*lookup->candidates,
+                          array_elt(index->patterns,
+                                    group->patterns_offset + i));
+            }
+            return;
+        }
+        if (cmp < 0) {
+            end = mid;
+        } else {
+            start = mid + 1;
+        }
+    }
+}
+
+static void regexp_router_lookup(const regexp_router_t *router,
+                                 const regexp_router_index_t *index,
+                                 const char *key, A(int) *candidates)
+{
+    regexp_router_lookup_t lookup = { router, index, key, candidates };
+
+    if (index->trie != NULL) {
+        trie_prefix_foreach(index->trie, key, regexp_router_lookup_cb,
+                            &lookup);
+    }
+}
+
+int regexp_router_match_str(const regexp_router_t *router,
+                            const clstr_t *str, A(int) *ids)
+{
+    char  buf[2 * BUFSIZ];
+    char *lower = buf;
+    char *reversed;
+    uint32_t matches = 0;
+    int previous = -1;
+
+    assert(router->compiled && "Can't match: regexp router not compiled");
+    ids->len = 0;
+
+    /* Build the lower-cased key and reversed key.
+     */
+    if (str->len >= BUFSIZ) {
+        lower = p_new(char, 2 * (str->len + 1));
+    }
+    reversed = lower + str->len + 1;
+    for (ssize_t i = 0 ; i < str->len ; ++i) {
+        lower[i] = ascii_tolower(str->str[i]);
+        reversed[str->len - i - 1] = lower[i];
+    }
+    lower[str->len]    = '\0';
+    reversed[str->len] = '\0';
+
+    regexp_router_lookup(router, &router->prefixes, lower, ids);
+    regexp_router_lookup(router, &router->suffixes, reversed, ids);
+    if (str->len > 0 && reversed[0] == '\n') {
+        /* $ also matches before a final newline */
+        regexp_router_lookup(router, &router->suffixes, reversed + 1, ids);
+    }
+    if (lower != buf) {
+        p_delete(&lower);
+    }
+    if (router->residual.len > 0) {
+        array_append(*ids, router->residual.data, router->residual.len);
+    }
+
+    /* Run the candidates in order.
+     */
+    if (ids->len > 1) {
+#       define QSORT_TYPE int
+#       define QSORT_BASE ids->data
+#       define QSORT_NELT ids->len
+#       define QSORT_LT(a,b) *(a) < *(b)
+#       include "qsort.c"
+#       undef QSORT_TYPE
+#       undef QSORT_BASE
+#       undef QSORT_NELT
+#       undef QSORT_LT
+    }
+    for (uint32_t i = 0 ; i < ids->len ; ++i) {
+        const int pattern = array_elt(*ids, i);
+        const regexp_router_pattern_t *p;
+
+        if (pattern == previous) {
+            continue;
+        }
+        previous = pattern;
+        p = array_ptr(router->patterns, pattern);
+        if (regexp_match_str(&p->re, str)) {
+            array_elt(*ids, matches++) = p->id;
+        }
+    }
+    ids->len = matches;
+    return matches;
+}
+
+int regexp_router_match(const regexp_router_t *router, const char *str,
+                        A(int) *ids)
+{
+    clstr_t s = { str, m_strlen(str) };
+    return regexp_router_match_str(router, &s, ids);
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,87 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#ifndef PFIXTOOLS_REGEXP_ROUTER_H
+#define PFIXTOOLS_REGEXP_ROUTER_H
+
+#include "regexp.h"
+
+/* Dispatch of a string to the regexps that may match it.
+ *
+ * The literal prefix (/^prefix.../) or suffix (/...suffix$/) of each regexp
+ * is used to index it in a trie of prefixes or in a trie of reversed
+ * suffixes. Only plain characters and escaped punctuation make a literal.
+ * A lookup only runs the regexps whose literal anchor matches the string,
+ * plus the regexps with no usable literal anchor (the residual list).
+ */
+
+typedef struct regexp_router_t regexp_router_t;
+
+regexp_router_t *regexp_router_new(void);
+void regexp_router_delete(regexp_router_t **router);
+
+/** Add a regexp in the /regexp/modifiers format to the router.
+ * \p id is the identifier reported when the regexp matches.
+ */
+__attribute__((nonnull(1,2)))
+bool regexp_router_add_str(regexp_router_t *router, const clstr_t *str,
+                           int id);
+
+__attribute__((nonnull(1,2)))
+bool regexp_router_add(regexp_router_t *router, const char *str, int id);
+
+/** Build the indexes.
+ * \param memlock if true, the tries are locked into the RAM.
+ */
+__attribute__((nonnull(1)))
+bool regexp_router_compile(regexp_router_t *router, bool memlock);
+
+/** Match the string against the regexps of the router.
+ * \p ids is filled with the identifiers of the matching regexps, in the
+ * order of insertion in the router.
+ *
+ * \return the number of matching regexps.
+ */
+__attribute__((nonnull(1,2,3)))
+int regexp_router_match_str(const regexp_router_t *router,
+                            const clstr_t *str, A(int) *ids);
+
+__attribute__((nonnull(1,2,3)))
+int regexp_router_match(const regexp_router_t *router, const char *str,
+                        A(int) *ids);
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
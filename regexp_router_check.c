@@ -0,0 +1,171 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Differential check of the regexp router.
+ *
+ * Random sets of /regexp/i patterns are loaded in a router, and random
+ * subjects are dispatched by the router and matched against every pattern
+ * of the set: both must report the same patterns. The patterns are made
+ * of the constructs that are easily mistaken for literals (escapes,
+ * classes, quantifiers, options...). A mismatch can be replayed with the
+ * same arguments:
+ *
+ *     regexp_router_check [seed [routers]]
+ */
+
+#include "regexp_check.h"
+#include "regexp_router.h"
+
+#define CHECK_PATTERNS     40
+#define CHECK_SUBJECTS     200
+#define CHECK_SUBJECT_LEN  10
+
+static void check_gen(buffer_t *pat)
+{
+    static const char * const atoms[] = {
+        "a", "b", "A", "x", ".", "\\.", "\\$", "\\/", "\\x61", "\\141",
+        "\\d", "\\w", "\\b", "\\n", "[ab]", "[]a]", "[^a]", "(a)", "(?i)",
+        "(?:b)", "\\Qa.\\E", "#", " ", "$", "^",
+    };
+    static const char * const quantifiers[] = {
+        "*", "+", "?", "{2}", "{1,2}", "*?", "++", "{",
+    };
+    int atoms_len = 1 + check_rand(5);
+
+    buffer_addch(pat, '/');
+    if (check_rand(3) != 0) {
+        buffer_addch(pat, '^');
+    }
+    for (int i = 0 ; i < atoms_len ; ++i) {
+        if (check_rand(4) == 0) {
+            buffer_addstr(pat, atoms[check_rand(countof(atoms))]);
+        } else {
+            buffer_addch(pat, "abAx"[check_rand(4)]);
+        }
+        if (check_rand(5) == 0) {
+            buffer_addstr(pat, quantifiers[check_rand(countof(quantifiers))]);
+        }
+        if (check_rand(20) == 0) {
+            buffer_addch(pat, '|');
+        }
+    }
+    if (check_rand(3) != 0) {
+        buffer_addch(pat, '$');
+    }
+    buffer_addch(pat, '/');
+    if (check_rand(2)) {
+        buffer_addch(pat, 'i');
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const char subject_chars[] = "abAx.$/ 1\n";
+    int routers = argc > 2 ? atoi(argv[2]) : 200;
+    int checks = 0;
+    buffer_t pats[CHECK_PATTERNS];
+    regexp_t res[CHECK_PATTERNS];
+    bool valid[CHECK_PATTERNS];
+    buffer_t body = BUFFER_INIT;
+    A(int) ids = ARRAY_INIT;
+
+    check_seed(argc, argv);
+    p_clear(pats, countof(pats));
+
+    /* Some of the patterns are invalid, and rejected by both sides */
+    log_level = LOG_CRIT;
+
+    for (int r = 0 ; r < routers ; ++r) {
+        regexp_router_t *router = regexp_router_new();
+
+        for (int i = 0 ; i < CHECK_PATTERNS ; ++i) {
+            bool cs;
+
+            buffer_reset(&pats[i]);
+            check_gen(&pats[i]);
+            p_clear(&res[i], 1);
+            valid[i] = regexp_parse(pats[i].data, NULL, &body, NULL, &cs)
+                    && regexp_compile(&res[i], body.data, cs);
+            if (valid[i] != regexp_router_add(router, pats[i].data, i)) {
+                printf("router and engine disagree on %s\n", pats[i].data);
+                check_failures_g++;
+                valid[i] = false;
+            }
+        }
+        regexp_router_compile(router, false);
+
+        for (int j = 0 ; j < CHECK_SUBJECTS ; ++j) {
+            char str[CHECK_SUBJECT_LEN];
+            const clstr_t s = { str, check_rand(CHECK_SUBJECT_LEN) };
+            uint32_t pos = 0;
+
+            for (int c = 0 ; c < s.len ; ++c) {
+                str[c] = subject_chars[check_rand(sizeof(subject_chars) - 1)];
+            }
+            regexp_router_match_str(router, &s, &ids);
+            checks++;
+            for (int i = 0 ; i < CHECK_PATTERNS ; ++i) {
+                const bool routed = pos < ids.len
+                                 && array_elt(ids, pos) == i;
+                const bool matched = valid[i]
+                                  && regexp_match_str(&res[i], &s);
+
+                pos += routed;
+                if (routed != matched) {
+                    printf("mismatch: %s on \"", pats[i].data);
+                    check_print(s.str, s.len);
+                    printf("\": router %d, regexp %d\n", routed, matched);
+                    check_failures_g++;
+                }
+            }
+        }
+
+        regexp_router_delete(&router);
+        for (int i = 0 ; i < CHECK_PATTERNS ; ++i) {
+            regexp_wipe(&res[i]);
+        }
+    }
+
+    printf("%d routers, %d subjects, %d failures\n", routers, checks,
+           check_failures_g);
+    for (int i = 0 ; i < CHECK_PATTERNS ; ++i) {
+        buffer_wipe(&pats[i]);
+    }
+    buffer_wipe(&body);
+    array_wipe(ids);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
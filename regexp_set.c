@@ -0,0 +1,590 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#include "regexp_set.h"
+
+typedef struct regexp_set_pattern_t {
+    regexp_t re;
+    int      id;
+} regexp_set_pattern_t;
+ARRAY(regexp_set_pattern_t)
+
+/* A node of the automaton. Outgoing edges are sorted by character. The
+ * dictionary link is the first node of the failure chain that has outputs.
+ */
+typedef struct regexp_set_node_t {
+    uint32_t fail;
+    uint32_t dict;
+    uint32_t edges_offset;
+    uint32_t outputs_offset;
+    uint16_t edges_len;
+    uint16_t outputs_len;
+} regexp_set_node_t;
+ARRAY(regexp_set_node_t)
+
+typedef struct regexp_set_edge_t {
+    uint32_t child;
+    uint8_t  c;
+} regexp_set_edge_t;
+ARRAY(regexp_set_edge_t)
+
+/* Build stuff: literal of a pattern, and range of (sorted) literals
+ * covered by a node.
+ */
+typedef struct regexp_set_key_t {
+    uint32_t offset;
+    uint32_t len;
+    uint32_t pattern;
+} regexp_set_key_t;
+ARRAY(regexp_set_key_t)
+
+typedef struct regexp_set_range_t {
+    uint32_t first;
+    uint32_t last;
+    uint32_t depth;
+} regexp_set_range_t;
+ARRAY(regexp_set_range_t)
+
+struct regexp_set_t {
+    A(regexp_set_pattern_t) patterns;
+
+    A(regexp_set_node_t)    nodes;
+    A(regexp_set_edge_t)    edges;
+    A(uint32_t)             outputs;
+    A(uint32_t)             always;
+    uint32_t                root[256];
+
+    /* Build stuff */
+    A(char)                 literals;
+    A(regexp_set_key_t)     keys;
+
+    bool compiled;
+};
+
+DO_INIT(regexp_set_t, regexp_set)
+regexp_set_t *regexp_set_new(void)
+{
+    return regexp_set_init(p_new(regexp_set_t, 1));
+}
+
+static void regexp_set_pattern_wipe(regexp_set_pattern_t *pattern)
+{
+    regexp_wipe(&pattern->re);
+}
+
+static void regexp_set_wipe(regexp_set_t *set)
+{
+    array_deep_wipe(set->patterns, regexp_set_pattern_wipe);
+    array_wipe(set->nodes);
+    array_wipe(set->edges);
+    array_wipe(set->outputs);
+    array_wipe(set->always);
+    array_wipe(set->literals);
+    array_wipe(set->keys);
+}
+
+void regexp_set_delete(regexp_set_t **set)
+{
+    if (*set) {
+        regexp_set_wipe(*set);
+        p_delete(set);
+    }
+}
+
+
+/* Literal extraction {{{1
+ */
+
+/** Skip a character class starting at re[pos] (which is '[').
+ * Returns the position following the class, or -1 if it is not terminated.
+ */
+static int skip_class(const char *re, int len, int pos)
+{
+    ++pos;
+    if (pos < len && re[pos] == '^') {
+        ++pos;
+    }
+    if (pos < len && re[pos] == ']') {
+        ++pos;
+    }
+    while (pos < len && re[pos] != ']') {
+        if (re[pos] == '\\') {
+            pos += 2;
+        } else if (re[pos] == '[' && pos + 1 < len && re[pos + 1] == ':') {
+            pos += 2;
+            while (pos + 1 < len && (re[pos] != ':' || re[pos + 1] != ']')) {
+                ++pos;
+            }
+            pos += 2;
+        } else {
+            ++pos;
+        }
+    }
+    return pos < len ? pos + 1 : -1;
+}
+
+/** Skip the argument of the escape sequence \\c, re[pos] being the first
+ * character following the escaped character.
+ */
+static int skip_escape_arg(const char *re, int len, int pos, char c)
+{
+    if (pos < len && (re[pos] == '{' || re[pos] == '<' || re[pos] == '\'')
+        && (c == 'x' || c == 'o' || c == 'p' || c == 'P' || c == 'k'
+            || c == 'g' || c == 'N')) {
+        const char close = re[pos] == '{' ? '}'
+                         : re[pos] == '<' ? '>' : '\'';
+        while (pos < len && re[pos] != close) {
+            ++pos;
+        }
+        return pos + 1;
+    }
+    switch (c) {
+      case 'x':
+        for (int i = 0 ; i < 2 && pos < len && isxdigit(re[pos]) ; ++i) {
+            ++pos;
+        }
+        break;
+      case 'c': case 'p': case 'P':
+        ++pos;
+        break;
+      case 'g':
+        if (pos < len && (re[pos] == '-' || re[pos] == '+')) {
+            ++pos;
+        }
+        /* fallthrough */
+      case '0' ... '9':
+        while (pos < len && isdigit(re[pos])) {
+            ++pos;
+        }
+        break;
+    }
+    return pos;
+}
+
+static void flush_literal(buffer_t *cur, buffer_t *best)
+{
+    if (cur->len > best->len) {
+        buffer_reset(best);
+        buffer_addbuf(best, cur);
+    }
+    buffer_reset(cur);
+}
+
+/** Find the longest literal string that must appear in any string matched
+ * by the regexp \p re. The literal is lower-cased.
+ *
+ * The analysis is conservative: only the characters outside any group are
+ * considered, and patterns with alternations or inline options are
+ * rejected.
+ */
+static bool regexp_set_literal(const char *re, int len, buffer_t *best)
+{
+    buffer_t cur = BUFFER_INIT;
+    int depth = 0;
+    int pos = 0;
+
+    buffer_reset(best);
+    while (pos < len) {
+        char c = re[pos];
+        int  next = pos + 1;
+
+        switch (c) {
+          case '|':
+            goto error;
+
+          case '(':
+            if (next + 1 < len && re[next] == '?'
+                && (isalpha(re[next + 1]) || re[next + 1] == '-'
+                    || re[next + 1] == '#')) {
+                goto error;
+            }
+            flush_literal(&cur, best);
+            ++depth;
+            pos = next;
+            continue;
+
+          case ')':
+            flush_literal(&cur, best);
+            --depth;
+            pos = next;
+            continue;
+
+          case '[':
+            flush_literal(&cur, best);
+            pos = skip_class(re, len, pos);
+            if (pos < 0) {
+                goto error;
+            }
+            continue;
+
+          case '\\':
+            if (next >= len) {
+                goto error;
+            }
+            c = re[next++];
+            if (c == 'Q') {
+                goto error;
+            }
+            if (isalnum(c)) {
+                flush_literal(&cur, best);
+                pos = skip_escape_arg(re, len, next, c);
+                continue;
+            }
+            break;
+
+          case '{':
+            flush_literal(&cur, best);
+            while (next < len && re[next - 1] != '}') {
+                ++next;
+            }
+            pos = next;
+            continue;
+
+          case '.': case '^': case '$': case '*': case '+': case '?':
+            flush_literal(&cur, best);
+            pos = next;
+            continue;
+
+          default:
+            break;
+        }
+
+        /* c is a literal character */
+        pos = next;
+        if (depth > 0) {
+            continue;
+        }
+        if (next < len
+            && (re[next] == '*' || re[next] == '?' || re[next] == '{')) {
+            /* optional character */
+            flush_literal(&cur, best);
+            continue;
+        }
+        buffer_addch(&cur, ascii_tolower(c));
+        if (next < len && re[next] == '+') {
+            flush_literal(&cur, best);
+        }
+    }
+    flush_literal(&cur, best);
+    buffer_wipe(&cur);
+    return best->len > 0;
+
+  error:
+    buffer_wipe(&cur);
+    buffer_reset(best);
+    return false;
+}
+
+
+/* Building {{{1
+ */
+
+bool regexp_set_add_str(regexp_set_t *set, const clstr_t *str, int id)
+{
+    buffer_t re      = BUFFER_INIT;
+    buffer_t literal = BUFFER_INIT;
+    regexp_set_pattern_t pattern = { .id = id };
+    bool cs = true;
+    bool ok = false;
+
+    assert(!set->compiled && "Regexp set already compiled");
+    if (!regexp_parse_str(str, NULL, &re, NULL, &cs)) {
+        goto end;
+    }
+    if (!regexp_intern(&pattern.re, re.data, cs)) {
+        goto end;
+    }
+    if (regexp_set_literal(re.data, re.len, &literal)) {
+        const regexp_set_key_t key = {
+            .offset  = set->literals.len,
+            .len     = literal.len,
+            .pattern = set->patterns.len,
+        };
+        array_append(set->literals, literal.data, literal.len);
+        array_add(set->keys, key);
+    } else {
+        array_add(set->always, set->patterns.len);
+    }
+    array_add(set->patterns, pattern);
+    ok = true;
+
+  end:
+    buffer_wipe(&re);
+    buffer_wipe(&literal);
+    return ok;
+}
+
+bool regexp_set_add(regexp_set_t *set, const char *str, int id)
+{
+    clstr_t s = { str, m_strlen(str) };
+    return regexp_set_add_str(set, &s, id);
+}
+
+static inline const char *key_str(const regexp_set_t *set,
+                                  const regexp_set_key_t *key)
+{
+    return array_ptr(set->literals, key->offset);
+}
+
+static inline bool key_lt(const regexp_set_t *set,
+                          const regexp_set_key_t *a,
+                          const regexp_set_key_t *b)
+{
+    int cmp = memcmp(key_str(set, a), key_str(set, b), MIN(a->len, b->len));
+    return cmp < 0 || (cmp == 0 && a->len < b->len);
+}
+
+static inline uint32_t regexp_set_child(const regexp_set_t *set,
+                                        uint32_t node, uint8_t c)
+{
+    if (node == 0) {
+        return set->root[c];
+    } else {
+        const regexp_set_node_t *n = array_ptr(set->nodes, node);
+        uint32_t start = n->edges_offset;
+        uint32_t end   = start + n->edges_len;
+
+        while (start < end) {
+            uint32_t mid = (start + end) >> 1;
+            const regexp_set_edge_t *edge = array_ptr(set->edges, mid);
+
+            if (edge->c == c) {
+                return edge->child;
+            }
+            if (c < edge->c) {
+                end = mid;
+            } else {
+                start = mid + 1;
+            }
+        }
+        return 0;
+    }
+}
+
+bool regexp_set_compile(regexp_set_t *set)
+{
+    A(regexp_set_range_t) ranges = ARRAY_INIT;
+    const regexp_set_node_t   empty_node  = { 0, 0, 0, 0, 0, 0 };
+
+    assert(!set->compiled && "Regexp set already compiled");
+
+    /* Sort the literals (qsort.c does not support 0 elements, a set may
+     * have none)
+     */
+    if (set->keys.len > 1) {
+#       define QSORT_TYPE regexp_set_key_t
+#       define QSORT_BASE set->keys.data
+#       define QSORT_NELT set->keys.len
+#       define QSORT_LT(a,b) key_lt(set, a, b)
+#       include "qsort.c"
+#       undef QSORT_TYPE
+#       undef QSORT_BASE
+#       undef QSORT_NELT
+#       undef QSORT_LT
+    }
+
+    /* Build the goto function: nodes are created in breadth-first order,
+     * each node covering the range of literals sharing its prefix.
+     */
+    {
+        const regexp_set_range_t root = { 0, set->keys.len, 0 };
+        array_add(set->nodes, empty_node);
+        array_add(ranges, root);
+    }
+    for (uint32_t id = 0 ; id < set->nodes.len ; ++id) {
+        const regexp_set_range_t range = array_elt(ranges, id);
+        uint32_t pos = range.first;
+        regexp_set_node_t *node;
+
+        node = array_ptr(set->nodes, id);
+        node->outputs_offset = set->outputs.len;
+        node->edges_offset   = set->edges.len;
+        while (pos < range.last
+               && array_elt(set->keys, pos).len == range.depth) {
+            array_add(set->outputs, array_elt(set->keys, pos).pattern);
+            ++pos;
+        }
+        node->outputs_len = set->outputs.len - node->outputs_offset;
+
+        while (pos < range.last) {
+            const uint8_t c = key_str(set, array_ptr(set->keys, pos))
+                                     [range.depth];
+            regexp_set_range_t child = { pos, pos, range.depth + 1 };
+            regexp_set_edge_t  edge  = { set->nodes.len, c };
+
+            while (child.last < range.last
+                   && key_str(set, array_ptr(set->keys, child.last))
+                                 [range.depth] == c) {
+                ++child.last;
+            }
+            pos = child.last;
+            array_add(set->nodes, empty_node);
+            array_add(ranges, child);
+            array_add(set->edges, edge);
+        }
+        node = array_ptr(set->nodes, id);
+        node->edges_len = set->edges.len - node->edges_offset;
+    }
+    array_wipe(ranges);
+
+    {
+        const regexp_set_node_t *root = array_ptr(set->nodes, 0);
+        for (uint32_t i = 0 ; i < root->edges_len ; ++i) {
+            const regexp_set_edge_t *edge
+                = array_ptr(set->edges, root->edges_offset + i);
+            set->root[edge->c] = edge->child;
+        }
+    }
+
+    /* Compute the failure and dictionary links. Since nodes are in
+     * breadth-first order, the links of the shallower nodes are always
+     * known.
+     */
+    for (uint32_t id = 0 ; id < set->nodes.len ; ++id) {
+        const regexp_set_node_t *node = array_ptr(set->nodes, id);
+
+        for (uint32_t i = 0 ; i < node->edges_len ; ++i) {
+            const regexp_set_edge_t *edge
+                = array_ptr(set->edges, node->edges_offset + i);
+            regexp_set_node_t *child = array_ptr(set->nodes, edge->child);
+            uint32_t fail = 0;
+
+            if (id != 0) {
+                uint32_t f = node->fail;
+                while ((fail = regexp_set_child(set, f, edge->c)) == 0
+                       && f != 0) {
+                    f = array_elt(set->nodes, f).fail;
+                }
+            }
+            child->fail = fail;
+            child->dict = array_elt(set->nodes, fail).outputs_len > 0
+                        ? fail : array_elt(set->nodes, fail).dict;
+        }
+    }
+
+    /* Cleanup structure and reduce memory consumption.
+     */
+    array_wipe(set->literals);
+    array_wipe(set->keys);
+    array_adjust(set->patterns);
+    array_adjust(set->nodes);
+    array_adjust(set->edges);
+    array_adjust(set->outputs);
+    array_adjust(set->always);
+    set->compiled = true;
+    return true;
+}
+
+
+/* Matching {{{1
+ */
+
+int regexp_set_match_str(const regexp_set_t *set, const clstr_t *str,
+                         A(int) *ids)
+{
+    uint32_t state = 0;
+    uint32_t matches = 0;
+    int previous = -1;
+
+    assert(set->compiled && "Can't match: regexp set not compiled");
+    ids->len = 0;
+
+    /* Collect the candidates: patterns whose literal appears in the
+     * string.
+     */
+    for (ssize_t i = 0 ; i < str->len ; ++i) {
+        const uint8_t c = ascii_tolower((uint8_t)str->str[i]);
+        uint32_t next = 0;
+
+        while (state != 0 && (next = regexp_set_child(set, state, c)) == 0) {
+            state = array_elt(set->nodes, state).fail;
+        }
+        state = (state != 0) ? next : set->root[c];
+
+        uint32_t out = array_elt(set->nodes, state).outputs_len > 0
+                     ? state : array_elt(set->nodes, state).dict;
+        while (out != 0) {
+            const regexp_set_node_t *node = array_ptr(set->nodes, out);
+            for (uint32_t j = 0 ; j < node->outputs_len ; ++j) {
+                const int pattern
+                    = array_elt(set->outputs, node->outputs_offset + j);
+                if (ids->len == 0 || array_last(*ids) != pattern) {
+                    array_add(*ids, pattern);
+                }
+            }
+            out = node->dict;
+        }
+    }
+    if (set->always.len > 0) {
+        array_append(*ids, set->always.data, set->always.len);
+    }
+
+    /* Run the candidates, in order, only once.
+     */
+    if (ids->len > 1) {
+#       define QSORT_TYPE int
+#       define QSORT_BASE ids->data
+#       define QSORT_NELT ids->len
+#       define QSORT_LT(a,b) *(a) < *(b)
+#       include "qsort.c"
+#       undef QSORT_TYPE
+#       undef QSORT_BASE
+#       undef QSORT_NELT
+#       undef QSORT_LT
+    }
+    for (uint32_t i = 0 ; i < ids->len ; ++i) {
+        const int pattern = array_elt(*ids, i);
+        const regexp_set_pattern_t *p;
+
+        if (pattern == previous) {
+            continue;
+        }
+        previous = pattern;
+        p = array_ptr(set->patterns, pattern);
+        if (regexp_match_str(&p->re, str)) {
+            array_elt(*ids, matches++) = p->id;
+        }
+    }
+    ids->len = matches;
+    return matches;
+}
+
+int regexp_set_match(const regexp_set_t *set, const char *str, A(int) *ids)
+{
+    clstr_t s = { str, m_strlen(str) };
+    return regexp_set_match_str(set, &s, ids);
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
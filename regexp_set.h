@@ -0,0 +1,88 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+#ifndef PFIXTOOLS_REGEXP_SET_H
+#define PFIXTOOLS_REGEXP_SET_H
+
+#include "regexp.h"
+
+/* Set of regexps matched in a single pass.
+ *
+ * A literal string that must appear in every subject matched by a regexp is
+ * extracted from each pattern. All those literals are compiled in a single
+ * automaton (Aho-Corasick) that is run once on the subject: only the
+ * regexps whose literal is found are then run. The regexps from which no
+ * literal can be extracted are always run.
+ */
+
+typedef struct regexp_set_t regexp_set_t;
+
+regexp_set_t *regexp_set_new(void);
+void regexp_set_delete(regexp_set_t **set);
+
+/** Add a regexp to the set.
+ * The regexp is given in the format parsed by \ref regexp_parse_str
+ * (/regexp/modifiers). \p id is the identifier reported when the regexp
+ * matches.
+ */
+__attribute__((nonnull(1,2)))
+bool regexp_set_add_str(regexp_set_t *set, const clstr_t *str, int id);
+
+__attribute__((nonnull(1,2)))
+bool regexp_set_add(regexp_set_t *set, const char *str, int id);
+
+/** Compile the set.
+ * The set must be compiled before lookup is possible, and no regexp can be
+ * added after that.
+ */
+__attribute__((nonnull(1)))
+bool regexp_set_compile(regexp_set_t *set);
+
+/** Match the string against all the regexps of the set.
+ * \p ids is filled with the identifiers of the matching regexps, in the
+ * order of insertion in the set.
+ *
+ * \return the number of matching regexps.
+ */
+__attribute__((nonnull(1,2,3)))
+int regexp_set_match_str(const regexp_set_t *set, const clstr_t *str,
+                         A(int) *ids);
+
+__attribute__((nonnull(1,2,3)))
+int regexp_set_match(const regexp_set_t *set, const char *str, A(int) *ids);
+
+#endif
+
+/* vim:set et sw=4 sts=4 sws=4: */
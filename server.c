@@ -33,9 +33,21 @@
 /*   see AUTHORS and source files for details                               */
 /****************************************************************************/
 
+#define _GNU_SOURCE /* pipe2 */
 #include <ev.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef HAVE_IO_URING
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#endif
 #include "server.h"
 #include "common.h"
+#include "regexp.h"
+
+ARRAY(pthread_t)
 
 typedef struct server_io_t {
     struct ev_io io;
@@ -43,23 +55,85 @@ typedef struct server_io_t {
 } server_io_t;
 #define server_of_io(s)  containerof(s, server_io_t, io);
 
+/* In multi-loop mode, each worker thread accepts through its own copies
+ * of the listeners: parent is then the listener they were made from. The
+ * copy of a TCP listener has its own socket in the SO_REUSEPORT group of
+ * the parent's, the copy of a unix one shares the parent's socket.
+ */
 struct listener_t {
     server_io_t io;
+    listener_t *parent;
+    timeout_t  *paused;     /**< accepting is suspended until it expires */
+    bool        stopped;    /**< handed over to a new process */
+    bool        reuseport;  /**< the copy has a socket of its own */
+#ifdef HAVE_IO_URING
+    bool        accepting;  /**< a multishot accept is armed in the ring */
+#endif
 };
 #define listener_of_io(l) ({                                                 \
         const server_io_t *__ser = server_of_io(l);                          \
         containerof(__ser, listener_t, io);                                  \
     })
 
+/* The output of a client is a chain of segments followed by obuf: the
+ * segments are either the former content of obuf, or slices borrowed from
+ * the caller. The chain is written with writev and consumed by moving the
+ * offsets, the data is never moved.
+ */
+typedef struct client_seg_t {
+    const char       *data;
+    size_t            len;
+    char             *owned;        /**< memory to free once written */
+    release_slice_f   release;      /**< called once a slice is written */
+    void             *owner;
+} client_seg_t;
+ARRAY(client_seg_t)
+
+#define CLIENT_IOV_MAX  64
+
 struct client_t {
     server_io_t io;
 
     buffer_t ibuf;
+    uint32_t ibuf_off;          /**< consumed input (\ref client_input_consume) */
     buffer_t obuf;
+    uint32_t obuf_off;
+    uint32_t ochain_head;
+    A(client_seg_t) ochain;
 
     run_client_f run;
     delete_client_f clear_data;
     void* data;
+
+    /* Offloaded jobs not completed yet. A client released while it has
+     * jobs in flight is only recycled once they are done.
+     */
+    int  jobs;
+    bool released;
+
+    /* In the list of the accepted clients of the loop */
+    client_t  *live_next;
+    client_t **live_pprev;
+
+#ifdef HAVE_IO_URING
+    /* State of the client in the io_uring backend (\ref server_uring_t) */
+    struct {
+        bool    on;             /**< the client is served by the ring */
+        bool    reading;        /**< a read is in flight */
+        bool    writing;        /**< a write is in flight */
+        bool    obuf;           /**< obuf is part of the write in flight */
+        bool    running;        /**< the run callback is being called */
+        bool    scheduled;      /**< in the ready list of the ring */
+        bool    starved;        /**< waiting for a buffer to read */
+        bool    eof;            /**< the peer is gone, no more reads */
+        bool    eof_seen;       /**< the end of input was reported */
+        int     error;          /**< errno of the failed read */
+        int     events;         /**< events the client waits for */
+        int     ops;            /**< requests in flight */
+        ssize_t input;          /**< received, not reported by client_read */
+    } uring;
+    struct iovec *uring_iov;
+#endif
 };
 #define client_of_io(s)  ({                                                  \
         const server_io_t *__ser = server_of_io(s);                          \
@@ -67,37 +141,297 @@ struct client_t {
     })
 
 
+/* Connections accepted per readiness event of a listener, and delay (ms)
+ * before accepting again after an error such as running out of
+ * descriptors.
+ */
+#define SERVER_ACCEPT_BATCH    64
+#define SERVER_ACCEPT_BACKOFF  100
+
+/* Maximum time a drained loop waits for its clients (ms), and period of
+ * the check of the idle clients.
+ */
+#define SERVER_DRAIN_TIMEOUT   30000
+#define SERVER_DRAIN_TICK      100
+
+/* Buffers larger than this are freed when their client is released, and
+ * at most this many clients are kept for reuse besides the preallocated
+ * ones.
+ */
+#define SERVER_CLIENT_BUF_KEEP (16 << 10)
+#define SERVER_CLIENT_POOL     256
+
+/* Period of the check of the retired configurations (ms) */
+#define SERVER_RECLAIM_TICK    20
+
+/* Timers are kept in a hierarchical timing wheel per loop: level l has
+ * SERVER_WHEEL_SLOTS slots of 64^l ticks. A timer is put in the level that
+ * covers its delay and cascaded to the lower levels as the time goes by.
+ * Arming and cancelling a timer are O(1), and a single libev timer is armed
+ * for the next tick at which something is due.
+ */
+#define SERVER_WHEEL_BITS    6
+#define SERVER_WHEEL_SLOTS   (1 << SERVER_WHEEL_BITS)
+#define SERVER_WHEEL_LEVELS  5
+#define SERVER_WHEEL_RANGE   (1ULL << (SERVER_WHEEL_BITS * SERVER_WHEEL_LEVELS))
+
 struct timeout_t {
-    struct ev_timer timer;
+    timeout_t  *next;
+    timeout_t **pprev;
+    uint64_t    expires;        /**< tick of the expiration */
+    uint16_t    slot;           /**< level * SERVER_WHEEL_SLOTS + slot */
+
     run_timeout_f run;
     void* data;
 };
-#define timeout_of_timer(t)  containerof(t, timeout_t, timer)
 
-static struct {
+typedef struct server_wheel_t {
+    struct ev_timer ticker;
+    ev_tstamp  origin;          /**< time of the tick 0 */
+    uint64_t   now;             /**< next tick to process */
+    uint64_t   wakeup;          /**< tick the ticker is armed for */
+    uint32_t   count;
+
+    uint64_t   occupied[SERVER_WHEEL_LEVELS];
+    timeout_t *slots[SERVER_WHEEL_LEVELS * SERVER_WHEEL_SLOTS];
+} server_wheel_t;
+
+/* State of an event loop. Each thread that runs a loop has its own, the
+ * clients and timers belong to the loop of the thread that created them.
+ */
+typedef struct server_job_t server_job_t;
+
+typedef struct server_thread_t {
+    struct ev_loop *loop;
     PA(listener_t)  listeners;
     PA(client_t)    client_pool;
     PA(timeout_t)   timeout_pool;
+    server_wheel_t  wheel;
+
+    pthread_t       thread;
+    struct ev_async stop;
+
+    /* Offloaded jobs completed by the pool, to be delivered by the loop */
+    struct ev_async jobs_async;
+    pthread_mutex_t jobs_lock;
+    server_job_t   *jobs_done;
+
+#ifdef HAVE_IO_URING
+    struct server_uring_t *uring;
+#endif
+
+    /* Metrics of the loop: in the stats file if any, in stats_local
+     * otherwise.
+     */
+    server_stats_t *stats;
+    server_stats_t  stats_local;
+
+    /* Epoch of the configuration seen by the loop, 0 while it waits for
+     * events (\ref server_epoch_enter).
+     */
+    uint64_t        epoch;
+
+    /* Accepted clients, closed once idle when the loop is drained */
+    client_t       *clients;
+    uint32_t        nclients;
+    uint32_t        deferred;           /**< released, jobs or ops pending */
+    bool            full;               /**< accepting suspended at the cap */
+    client_t       *slab;               /**< preallocated clients */
+    uint32_t        slab_len;
+    struct ev_async drain;
+    uint64_t        drain_deadline;     /**< usec */
+} server_thread_t;
+PARRAY(server_thread_t)
+
+/* A configuration replaced at epoch, deleted once all the threads have
+ * seen that epoch.
+ */
+typedef struct server_retired_t {
+    void     *config;
+    uint64_t  epoch;
+} server_retired_t;
+ARRAY(server_retired_t)
+
+struct server_job_t {
+    server_job_t    *next;
+    client_t        *client;
+    server_thread_t *owner;
+    run_job_f        run;
+    done_job_f       done;
+    void            *data;
+    uint64_t         submitted;
+};
+
+static struct {
+    PA(listener_t)  listeners;
 
-    struct ev_loop *loop;
     start_client_f  client_start;
     delete_client_f client_delete;
     run_client_f    client_run;
     refresh_f       config_refresh;
     void           *config;
-} server_g;
+
+    /* Admission of the connections: accept batches, and the cap on the
+     * accepted clients with its per-loop share.
+     */
+    int                accept_batch;
+    int                clients_cap;        /**< 0 for no cap */
+    int                clients_low;
+    int                max_clients;        /**< share of a loop */
+    int                low_water;          /**< share of a loop */
+
+    bool               uring;              /**< use io_uring if available */
+
+    /* Timing wheels of the loops */
+    int                timer_resolution;   /**< ms per tick */
+    int                timer_slack;        /**< ticks a timer may be late */
+
+    /* Multi-loop mode: the worker threads run the loop while holding
+     * config_lock for reading, and release it while they wait for events.
+     * The configuration is refreshed with the lock held for writing.
+     */
+    int                threads;
+    PA(server_thread_t) workers;
+    pthread_rwlock_t   config_lock;
+    bool               shared;
+
+    /* Offload pool: a FIFO of jobs bounded to queue_depth */
+    struct {
+        int             threads;
+        int             queue_depth;
+        A(pthread_t)    pool;
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;
+        server_job_t   *head;
+        server_job_t  **tail;
+        bool            stop;
+        uint64_t       *epochs;     /**< \ref server_thread_t.epoch */
+
+        server_offload_stats_t stats;
+    } offload;
+
+    /* Configuration snapshots built by a background thread
+     * (\ref server_set_config_loader).
+     */
+    struct {
+        load_config_f   load;
+        delete_config_f delete;
+        uint64_t        epoch;      /**< bumped at each swap */
+        bool            running;
+        pthread_t       thread;
+        void           *result;
+        struct ev_async done;
+        A(server_retired_t) retired;
+        timeout_t      *reclaim;
+    } reload;
+
+    /* Metrics: the stats file and the control socket */
+    struct {
+        char           *file;
+        void           *map;
+        size_t          map_len;
+        listener_t     *control;
+    } stats;
+
+    /* Graceful upgrade (\ref server_upgrade) */
+    struct {
+        const char     *path;
+        char *const    *argv;
+        int             drain_timeout;
+        bool            draining;
+        A(int)          inherited;      /**< listening sockets received */
+        int             notify;         /**< readiness pipe to the old process */
+        server_io_t     ready;          /**< readiness pipe from the new one */
+    } upgrade;
+} server_g = {
+    .offload = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    },
+};
 #define _G  server_g
 
+static server_thread_t server_main_g;
+static __thread server_thread_t *server_thread_g;
+#define _T  (*server_thread_g)
+
+/** Current configuration, only valid until the caller returns to the loop
+ * (\ref server_epoch_enter).
+ */
+static inline void *server_config(void)
+{
+    return __atomic_load_n(&_G.config, __ATOMIC_ACQUIRE);
+}
+
+/** The thread may use the configuration until server_epoch_leave. A
+ * retired configuration is deleted once each thread has either left or
+ * entered an epoch after its retirement.
+ */
+static inline void server_epoch_enter(uint64_t *epoch)
+{
+    __atomic_store_n(epoch, __atomic_load_n(&_G.reload.epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+}
+
+static inline void server_epoch_leave(uint64_t *epoch)
+{
+    __atomic_store_n(epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+/* The metrics of a loop are only written by its thread. The stores are
+ * atomic so that the other threads never read a torn value.
+ */
+#define server_stats_add(field, n)  ({                                      \
+        server_stats_t *__st = _T.stats;                                     \
+        __atomic_store_n(&__st->field, __st->field + (n), __ATOMIC_RELAXED); \
+    })
+#define server_stats_set(field, v)                                           \
+    __atomic_store_n(&_T.stats->field, (v), __ATOMIC_RELAXED)
+
+static inline uint64_t server_now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Account for a duration that started at @c start (\ref server_now_nsec).
+ */
+static void server_histogram_add(server_histogram_t *h, uint64_t start)
+{
+    uint64_t nsec = server_now_nsec() - start;
+    int bucket = 0;
+
+    if (nsec > 0) {
+        bucket = MIN(63 - __builtin_clzll(nsec), SERVER_STATS_BUCKETS - 1);
+    }
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum_nsec, h->sum_nsec + nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->buckets[bucket], h->buckets[bucket] + 1,
+                     __ATOMIC_RELAXED);
+}
+
+#ifdef HAVE_IO_URING
+static ssize_t server_uring_input(client_t *client);
+static void server_uring_set_events(client_t *client, int events);
+static void server_uring_cancel(client_t *client);
+static void server_uring_unlist(client_t *client);
+static void server_uring_accept(listener_t *listener);
+static void server_uring_unaccept(listener_t *listener);
+#endif
+static bool listener_accept(listener_t *server);
+
 /* Server io structure methods.
  */
 
 static inline void server_io_wipe(server_io_t *io)
 {
-    if (unlikely(_G.loop == NULL)) {
+    if (unlikely(server_thread_g == NULL || _T.loop == NULL)) {
         return;
     }
     if (io->fd >= 0) {
-        ev_io_stop(_G.loop, &io->io);
+        ev_io_stop(_T.loop, &io->io);
         close(io->fd);
         io->fd = -1;
     }
@@ -117,17 +451,41 @@ static client_t *client_init(client_t *client)
 }
 DO_NEW(client_t, client);
 
+static void client_seg_release(client_seg_t *seg)
+{
+    p_delete(&seg->owned);
+    if (seg->release) {
+        seg->release(seg->owner);
+    }
+}
+
+static void client_chain_clear(client_t *client)
+{
+    for (uint32_t i = client->ochain_head ; i < client->ochain.len ; ++i) {
+        client_seg_release(array_ptr(client->ochain, i));
+    }
+    client->ochain.len   = 0;
+    client->ochain_head  = 0;
+}
+
 static void client_clear(client_t *server)
 {
     server_io_wipe(&server->io);
     if (server->data && server->clear_data) {
         server->clear_data(&server->data);
     }
+    client_chain_clear(server);
     server->obuf.len = 0;
+    server->obuf_off = 0;
     server->ibuf.len = 0;
+    server->ibuf_off = 0;
     server->data = NULL;
     server->clear_data = NULL;
     server->run = NULL;
+    server->released = false;
+#ifdef HAVE_IO_URING
+    p_clear(&server->uring, 1);
+#endif
 }
 
 static void client_wipe(client_t *server)
@@ -135,64 +493,244 @@ static void client_wipe(client_t *server)
     buffer_wipe(&server->ibuf);
     buffer_wipe(&server->obuf);
     client_clear(server);
+    array_wipe(server->ochain);
+#ifdef HAVE_IO_URING
+    p_delete(&server->uring_iov);
+#endif
+}
+
+static bool client_in_slab(const client_t *client)
+{
+    return client >= _T.slab && client < _T.slab + _T.slab_len;
 }
 
 void client_delete(client_t **client)
 {
     if (*client) {
         client_wipe(*client);
-        p_delete(client);
+        if (client_in_slab(*client)) {
+            *client = NULL;
+        } else {
+            p_delete(client);
+        }
     }
 }
 
 static client_t *client_acquire(void)
 {
-    if (_G.client_pool.len != 0) {
-        return array_pop_last(_G.client_pool);
+    if (_T.client_pool.len != 0) {
+        client_t *client = array_pop_last(_T.client_pool);
+
+        server_stats_set(client_pool, _T.client_pool.len);
+        return client;
     } else {
         return client_new();
     }
 }
 
+static void server_admission_resume(void);
+
+/** Link an accepted client in the list of its loop.
+ */
+static void client_track(client_t *client)
+{
+    client->live_next = _T.clients;
+    if (_T.clients != NULL) {
+        _T.clients->live_pprev = &client->live_next;
+    }
+    client->live_pprev = &_T.clients;
+    _T.clients = client;
+    server_stats_set(clients_active, ++_T.nclients);
+}
+
+static void client_untrack(client_t *client)
+{
+    if (client->live_pprev == NULL) {
+        return;
+    }
+    *client->live_pprev = client->live_next;
+    if (client->live_next != NULL) {
+        client->live_next->live_pprev = client->live_pprev;
+    }
+    client->live_next  = NULL;
+    client->live_pprev = NULL;
+    server_stats_set(clients_active, --_T.nclients);
+    if (_T.full && _T.nclients <= (uint32_t)_G.low_water) {
+        server_admission_resume();
+    }
+}
+
+/** Free the large buffers of a released client, the pool would otherwise
+ * keep the memory of the largest requests forever.
+ */
+static void client_trim(client_t *client)
+{
+    if (client->ibuf.size > SERVER_CLIENT_BUF_KEEP) {
+        buffer_wipe(&client->ibuf);
+        buffer_init(&client->ibuf);
+    }
+    if (client->obuf.size > SERVER_CLIENT_BUF_KEEP) {
+        buffer_wipe(&client->obuf);
+        buffer_init(&client->obuf);
+    }
+    if (client->ochain.size > CLIENT_IOV_MAX) {
+        array_wipe(client->ochain);
+    }
+}
+
 void client_release(client_t *server)
 {
+    client_untrack(server);
+#ifdef HAVE_IO_URING
+    /* The requests in the ring point to the client, they must be over */
+    if (server->uring.ops > 0) {
+        if (!server->released) {
+            server_uring_cancel(server);
+            _T.deferred++;
+        }
+        client_io_none(server);
+        server->released = true;
+        return;
+    }
+#endif
+    if (server->jobs > 0) {
+        if (!server->released) {
+            _T.deferred++;
+        }
+        client_io_none(server);
+        server->released = true;
+        return;
+    }
+    if (server->released) {
+        _T.deferred--;
+    }
+#ifdef HAVE_IO_URING
+    server_uring_unlist(server);
+#endif
     client_clear(server);
-    array_add(_G.client_pool, server);
+    server_stats_add(clients_closed, 1);
+    if (!client_in_slab(server)
+    &&  _T.client_pool.len >= MAX(_T.slab_len, SERVER_CLIENT_POOL))
+    {
+        client_delete(&server);
+        return;
+    }
+    client_trim(server);
+    array_add(_T.client_pool, server);
+    server_stats_set(client_pool, _T.client_pool.len);
 }
 
 /* 2 - Doing I/O */
 
-void client_io_none(client_t *server)
+/** Watch the given events on the client socket.
+ *
+ * The watcher is left untouched when it already watches these events:
+ * restarting it costs an epoll_ctl (or two) in the backend.
+ */
+static void client_io_set(client_t *client, int events)
 {
-    if (unlikely(_G.loop == NULL)) {
+    ev_io *io = &client->io.io;
+
+    if (unlikely(_T.loop == NULL)) {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (client->uring.on) {
+        server_uring_set_events(client, events);
+        return;
+    }
+#endif
+    if (events == 0) {
+        if (ev_is_active(io)) {
+            ev_io_stop(_T.loop, io);
+        }
+        return;
+    }
+    if (ev_is_active(io) && (io->events & (EV_READ | EV_WRITE)) == events) {
         return;
     }
-    ev_io_stop(_G.loop, &server->io.io);
+    if (ev_is_active(io)) {
+        ev_io_stop(_T.loop, io);
+    }
+    ev_io_set(io, client->io.fd, events);
+    ev_io_start(_T.loop, io);
+}
+
+static int client_flush(client_t *client);
+
+void client_io_none(client_t *server)
+{
+    client_io_set(server, 0);
 }
 
 void client_io_rw(client_t *server)
 {
-    if (unlikely(_G.loop == NULL)) {
-        return;
+    /* Try to write at once: EV_WRITE is only needed if the socket is full.
+     * An error is left to the EV_WRITE handler, that releases the client.
+     * With io_uring, the write is queued in the ring instead.
+     */
+    if (client_has_output(server)) {
+        client_flush(server);
     }
-    ev_io_stop(_G.loop, &server->io.io);
-    ev_io_set(&server->io.io, server->io.fd, EV_READ | EV_WRITE);
-    ev_io_start(_G.loop, &server->io.io);
+    client_io_set(server, client_has_output(server) ? EV_READ | EV_WRITE
+                                                    : EV_READ);
 }
 
 void client_io_ro(client_t *server)
 {
-    if (unlikely(_G.loop == NULL)) {
-        return;
+    client_io_set(server, EV_READ);
+}
+
+/** Drop the consumed input, only when the buffer would have to grow.
+ */
+static void client_input_compact(client_t *client)
+{
+    buffer_t *buf = &client->ibuf;
+
+    if (client->ibuf_off > 0 && buf->len + BUFSIZ >= buf->size) {
+        memmove(buf->data, buf->data + client->ibuf_off,
+                buf->len - client->ibuf_off + 1);
+        buf->len -= client->ibuf_off;
+        client->ibuf_off = 0;
     }
-    ev_io_stop(_G.loop, &server->io.io);
-    ev_io_set(&server->io.io, server->io.fd, EV_READ);
-    ev_io_start(_G.loop, &server->io.io);
 }
 
 ssize_t client_read(client_t *client)
 {
-    return buffer_read(&client->ibuf, client->io.fd, -1);
+#ifdef HAVE_IO_URING
+    if (client->uring.on) {
+        return server_uring_input(client);
+    }
+#endif
+    ssize_t res;
+
+    client_input_compact(client);
+    res = buffer_read(&client->ibuf, client->io.fd, -1);
+    if (res > 0) {
+        server_stats_add(bytes_in, res);
+    }
+    return res;
+}
+
+clstr_t client_input_str(client_t *client)
+{
+    clstr_t str = {
+        client->ibuf.data + client->ibuf_off,
+        client->ibuf.len - client->ibuf_off
+    };
+    return str;
+}
+
+void client_input_consume(client_t *client, int len)
+{
+    if (len <= 0) {
+        return;
+    }
+    client->ibuf_off += len;
+    if (client->ibuf_off >= client->ibuf.len) {
+        buffer_reset(&client->ibuf);
+        client->ibuf_off = 0;
+    }
 }
 
 buffer_t *client_input_buffer(client_t *client)
@@ -200,14 +738,143 @@ buffer_t *client_input_buffer(client_t *client)
     return &client->ibuf;
 }
 
+void *client_data(client_t *client)
+{
+    return client->data;
+}
+
+/** Move the content of obuf at the end of the chain.
+ */
+static void client_output_seal(client_t *client)
+{
+    if (client->obuf.len > client->obuf_off) {
+        client_seg_t prev = {
+            .data  = client->obuf.data + client->obuf_off,
+            .len   = client->obuf.len - client->obuf_off,
+            .owned = client->obuf.data,
+        };
+        array_add(client->ochain, prev);
+        buffer_init(&client->obuf);
+        client->obuf_off = 0;
+    }
+#ifdef HAVE_IO_URING
+    client->uring.obuf = false;
+#endif
+}
+
 buffer_t *client_output_buffer(client_t *client)
 {
+#ifdef HAVE_IO_URING
+    if (client->uring.obuf) {
+        /* The ring writes from obuf, appending to it could move it */
+        client_output_seal(client);
+    }
+#endif
     return &client->obuf;
 }
 
-void *client_data(client_t *client)
+void client_write_slice(client_t *client, const void *data, size_t len,
+                        release_slice_f release, void *owner)
 {
-    return client->data;
+    client_seg_t seg = {
+        .data    = data,
+        .len     = len,
+        .release = release,
+        .owner   = owner,
+    };
+
+    /* What was written in obuf goes first */
+    client_output_seal(client);
+    array_add(client->ochain, seg);
+}
+
+bool client_has_output(client_t *client)
+{
+    return client->ochain_head < client->ochain.len
+        || client->obuf.len > client->obuf_off;
+}
+
+/** Drop the first @c written bytes of the output.
+ */
+static void client_output_consume(client_t *client, size_t written)
+{
+    for (size_t left = written ; left > 0 ; ) {
+        client_seg_t *seg;
+
+        if (client->ochain_head == client->ochain.len) {
+            client->obuf_off += left;
+            break;
+        }
+        seg = array_ptr(client->ochain, client->ochain_head);
+        if (left < seg->len) {
+            seg->data += left;
+            seg->len  -= left;
+            break;
+        }
+        left -= seg->len;
+        client_seg_release(seg);
+        client->ochain_head++;
+    }
+    if (client->ochain_head == client->ochain.len) {
+        client->ochain.len  = 0;
+        client->ochain_head = 0;
+    }
+    if (client->obuf_off == client->obuf.len) {
+        buffer_reset(&client->obuf);
+        client->obuf_off = 0;
+    }
+}
+
+/** Write as much of the output as possible.
+ * \return -1 on error.
+ */
+static int client_flush(client_t *client)
+{
+#ifdef HAVE_IO_URING
+    if (client->uring.on) {
+        /* The output is written by the ring (\ref server_uring_write) */
+        return 0;
+    }
+#endif
+    while (client_has_output(client)) {
+        struct iovec iov[CLIENT_IOV_MAX];
+        size_t total = 0;
+        ssize_t res;
+        int cnt = 0;
+
+        uint32_t i;
+
+        for (i = client->ochain_head ;
+             i < client->ochain.len && cnt < CLIENT_IOV_MAX - 1 ; ++i) {
+            const client_seg_t *seg = array_ptr(client->ochain, i);
+
+            iov[cnt].iov_base = (void *)seg->data;
+            iov[cnt].iov_len  = seg->len;
+            total += iov[cnt++].iov_len;
+        }
+        /* obuf comes after the whole chain, or in a later writev */
+        if (i == client->ochain.len && client->obuf.len > client->obuf_off) {
+            iov[cnt].iov_base = client->obuf.data + client->obuf_off;
+            iov[cnt].iov_len  = client->obuf.len - client->obuf_off;
+            total += iov[cnt++].iov_len;
+        }
+
+        res = writev(client->io.fd, iov, cnt);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        server_stats_add(bytes_out, res);
+        client_output_consume(client, res);
+        if ((size_t)res < total) {
+            /* The socket is full */
+            return 0;
+        }
+    }
+    return 0;
 }
 
 
@@ -215,24 +882,44 @@ static void client_cb(EV_P_ struct ev_io *w, int events)
 {
     client_t *server = client_of_io(w);
 
-    if (events & EV_WRITE && server->obuf.len) {
-        if (buffer_write(&server->obuf, server->io.fd) < 0) {
+    if (events & EV_WRITE && client_has_output(server)) {
+        if (client_flush(server) < 0) {
             client_release(server);
             return;
         }
-        if (!server->obuf.len) {
-            client_io_ro(server);
+        if (!client_has_output(server)) {
+            client_io_set(server, server->jobs > 0 ? 0 : EV_READ);
         }
     }
 
     if (events & EV_READ) {
-        if (server->run(server, _G.config) < 0) {
+        uint64_t start = server_now_nsec();
+        int res = server->run(server, server_config());
+
+        server_histogram_add(&_T.stats->run, start);
+        if (res < 0) {
             client_release(server);
             return;
         }
     }
 }
 
+/** Start waiting for the input of a new client.
+ */
+static void client_watch(client_t *client)
+{
+    server_stats_add(clients_opened, 1);
+    ev_io_init(&client->io.io, client_cb, client->io.fd, EV_READ);
+#ifdef HAVE_IO_URING
+    if (_T.uring != NULL) {
+        client->uring.on = true;
+        server_uring_set_events(client, EV_READ);
+        return;
+    }
+#endif
+    ev_io_start(_T.loop, &client->io.io);
+}
+
 client_t *client_register(int fd, run_client_f runner, void *data)
 {
     if (fd < 0) {
@@ -244,8 +931,7 @@ client_t *client_register(int fd, run_client_f runner, void *data)
     tmp->data       = data;
     tmp->run        = runner;
     tmp->clear_data = NULL;
-    ev_io_init(&tmp->io.io, client_cb, tmp->io.fd, EV_READ);
-    ev_io_start(_G.loop, &tmp->io.io);
+    client_watch(tmp);
     return tmp;
 }
 
@@ -265,6 +951,15 @@ DO_NEW(listener_t, listener);
 
 static inline void listener_wipe(listener_t *io)
 {
+    if (io->paused != NULL) {
+        timer_cancel(io->paused);
+        io->paused = NULL;
+    }
+    if (io->parent != NULL && !io->reuseport) {
+        /* The socket belongs to the parent */
+        ev_io_stop(_T.loop, &io->io.io);
+        io->io.fd = -1;
+    }
     server_io_wipe(&io->io);
 }
 DO_DELETE(listener_t, listener);
@@ -272,25 +967,140 @@ DO_DELETE(listener_t, listener);
 
 /* 2 - Management */
 
-static void listener_cb(EV_P_ struct ev_io *w, int events)
+/** Start accepting the connections of the listener in the current loop.
+ */
+static void listener_start(listener_t *server)
+{
+    if (server->stopped || _T.full) {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (_T.uring != NULL) {
+        server_uring_accept(server);
+        return;
+    }
+#endif
+    ev_io_start(_T.loop, &server->io.io);
+}
+
+static void listener_resume(void *data)
+{
+    listener_t *server = data;
+
+    server->paused = NULL;
+    listener_start(server);
+}
+
+/** Stop accepting the connections of the listener, for good.
+ */
+static void listener_stop(listener_t *server)
+{
+    if (server->reuseport && !server->stopped) {
+        /* The kernel keeps queueing connections on the socket as long as
+         * it is in the group: take the queued ones, and leave the group
+         * so that the next ones go to the sockets still accepting.
+         */
+        while (!_T.full && listener_accept(server)) {
+        }
+        shutdown(server->io.fd, SHUT_RDWR);
+    }
+    server->stopped = true;
+    if (server->paused != NULL) {
+        timer_cancel(server->paused);
+        server->paused = NULL;
+    }
+    ev_io_stop(_T.loop, &server->io.io);
+#ifdef HAVE_IO_URING
+    if (_T.uring != NULL) {
+        server_uring_unaccept(server);
+    }
+#endif
+}
+
+/** Listeners watched by the loop of the current thread.
+ */
+static PA(listener_t) *server_loop_listeners(void)
+{
+    return server_thread_g == &server_main_g ? &_G.listeners : &_T.listeners;
+}
+
+/** Stop accepting in the current loop: its clients reached the cap.
+ */
+static void server_admission_suspend(void)
+{
+    _T.full = true;
+    server_stats_add(accepts_deferred, 1);
+    foreach (l, *server_loop_listeners()) {
+        ev_io_stop(_T.loop, &(*l)->io.io);
+#ifdef HAVE_IO_URING
+        if (_T.uring != NULL) {
+            server_uring_unaccept(*l);
+        }
+#endif
+    }
+}
+
+static void server_admission_resume(void)
+{
+    _T.full = false;
+    foreach (l, *server_loop_listeners()) {
+        if ((*l)->paused == NULL) {
+            listener_start(*l);
+        }
+    }
+}
+
+void server_set_max_clients(int max_clients, int low_water)
+{
+    _G.clients_cap = MAX(max_clients, 0);
+    _G.clients_low = low_water > 0 ? MIN(low_water, _G.clients_cap)
+                                   : _G.clients_cap * 9 / 10;
+}
+
+/** Preallocate the clients of the current loop, given its share of the
+ * cap.
+ */
+static void server_slab_init(int max_clients)
+{
+    if (max_clients <= 0) {
+        return;
+    }
+    _T.slab     = p_new(client_t, max_clients);
+    _T.slab_len = max_clients;
+    array_ensure_capacity(_T.client_pool, (uint32_t)max_clients);
+    for (int i = max_clients ; i-- > 0 ; ) {
+        array_add(_T.client_pool, client_init(&_T.slab[i]));
+    }
+    server_stats_set(client_pool, _T.client_pool.len);
+}
+
+/** Release the preallocated clients, once the pool is wiped.
+ */
+static void server_slab_wipe(void)
+{
+    p_delete(&_T.slab);
+    _T.slab_len = 0;
+}
+
+/** Serve a new connection of the listener.
+ */
+static void listener_client_start(listener_t *server, int sock)
 {
-    listener_t *server = listener_of_io(w);
     client_t *tmp;
     void* data = NULL;
-    int sock;
 
-    sock = accept_nonblock(server->io.fd);
-    if (sock < 0) {
-        UNIXERR("accept");
-        ev_unloop(EV_A_ EVUNLOOP_ALL);
+    if (_G.max_clients > 0 && _T.nclients >= (uint32_t)_G.max_clients) {
+        /* Accepted by a request of the ring that was in flight */
+        server_stats_add(accepts_rejected, 1);
+        close(sock);
         return;
     }
-
     if (_G.client_start) {
-        data = _G.client_start(server);
+        data = _G.client_start(server->parent ?: server);
         if (data == NULL) {
+            warn("cannot initialize a new client, connection dropped");
+            server_stats_add(accepts_rejected, 1);
             close(sock);
-            ev_unloop(EV_A_ EVUNLOOP_ALL);
             return;
         }
     }
@@ -300,30 +1110,155 @@ static void listener_cb(EV_P_ struct ev_io *w, int events)
     tmp->data       = data;
     tmp->run        = _G.client_run;
     tmp->clear_data = _G.client_delete;
-    ev_io_init(&tmp->io.io, client_cb, tmp->io.fd, EV_READ);
-    ev_io_start(_G.loop, &tmp->io.io);
+    client_watch(tmp);
+    client_track(tmp);
+    if (_G.max_clients > 0 && _T.nclients >= (uint32_t)_G.max_clients) {
+        server_admission_suspend();
+    }
 }
 
-listener_t *start_tcp_listener(int port)
+/** Accept one connection.
+ * \return false if the listener must not be polled again for now.
+ */
+static bool listener_accept(listener_t *server)
 {
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_addr   = { htonl(INADDR_LOOPBACK) },
-    };
-    listener_t *tmp;
     int sock;
 
-    addr.sin_port = htons(port);
-    sock = tcp_listen_nonblock((const struct sockaddr *)&addr, sizeof(addr));
-
+    sock = accept_nonblock(server->io.fd);
     if (sock < 0) {
-        return NULL;
+        switch (errno) {
+          case EINTR:
+          case ECONNABORTED:
+          case EPROTO:
+            /* The connection was lost before it could be accepted */
+            server_stats_add(accept_errors, 1);
+            return true;
+
+          case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+          case EWOULDBLOCK:
+#endif
+            /* The backlog is empty, or another loop took the connection */
+            return false;
+
+          default:
+            /* EMFILE, ENOBUFS... or a broken listening socket, already
+             * logged by accept_nonblock: retrying at once would spin, back
+             * off for a while.
+             */
+            server_stats_add(accept_errors, 1);
+            ev_io_stop(_T.loop, &server->io.io);
+            server->paused = start_timer(SERVER_ACCEPT_BACKOFF,
+                                         listener_resume, server);
+            return false;
+        }
     }
 
-    tmp             = listener_new();
+    listener_client_start(server, sock);
+    return true;
+}
+
+static void listener_cb(EV_P_ struct ev_io *w, int events)
+{
+    listener_t *server = listener_of_io(w);
+    uint64_t start = server_now_nsec();
+
+    /* Drain the backlog, up to a batch to be fair to the other clients */
+    for (int i = 0 ; i < _G.accept_batch && !_T.full ; ++i) {
+        if (!listener_accept(server)) {
+            break;
+        }
+    }
+    server_histogram_add(&_T.stats->accept, start);
+}
+
+void server_set_accept_batch(int batch)
+{
+    _G.accept_batch = MAX(batch, 1);
+}
+
+static bool server_addr_equal(const struct sockaddr *a,
+                              const struct sockaddr *b)
+{
+    if (a->sa_family != b->sa_family) {
+        return false;
+    }
+    switch (a->sa_family) {
+      case AF_UNIX: {
+        const struct sockaddr_un *ua = (const struct sockaddr_un *)a;
+        const struct sockaddr_un *ub = (const struct sockaddr_un *)b;
+
+        return strncmp(ua->sun_path, ub->sun_path, sizeof(ua->sun_path)) == 0;
+      }
+      case AF_INET: {
+        const struct sockaddr_in *ia = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *ib = (const struct sockaddr_in *)b;
+
+        return ia->sin_port == ib->sin_port
+            && ia->sin_addr.s_addr == ib->sin_addr.s_addr;
+      }
+      case AF_INET6: {
+        const struct sockaddr_in6 *ia = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *ib = (const struct sockaddr_in6 *)b;
+
+        return ia->sin6_port == ib->sin6_port
+            && memcmp(&ia->sin6_addr, &ib->sin6_addr,
+                      sizeof(ia->sin6_addr)) == 0;
+      }
+      default:
+        return false;
+    }
+}
+
+/** Get a listening socket bound to @c addr: the one inherited from the
+ * previous process if any (\ref server_upgrade), a new one otherwise.
+ */
+static int server_listen(const struct sockaddr *addr, socklen_t len)
+{
+    for (uint32_t i = 0 ; i < array_len(_G.upgrade.inherited) ; ++i) {
+        int fd = array_elt(_G.upgrade.inherited, i);
+        struct sockaddr_storage cur;
+        socklen_t cur_len = sizeof(cur);
+        int last;
+
+        if (getsockname(fd, (struct sockaddr *)&cur, &cur_len) < 0
+        ||  !server_addr_equal(addr, (const struct sockaddr *)&cur))
+        {
+            continue;
+        }
+        last = array_pop_last(_G.upgrade.inherited);
+        if (i < array_len(_G.upgrade.inherited)) {
+            array_elt(_G.upgrade.inherited, i) = last;
+        }
+        if (setnonblock(fd) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    return tcp_listen_nonblock(addr, len);
+}
+
+listener_t *start_tcp_listener(int port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr   = { htonl(INADDR_LOOPBACK) },
+    };
+    listener_t *tmp;
+    int sock;
+
+    addr.sin_port = htons(port);
+    sock = server_listen((const struct sockaddr *)&addr, sizeof(addr));
+
+    if (sock < 0) {
+        return NULL;
+    }
+
+    tmp             = listener_new();
     tmp->io.fd      = sock;
     ev_io_init(&tmp->io.io, listener_cb, tmp->io.fd, EV_READ);
-    ev_io_start(_G.loop, &tmp->io.io);
+    listener_start(tmp);
     array_add(_G.listeners, tmp);
     return tmp;
 }
@@ -340,7 +1275,7 @@ listener_t *start_unix_listener(const char *socketfile)
     old = umask(0111);
     strncpy(addr.sun_path, socketfile, sizeof(addr.sun_path) - 1);
     addr.sun_path[sizeof(addr.sun_path) - 1] = 0;
-    sock = tcp_listen_nonblock((const struct sockaddr *)&addr, sizeof(addr));
+    sock = server_listen((const struct sockaddr *)&addr, sizeof(addr));
     umask(old);
 
     if (sock < 0) {
@@ -350,7 +1285,7 @@ listener_t *start_unix_listener(const char *socketfile)
     tmp             = listener_new();
     tmp->io.fd      = sock;
     ev_io_init(&tmp->io.io, listener_cb, tmp->io.fd, EV_READ);
-    ev_io_start(_G.loop, &tmp->io.io);
+    listener_start(tmp);
     array_add(_G.listeners, tmp);
     return tmp;
 }
@@ -358,124 +1293,2306 @@ listener_t *start_unix_listener(const char *socketfile)
 /* Timers
  */
 
-DO_INIT(timeout_t, timeout);
-DO_NEW(timeout_t, timeout);
+DO_ALL(timeout_t, timeout);
 
-static void timeout_wipe(timeout_t *timer)
+static void timeout_release(timeout_t *timer)
 {
-    ev_timer_stop(_G.loop, &timer->timer);
+    array_add(_T.timeout_pool, timer);
+    server_stats_set(timeout_pool, _T.timeout_pool.len);
 }
-DO_DELETE(timeout_t, timeout);
 
+void server_set_timer_resolution(int resolution, int slack)
+{
+    _G.timer_resolution = MAX(resolution, 1);
+    _G.timer_slack      = MAX(slack, 0) / _G.timer_resolution;
+}
 
-static void timeout_release(timeout_t *timer)
+/** Convert a time to a tick of the wheel, rounded down (the current tick)
+ * or up (the tick of an expiration).
+ */
+static inline uint64_t server_wheel_tick(const server_wheel_t *w,
+                                         ev_tstamp time, bool up)
 {
-    timeout_wipe(timer);
-    array_add(_G.timeout_pool, timer);
+    /* The epsilon avoids waking up just before the tick the ticker was
+     * armed for.
+     */
+    uint64_t tick;
+
+    time = (time - w->origin) * 1000. / _G.timer_resolution;
+    time = up ? time - 1e-6 : time + 1e-6;
+    if (time <= 0) {
+        return 0;
+    }
+    tick = (uint64_t)time;
+    return up && tick < time ? tick + 1 : tick;
 }
 
-static void timeout_cb(EV_P_ struct ev_timer *w, int revents)
+static void server_wheel_link(server_wheel_t *w, timeout_t *timer)
 {
-    timeout_t *timer = timeout_of_timer(w);
-    run_timeout_f run = timer->run;
-    void* data = timer->data;
-    timeout_release(timer);
+    uint64_t at    = timer->expires;
+    uint64_t delta = at > w->now ? at - w->now : 0;
+    int level = 0;
+
+    /* Timers beyond the range of the wheel are put in the last level, and
+     * linked again when they reach level 0 (\ref server_wheel_advance).
+     */
+    if (delta >= SERVER_WHEEL_RANGE) {
+        delta = SERVER_WHEEL_RANGE - 1;
+        at    = w->now + delta;
+    } else if (delta == 0) {
+        at = w->now;
+    }
+    while (delta >= 1ULL << (SERVER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    timer->slot = level * SERVER_WHEEL_SLOTS
+                + ((at >> (SERVER_WHEEL_BITS * level)) & (SERVER_WHEEL_SLOTS - 1));
+    timer->next  = w->slots[timer->slot];
+    timer->pprev = &w->slots[timer->slot];
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    w->slots[timer->slot] = timer;
+    w->occupied[level] |= 1ULL << (timer->slot % SERVER_WHEEL_SLOTS);
+}
+
+static void server_wheel_unlink(server_wheel_t *w, timeout_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (w->slots[timer->slot] == NULL) {
+        w->occupied[timer->slot / SERVER_WHEEL_SLOTS]
+            &= ~(1ULL << (timer->slot % SERVER_WHEEL_SLOTS));
+    }
+    timer->next  = NULL;
+    timer->pprev = NULL;
+}
+
+/** Get the next tick at which a timer expires or a slot is cascaded. The
+ * result may be early, never late.
+ */
+static uint64_t server_wheel_next(const server_wheel_t *w)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0 ; level < SERVER_WHEEL_LEVELS ; ++level) {
+        const int shift = SERVER_WHEEL_BITS * level;
+        const uint64_t period = 1ULL << (shift + SERVER_WHEEL_BITS);
+        uint64_t base = w->now & ~(period - 1);
+        uint64_t mask = w->occupied[level];
+        int index = (w->now >> shift) & (SERVER_WHEEL_SLOTS - 1);
+        uint64_t at;
+
+        if (mask == 0) {
+            continue;
+        }
+
+        /* The current slot of an upper level is only still to cascade if
+         * the tick is on its boundary.
+         */
+        if (level > 0 && (w->now & ((1ULL << shift) - 1)) != 0) {
+            index++;
+        }
+        mask = index < SERVER_WHEEL_SLOTS ? mask & (~0ULL << index) : 0;
+        if (mask != 0) {
+            at = base + ((uint64_t)__builtin_ctzll(mask) << shift);
+        } else {
+            at = base + period
+               + ((uint64_t)__builtin_ctzll(w->occupied[level]) << shift);
+        }
+        next = MIN(next, at);
+    }
+    return next;
+}
+
+static void server_wheel_cascade(server_wheel_t *w, int level)
+{
+    int slot = level * SERVER_WHEEL_SLOTS
+             + ((w->now >> (SERVER_WHEEL_BITS * level)) & (SERVER_WHEEL_SLOTS - 1));
+    timeout_t *timer = w->slots[slot];
+
+    w->slots[slot] = NULL;
+    w->occupied[level] &= ~(1ULL << (slot % SERVER_WHEEL_SLOTS));
+    while (timer != NULL) {
+        timeout_t *next = timer->next;
+        server_wheel_link(w, timer);
+        timer = next;
+    }
+}
+
+/** Run the timers that expire up to the tick @c target.
+ */
+static void server_wheel_advance(server_wheel_t *w, uint64_t target)
+{
+    while (w->now <= target && w->count > 0) {
+        int slot = w->now & (SERVER_WHEEL_SLOTS - 1);
+        timeout_t *expired;
+
+        for (int level = 1 ; level < SERVER_WHEEL_LEVELS ; ++level) {
+            if (w->now & ((1ULL << (SERVER_WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+            server_wheel_cascade(w, level);
+        }
+
+        /* The tick is over before the callbacks run: the timers they start
+         * go to the next ticks.
+         */
+        expired = w->slots[slot];
+        w->slots[slot] = NULL;
+        w->occupied[0] &= ~(1ULL << slot);
+        if (expired != NULL) {
+            expired->pprev = &expired;
+        }
+        w->now++;
+        while (expired != NULL) {
+            timeout_t *timer = expired;
+            run_timeout_f run = timer->run;
+            void *data = timer->data;
+
+            server_wheel_unlink(w, timer);
+            if (timer->expires >= w->now) {
+                server_wheel_link(w, timer);
+                continue;
+            }
+            w->count--;
+            timeout_release(timer);
+            server_stats_set(timers_armed, w->count);
+            server_stats_add(timers_fired, 1);
+            if (run) {
+                uint64_t start = server_now_nsec();
+
+                run(data);
+                server_histogram_add(&_T.stats->timeout, start);
+            }
+        }
+
+        /* Skip the ticks at which nothing happens */
+        w->now = MAX(w->now, MIN(server_wheel_next(w), target + 1));
+    }
+    w->now = MAX(w->now, target + 1);
+}
+
+static void server_wheel_arm(server_wheel_t *w, uint64_t wakeup)
+{
+    ev_tstamp delay = w->origin + wakeup * _G.timer_resolution / 1000.
+                    - ev_now(_T.loop);
+
+    w->wakeup = wakeup;
+    ev_timer_stop(_T.loop, &w->ticker);
+    ev_timer_set(&w->ticker, MAX(delay, 0.), 0.);
+    ev_timer_start(_T.loop, &w->ticker);
+}
+
+static void server_wheel_cb(EV_P_ struct ev_timer *t, int revents)
+{
+    server_wheel_t *w = containerof(t, server_wheel_t, ticker);
 
-    if (run) {
-        run(data);
+    server_wheel_advance(w, server_wheel_tick(w, ev_now(EV_A), false));
+    if (w->count > 0) {
+        server_wheel_arm(w, server_wheel_next(w) + _G.timer_slack);
+    }
+}
+
+static void server_wheel_init(server_wheel_t *w, struct ev_loop *loop)
+{
+    w->origin = ev_now(loop);
+    ev_timer_init(&w->ticker, server_wheel_cb, 0., 0.);
+}
+
+static void server_wheel_wipe(server_wheel_t *w, struct ev_loop *loop)
+{
+    ev_timer_stop(loop, &w->ticker);
+    for (int i = 0 ; i < countof(w->slots) ; ++i) {
+        while (w->slots[i] != NULL) {
+            timeout_t *timer = w->slots[i];
+            w->slots[i] = timer->next;
+            timeout_delete(&timer);
+        }
     }
+    p_clear(w->occupied, SERVER_WHEEL_LEVELS);
+    w->count = 0;
 }
 
 timeout_t *start_timer(int milliseconds, run_timeout_f runner, void *data)
 {
+    server_wheel_t *w = &_T.wheel;
+    uint64_t now = server_wheel_tick(w, ev_now(_T.loop), false);
     timeout_t *timer = NULL;
-    float timeout = ((float)milliseconds) / 1000.;
-    if (array_len(_G.timeout_pool) > 0) {
-        timer = array_pop_last(_G.timeout_pool);
-        ev_timer_set(&timer->timer, timeout, 0.);
+
+    if (array_len(_T.timeout_pool) > 0) {
+        timer = array_pop_last(_T.timeout_pool);
+        server_stats_set(timeout_pool, _T.timeout_pool.len);
     } else {
         timer = timeout_new();
-        ev_timer_init(&timer->timer, timeout_cb, timeout, 0.);
     }
     timer->run = runner;
     timer->data = data;
-    ev_timer_start(_G.loop, &timer->timer);
+
+    /* An empty wheel jumps to the current tick */
+    if (w->count == 0) {
+        w->now = MAX(w->now, now);
+    }
+    timer->expires = server_wheel_tick(w, ev_now(_T.loop)
+                                       + MAX(milliseconds, 0) / 1000., true);
+    server_wheel_link(w, timer);
+    w->count++;
+    server_stats_add(timers_started, 1);
+    server_stats_set(timers_armed, w->count);
+
+    if (!ev_is_active(&w->ticker)
+    ||  MAX(timer->expires, w->now) + _G.timer_slack < w->wakeup) {
+        server_wheel_arm(w, MAX(timer->expires, w->now) + _G.timer_slack);
+    }
     return timer;
 }
 
 void timer_cancel(timeout_t *timer)
 {
+    server_wheel_t *w = &_T.wheel;
+
+    if (timer->pprev == NULL) {
+        return;
+    }
+    server_wheel_unlink(w, timer);
     timeout_release(timer);
+    server_stats_set(timers_armed, w->count - 1);
+    if (--w->count == 0) {
+        ev_timer_stop(_T.loop, &w->ticker);
+    }
 }
 
 
+/* io_uring backend
+ */
+#ifdef HAVE_IO_URING
+
+/* With io_uring, the clients and listeners have no watcher: their reads,
+ * writes and accepts are requests queued in a ring per loop, all submitted
+ * by a single io_uring_enter before the loop polls. The reads pick their
+ * memory in a ring of provided buffers, so that idle connections hold no
+ * buffer, and the listeners use multishot accepts. The loop still runs
+ * libev for the timers, signals and asynchronous events, and watches the
+ * ring descriptor to reap the completions.
+ */
+#define SERVER_URING_ENTRIES  1024
+#define SERVER_URING_BUFS     1024      /**< provided buffers, power of 2 */
+#define SERVER_URING_BUFSIZ   2048
 
-/* Server runtime stuff.
+/* The kind of a request is stored in the low bits of its user data, the
+ * rest is the listener or client it belongs to.
  */
+enum {
+    SERVER_URING_CANCEL,
+    SERVER_URING_ACCEPT,
+    SERVER_URING_READ,
+    SERVER_URING_WRITE,
+    SERVER_URING_KIND_MASK = 7,
+};
 
-static int server_init(void)
+typedef struct server_uring_t {
+    int fd;
+    struct ev_io      io;
+    struct ev_prepare prepare;
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned  sq_mask;
+    unsigned  sq_entries;
+    unsigned  sq_queued;        /**< tail including the unsubmitted entries */
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void     *sq_map;
+    size_t    sq_map_len;
+    void     *cq_map;
+    size_t    cq_map_len;
+    size_t    sqes_len;
+
+    /* Provided buffers */
+    struct io_uring_buf_ring *br;
+    size_t    br_len;
+    uint16_t  br_tail;
+    char     *bufs;
+
+    /* Clients to update before the next poll, and the list being updated */
+    PA(client_t) ready;
+    PA(client_t) updating;
+
+    /* Reads that found no buffer. They are retried in order, a batch per
+     * loop iteration: retrying them all at once would just run out of
+     * buffers again.
+     */
+    PA(client_t) starved;
+    uint32_t     starved_head;
+} server_uring_t;
+
+static void *server_uring_map(int fd, size_t len, off_t off)
 {
-    _G.loop = ev_default_loop(0);
-    return 0;
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, off);
+
+    return map == MAP_FAILED ? NULL : map;
 }
 
-static void server_shutdown(void)
+static void server_uring_delete(server_uring_t **ring)
 {
-    array_deep_wipe(_G.listeners, listener_delete);
-    array_deep_wipe(_G.client_pool, client_delete);
-    array_deep_wipe(_G.timeout_pool, timeout_delete);
-    if (daemon_process) {
-        ev_default_destroy();
-        _G.loop = NULL;
+    server_uring_t *r = *ring;
+
+    if (r == NULL) {
+        return;
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_len);
     }
+    if (r->cq_map != NULL && r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_len);
+    }
+    if (r->sq_map != NULL) {
+        munmap(r->sq_map, r->sq_map_len);
+    }
+    if (r->br != NULL) {
+        munmap(r->br, r->br_len);
+    }
+    p_delete(&r->bufs);
+    array_wipe(r->ready);
+    array_wipe(r->updating);
+    array_wipe(r->starved);
+    p_delete(ring);
 }
-module_init(server_init);
-module_exit(server_shutdown);
 
+/** Give a buffer back to the kernel.
+ */
+static void server_uring_buf_release(server_uring_t *r, uint16_t bid)
+{
+    /* The tail of the ring overlays the resv field of the first entry: the
+     * entries are set field by field.
+     */
+    struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (SERVER_URING_BUFS - 1)];
+
+    buf->addr = (uintptr_t)(r->bufs + (size_t)bid * SERVER_URING_BUFSIZ);
+    buf->len  = SERVER_URING_BUFSIZ;
+    buf->bid  = bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
 
-static void refresh_cb(EV_P_ struct ev_signal *w, int event)
+/** Set up a ring.
+ * \return NULL if io_uring or one of the features the backend needs is not
+ * available (errno is then set).
+ */
+static server_uring_t *server_uring_new(void)
 {
-    log_state = "refreshing ";
-    if (!_G.config_refresh(_G.config)) {
-        ev_unloop(EV_A_ EVUNLOOP_ALL);
-        notice("failed");
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    server_uring_t *r = p_new(server_uring_t, 1);
+    int saved;
+
+    /* The loop enters the kernel often enough: there is no need to
+     * interrupt it to complete the requests.
+     */
+    p_clear(&params, 1);
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    r->fd = syscall(__NR_io_uring_setup, SERVER_URING_ENTRIES, &params);
+    if (r->fd < 0 && errno == EINVAL) {
+        p_clear(&params, 1);
+        r->fd = syscall(__NR_io_uring_setup, SERVER_URING_ENTRIES, &params);
+    }
+    if (r->fd < 0) {
+        goto error;
+    }
+
+    r->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_map_len = params.cq_off.cqes
+                  + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_map_len = r->cq_map_len = MAX(r->sq_map_len, r->cq_map_len);
+    }
+    r->sq_map = server_uring_map(r->fd, r->sq_map_len, IORING_OFF_SQ_RING);
+    if (r->sq_map == NULL) {
+        goto error;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
     } else {
-        notice("done");
+        r->cq_map = server_uring_map(r->fd, r->cq_map_len, IORING_OFF_CQ_RING);
+        if (r->cq_map == NULL) {
+            goto error;
+        }
     }
-    log_state = "";
+    r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = server_uring_map(r->fd, r->sqes_len, IORING_OFF_SQES);
+    if (r->sqes == NULL) {
+        goto error;
+    }
+    r->sq_head    = (unsigned *)((char *)r->sq_map + params.sq_off.head);
+    r->sq_tail    = (unsigned *)((char *)r->sq_map + params.sq_off.tail);
+    r->sq_flags   = (unsigned *)((char *)r->sq_map + params.sq_off.flags);
+    r->sq_array   = (unsigned *)((char *)r->sq_map + params.sq_off.array);
+    r->sq_mask    = *(unsigned *)((char *)r->sq_map + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    r->sq_queued  = *r->sq_tail;
+    r->cq_head    = (unsigned *)((char *)r->cq_map + params.cq_off.head);
+    r->cq_tail    = (unsigned *)((char *)r->cq_map + params.cq_off.tail);
+    r->cq_mask    = *(unsigned *)((char *)r->cq_map + params.cq_off.ring_mask);
+    r->cqes       = (struct io_uring_cqe *)((char *)r->cq_map
+                                            + params.cq_off.cqes);
+
+    /* The buffer ring must be page aligned (Linux 5.19) */
+    r->br_len = SERVER_URING_BUFS * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        goto error;
+    }
+    p_clear(&reg, 1);
+    reg.ring_addr    = (uintptr_t)r->br;
+    reg.ring_entries = SERVER_URING_BUFS;
+    reg.bgid         = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        goto error;
+    }
+    r->bufs = p_new(char, SERVER_URING_BUFS * SERVER_URING_BUFSIZ);
+    for (int i = 0 ; i < SERVER_URING_BUFS ; ++i) {
+        server_uring_buf_release(r, i);
+    }
+    return r;
+
+  error:
+    saved = errno;
+    server_uring_delete(&r);
+    errno = saved;
+    return NULL;
 }
 
-static void exit_cb(EV_P_ struct ev_signal *w, int event)
+/** Submit the queued requests.
+ * \return false if the kernel could not take them for now.
+ */
+static bool server_uring_submit(server_uring_t *r)
 {
-    ev_unloop(EV_A_ EVUNLOOP_ALL);
+    unsigned pending;
+
+    __atomic_store_n(r->sq_tail, r->sq_queued, __ATOMIC_RELEASE);
+    pending = r->sq_queued - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    while (pending > 0) {
+        if (syscall(__NR_io_uring_enter, r->fd, pending, 0, 0, NULL, 0) >= 0) {
+            return true;
+        }
+        if (errno != EINTR) {
+            /* EAGAIN or EBUSY: the kernel is short of resources, the
+             * requests stay queued until completions are reaped.
+             */
+            if (errno != EAGAIN && errno != EBUSY) {
+                UNIXERR("io_uring_enter");
+            }
+            return false;
+        }
+    }
+    return true;
 }
 
-int server_loop(start_client_f starter, delete_client_f deleter,
-                run_client_f runner, refresh_f refresh, void *config)
+/** Get an entry to queue a request.
+ * \return NULL if the submission queue is full.
+ */
+static struct io_uring_sqe *server_uring_sqe(server_uring_t *r)
 {
-    struct ev_signal ev_sighup;
-    struct ev_signal ev_sigint;
-    struct ev_signal ev_sigterm;
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (r->sq_queued - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+        >= r->sq_entries)
+    {
+        server_uring_submit(r);
+        if (r->sq_queued - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+            >= r->sq_entries)
+        {
+            return NULL;
+        }
+    }
+    index = r->sq_queued & r->sq_mask;
+    sqe = &r->sqes[index];
+    p_clear(sqe, 1);
+    r->sq_array[index] = index;
+    r->sq_queued++;
+    return sqe;
+}
 
-    _G.client_start   = starter;
-    _G.client_delete  = deleter;
-    _G.client_run     = runner;
-    _G.config_refresh = refresh;
-    _G.config         = config;
+/** Update the requests of the client before the next poll.
+ */
+static void server_uring_schedule(client_t *client)
+{
+    if (!client->uring.scheduled) {
+        client->uring.scheduled = true;
+        array_add(_T.uring->ready, client);
+    }
+}
 
-    if (refresh != NULL) {
-        ev_signal_init(&ev_sighup, refresh_cb, SIGHUP);
-        ev_signal_start(_G.loop, &ev_sighup);
+/** Forget the released client in the lists of the ring: it may be freed,
+ * or recycled with its flags cleared.
+ */
+static void server_uring_unlist(client_t *client)
+{
+    server_uring_t *r = _T.uring;
+
+    if (client->uring.scheduled) {
+        foreach (c, r->ready) {
+            if (*c == client) {
+                *c = NULL;
+            }
+        }
+        foreach (c, r->updating) {
+            if (*c == client) {
+                *c = NULL;
+            }
+        }
     }
-    ev_signal_init(&ev_sigint, exit_cb, SIGINT);
-    ev_signal_start(_G.loop, &ev_sigint);
-    ev_signal_init(&ev_sigterm, exit_cb, SIGTERM);
-    ev_signal_start(_G.loop, &ev_sigterm);
+    if (client->uring.starved) {
+        for (uint32_t i = r->starved_head ; i < array_len(r->starved) ; i++) {
+            if (array_elt(r->starved, i) == client) {
+                array_elt(r->starved, i) = NULL;
+            }
+        }
+    }
+}
 
-    log_state = "";
-    notice("entering processing loop");
-    ev_loop(_G.loop, 0);
-    notice("exit requested");
+static void server_uring_read(client_t *client)
+{
+    struct io_uring_sqe *sqe = server_uring_sqe(_T.uring);
+
+    if (sqe == NULL) {
+        server_uring_schedule(client);
+        return;
+    }
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = client->io.fd;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->len       = SERVER_URING_BUFSIZ;
+    sqe->off       = (uint64_t)-1;
+    sqe->user_data = (uintptr_t)client | SERVER_URING_READ;
+    client->uring.reading = true;
+    client->uring.ops++;
+}
+
+static void server_uring_write(client_t *client)
+{
+    struct io_uring_sqe *sqe = server_uring_sqe(_T.uring);
+    struct iovec *iov;
+    uint32_t i;
+    int cnt = 0;
+
+    if (sqe == NULL) {
+        server_uring_schedule(client);
+        return;
+    }
+
+    if (client->uring_iov == NULL) {
+        client->uring_iov = p_new(struct iovec, CLIENT_IOV_MAX);
+    }
+    iov = client->uring_iov;
+    for (i = client->ochain_head ;
+         i < client->ochain.len && cnt < CLIENT_IOV_MAX - 1 ; ++i) {
+        const client_seg_t *seg = array_ptr(client->ochain, i);
+
+        iov[cnt].iov_base = (void *)seg->data;
+        iov[cnt++].iov_len = seg->len;
+    }
+    /* obuf is written in place: it is only moved to the chain if the
+     * output buffer is asked for before the write completes
+     * (\ref client_output_buffer).
+     */
+    if (i == client->ochain.len && client->obuf.len > client->obuf_off) {
+        iov[cnt].iov_base = client->obuf.data + client->obuf_off;
+        iov[cnt++].iov_len = client->obuf.len - client->obuf_off;
+        client->uring.obuf = true;
+    }
+    sqe->opcode    = IORING_OP_WRITEV;
+    sqe->fd        = client->io.fd;
+    sqe->addr      = (uintptr_t)client->uring_iov;
+    sqe->len       = cnt;
+    sqe->off       = (uint64_t)-1;
+    sqe->user_data = (uintptr_t)client | SERVER_URING_WRITE;
+    client->uring.writing = true;
+    client->uring.ops++;
+}
+
+static void server_uring_cancel(client_t *client)
+{
+    struct io_uring_sqe *sqe = server_uring_sqe(_T.uring);
+
+    if (sqe == NULL) {
+        /* Reading from a socket that is shut down fails at once */
+        shutdown(client->io.fd, SHUT_RDWR);
+        return;
+    }
+    sqe->opcode      = IORING_OP_ASYNC_CANCEL;
+    sqe->fd          = client->io.fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data   = SERVER_URING_CANCEL;
+}
+
+static void server_uring_accept(listener_t *listener)
+{
+    struct io_uring_sqe *sqe;
+
+    if (listener->accepting) {
+        return;
+    }
+    ev_io_stop(_T.loop, &listener->io.io);
+    sqe = server_uring_sqe(_T.uring);
+    if (sqe == NULL) {
+        listener->paused = start_timer(SERVER_ACCEPT_BACKOFF,
+                                       listener_resume, listener);
+        return;
+    }
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = listener->io.fd;
+    /* A multishot accept would take the whole backlog past the cap */
+    sqe->ioprio       = _G.max_clients > 0 ? 0 : IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = (uintptr_t)listener | SERVER_URING_ACCEPT;
+    listener->accepting = true;
+}
+
+/** Cancel the accept of a stopped listener. Without a free entry in the
+ * ring, this is retried when the next connection is accepted.
+ */
+static void server_uring_unaccept(listener_t *listener)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!listener->accepting) {
+        return;
+    }
+    sqe = server_uring_sqe(_T.uring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+    sqe->fd           = listener->io.fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data    = SERVER_URING_CANCEL;
+}
+
+static ssize_t server_uring_input(client_t *client)
+{
+    ssize_t res = client->uring.input;
+
+    if (res > 0) {
+        client->uring.input = 0;
+        return res;
+    }
+    if (client->uring.eof) {
+        if (client->uring.error == 0) {
+            return 0;
+        }
+        errno = client->uring.error;
+        return -1;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static void server_uring_update(client_t *client);
+
+/** Call the client with the input received by the ring.
+ */
+static void server_uring_run(client_t *client)
+{
+    uint64_t start;
+    int res;
+
+    if (client->uring.eof) {
+        client->uring.eof_seen = true;
+    }
+    client->uring.running = true;
+    start = server_now_nsec();
+    res = client->run(client, server_config());
+    server_histogram_add(&_T.stats->run, start);
+    client->uring.running = false;
+    client->uring.input = 0;
+    if (res < 0) {
+        client_release(client);
+        return;
+    }
+    server_uring_update(client);
+}
+
+static void server_uring_update(client_t *client)
+{
+    if (!client->uring.on || client->released) {
+        return;
+    }
+    if (client->uring.events & EV_READ) {
+        if (client->uring.input > 0
+        ||  (client->uring.eof && !client->uring.eof_seen)) {
+            server_uring_run(client);
+            return;
+        }
+        if (!client->uring.reading && !client->uring.eof
+        &&  !client->uring.starved) {
+            server_uring_read(client);
+        }
+    }
+    if ((client->uring.events & EV_WRITE) && !client->uring.writing
+    &&  client_has_output(client)) {
+        server_uring_write(client);
+    }
+}
+
+static void server_uring_set_events(client_t *client, int events)
+{
+    client->uring.events = events;
+    if (!client->uring.running) {
+        server_uring_schedule(client);
+    }
+}
+
+/** Account for the end of a request of the client.
+ * \return true if the client is released.
+ */
+static bool server_uring_done(client_t *client)
+{
+    client->uring.ops--;
+    if (client->released) {
+        if (client->uring.ops == 0 && client->jobs == 0) {
+            client_release(client);
+        }
+        return true;
+    }
+    return false;
+}
+
+static void server_uring_read_done(server_uring_t *r, client_t *client,
+                                   const struct io_uring_cqe *cqe)
+{
+    client->uring.reading = false;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (cqe->res > 0 && !client->released) {
+            client_input_compact(client);
+            buffer_add(&client->ibuf, r->bufs + (size_t)bid * SERVER_URING_BUFSIZ,
+                       cqe->res);
+            client->uring.input += cqe->res;
+            server_stats_add(bytes_in, cqe->res);
+        }
+        server_uring_buf_release(r, bid);
+    }
+    if (server_uring_done(client)) {
+        return;
+    }
+    if (cqe->res == 0) {
+        client->uring.eof = true;
+    } else if (cqe->res < 0) {
+        switch (-cqe->res) {
+          case ENOBUFS:
+            if (!client->uring.starved) {
+                client->uring.starved = true;
+                array_add(r->starved, client);
+            }
+            return;
+
+          case EINTR:
+          case EAGAIN:
+          case ECANCELED:
+            server_uring_schedule(client);
+            return;
+
+          default:
+            client->uring.eof   = true;
+            client->uring.error = -cqe->res;
+            break;
+        }
+    }
+    if (client->uring.events & EV_READ) {
+        server_uring_run(client);
+    }
+}
+
+static void server_uring_write_done(client_t *client,
+                                    const struct io_uring_cqe *cqe)
+{
+    client->uring.writing = false;
+    client->uring.obuf    = false;
+    if (server_uring_done(client)) {
+        return;
+    }
+    if (cqe->res < 0) {
+        if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+            server_uring_schedule(client);
+            return;
+        }
+        client_release(client);
+        return;
+    }
+    server_stats_add(bytes_out, cqe->res);
+    client_output_consume(client, cqe->res);
+    if (!client_has_output(client) && (client->uring.events & EV_WRITE)) {
+        client->uring.events = client->jobs > 0 ? 0 : EV_READ;
+    }
+    server_uring_update(client);
+}
+
+static void server_uring_accept_done(listener_t *listener,
+                                     const struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        listener->accepting = false;
+    }
+    if (cqe->res >= 0) {
+        uint64_t start = server_now_nsec();
+
+        listener_client_start(listener, cqe->res);
+        server_histogram_add(&_T.stats->accept, start);
+    } else if (listener->stopped) {
+        /* Cancelled, or the socket of the loop was shut down */
+    } else {
+        switch (-cqe->res) {
+          case ECANCELED:
+            /* Accepting again may have been requested meanwhile */
+            break;
+
+          case EINTR:
+          case EAGAIN:
+            break;
+
+          case ECONNABORTED:
+          case EPROTO:
+            /* The connection was lost before it could be accepted */
+            server_stats_add(accept_errors, 1);
+            break;
+
+          default:
+            /* EMFILE, ENOBUFS... or a broken listening socket: retrying at
+             * once would spin, back off for a while.
+             */
+            errno = -cqe->res;
+            UNIXERR("accept");
+            server_stats_add(accept_errors, 1);
+            if (!listener->accepting && listener->paused == NULL) {
+                listener->paused = start_timer(SERVER_ACCEPT_BACKOFF,
+                                               listener_resume, listener);
+            }
+            return;
+        }
+    }
+    if (listener->stopped || _T.full) {
+        server_uring_unaccept(listener);
+    } else if (!listener->accepting && listener->paused == NULL) {
+        server_uring_accept(listener);
+    }
+}
+
+static void server_uring_cb(EV_P_ struct ev_io *w, int events)
+{
+    server_uring_t *r = containerof(w, server_uring_t, io);
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        if (head == tail) {
+            /* The completions that did not fit in the queue are only moved
+             * to it by io_uring_enter, the ring is not readable for them.
+             */
+            if (!(__atomic_load_n(r->sq_flags, __ATOMIC_ACQUIRE)
+                  & IORING_SQ_CQ_OVERFLOW))
+            {
+                break;
+            }
+            syscall(__NR_io_uring_enter, r->fd, 0, 0, IORING_ENTER_GETEVENTS,
+                    NULL, 0);
+            tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                break;
+            }
+        }
+
+        struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+        void *ptr = (void *)(uintptr_t)(cqe.user_data
+                                        & ~(uint64_t)SERVER_URING_KIND_MASK);
+
+        /* The entry is given back first, the callbacks may submit */
+        __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+        switch (cqe.user_data & SERVER_URING_KIND_MASK) {
+          case SERVER_URING_ACCEPT:
+            server_uring_accept_done(ptr, &cqe);
+            break;
+          case SERVER_URING_READ:
+            server_uring_read_done(r, ptr, &cqe);
+            break;
+          case SERVER_URING_WRITE:
+            server_uring_write_done(ptr, &cqe);
+            break;
+          default:
+            break;
+        }
+        if (head == tail) {
+            tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+}
+
+static void server_uring_prepare_cb(EV_P_ struct ev_prepare *w, int events)
+{
+    server_uring_t *r = containerof(w, server_uring_t, prepare);
+
+    /* The updates may schedule clients again when the submission queue is
+     * full: they are retried once the queue is submitted.
+     */
+    while (array_len(r->ready) > 0) {
+        PA(client_t) list = r->ready;
+
+        r->ready    = r->updating;
+        r->updating = list;
+        foreach (client, r->updating) {
+            if (*client != NULL && (*client)->uring.scheduled) {
+                (*client)->uring.scheduled = false;
+                server_uring_update(*client);
+            }
+        }
+        r->updating.len = 0;
+        if (!server_uring_submit(r)) {
+            return;
+        }
+    }
+
+    for (int i = 0 ; i < SERVER_URING_BUFS
+                  && r->starved_head < array_len(r->starved) ; ) {
+        client_t *client = array_elt(r->starved, r->starved_head++);
+
+        if (client != NULL && client->uring.starved) {
+            client->uring.starved = false;
+            server_uring_update(client);
+            i++;
+        }
+    }
+    if (r->starved_head > 0 && r->starved_head * 2 >= array_len(r->starved)) {
+        memmove(r->starved.data, r->starved.data + r->starved_head,
+                (array_len(r->starved) - r->starved_head) * sizeof(client_t *));
+        r->starved.len  -= r->starved_head;
+        r->starved_head  = 0;
+    }
+    server_uring_submit(r);
+}
+
+/** Serve the clients of the loop of the thread with a ring.
+ */
+static bool server_uring_start(server_thread_t *thr)
+{
+    server_uring_t *r = server_uring_new();
+
+    if (r == NULL) {
+        return false;
+    }
+    ev_io_init(&r->io, server_uring_cb, r->fd, EV_READ);
+    ev_io_start(thr->loop, &r->io);
+    ev_prepare_init(&r->prepare, server_uring_prepare_cb);
+    ev_prepare_start(thr->loop, &r->prepare);
+    thr->uring = r;
+    return true;
+}
+
+static void server_uring_stop(server_thread_t *thr)
+{
+    if (thr->uring == NULL) {
+        return;
+    }
+    ev_io_stop(thr->loop, &thr->uring->io);
+    ev_prepare_stop(thr->loop, &thr->uring->prepare);
+
+    /* Closing the ring cancels the requests in flight */
+    server_uring_delete(&thr->uring);
+}
+
+#endif
+
+void server_set_io_uring(bool enable)
+{
+#ifdef HAVE_IO_URING
+    _G.uring = enable;
+#else
+    if (enable) {
+        warn("io_uring support is not built in, using libev");
+    }
+#endif
+}
+
+
+/* Offloading
+ */
+
+static uint64_t server_now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void server_set_offload(int threads, int queue_depth)
+{
+    _G.offload.threads     = MAX(threads, 0);
+    _G.offload.queue_depth = MAX(queue_depth, 1);
+}
+
+bool client_offload(client_t *client, run_job_f run, done_job_f done,
+                    void *data)
+{
+    server_job_t *job;
+
+    if (_G.offload.pool.len == 0) {
+        return false;
+    }
+    pthread_mutex_lock(&_G.offload.lock);
+    if (_G.offload.stats.queued >= (uint32_t)_G.offload.queue_depth) {
+        _G.offload.stats.rejected++;
+        pthread_mutex_unlock(&_G.offload.lock);
+        return false;
+    }
+    job = p_new(server_job_t, 1);
+    job->client    = client;
+    job->owner     = server_thread_g;
+    job->run       = run;
+    job->done      = done;
+    job->data      = data;
+    job->submitted = server_now_usec();
+    *_G.offload.tail = job;
+    _G.offload.tail  = &job->next;
+    _G.offload.stats.submitted++;
+    _G.offload.stats.queued++;
+    _G.offload.stats.max_queued = MAX(_G.offload.stats.max_queued,
+                                      _G.offload.stats.queued);
+    pthread_cond_signal(&_G.offload.cond);
+    pthread_mutex_unlock(&_G.offload.lock);
+
+    /* The client is not read until the job is done, pending output is
+     * still flushed.
+     */
+    client->jobs++;
+    if (client_has_output(client)) {
+        client_flush(client);
+    }
+    client_io_set(client, client_has_output(client) ? EV_WRITE : 0);
+    return true;
+}
+
+void server_get_offload_stats(server_offload_stats_t *stats)
+{
+    pthread_mutex_lock(&_G.offload.lock);
+    *stats = _G.offload.stats;
+    pthread_mutex_unlock(&_G.offload.lock);
+}
+
+static void *server_offload_run(void *data)
+{
+    uint64_t *epoch = data;
+
+    pthread_mutex_lock(&_G.offload.lock);
+    for (;;) {
+        server_job_t *job;
+        uint64_t waited;
+
+        while (_G.offload.head == NULL && !_G.offload.stop) {
+            pthread_cond_wait(&_G.offload.cond, &_G.offload.lock);
+        }
+        if (_G.offload.stop) {
+            break;
+        }
+        job = _G.offload.head;
+        _G.offload.head = job->next;
+        if (_G.offload.head == NULL) {
+            _G.offload.tail = &_G.offload.head;
+        }
+        waited = server_now_usec() - job->submitted;
+        _G.offload.stats.queued--;
+        _G.offload.stats.queue_usec += waited;
+        _G.offload.stats.max_queue_usec = MAX(_G.offload.stats.max_queue_usec,
+                                              waited);
+        pthread_mutex_unlock(&_G.offload.lock);
+
+        pthread_rwlock_rdlock(&_G.config_lock);
+        server_epoch_enter(epoch);
+        job->run(job->data, server_config());
+        server_epoch_leave(epoch);
+        pthread_rwlock_unlock(&_G.config_lock);
+
+        pthread_mutex_lock(&job->owner->jobs_lock);
+        job->next = job->owner->jobs_done;
+        job->owner->jobs_done = job;
+        pthread_mutex_unlock(&job->owner->jobs_lock);
+        ev_async_send(job->owner->loop, &job->owner->jobs_async);
+
+        pthread_mutex_lock(&_G.offload.lock);
+    }
+    pthread_mutex_unlock(&_G.offload.lock);
+    regexp_thread_wipe();
+    return NULL;
+}
+
+/** Deliver a completed job to its client, in the loop of the client.
+ */
+static void server_job_done(server_job_t *job)
+{
+    client_t *client = job->client;
+
+    client->jobs--;
+    if (client->released) {
+        job->done(NULL, job->data);
+        if (client->jobs == 0) {
+            client_release(client);
+        }
+        return;
+    }
+    if (job->done(client, job->data) < 0) {
+        client_release(client);
+        return;
+    }
+    if (client->jobs > 0 && !client_has_output(client)) {
+        return;
+    }
+    if (client_has_output(client)) {
+        client_io_rw(client);
+    } else {
+        client_io_ro(client);
+    }
+}
+
+static void server_jobs_cb(EV_P_ struct ev_async *w, int event)
+{
+    server_thread_t *thr = containerof(w, server_thread_t, jobs_async);
+    server_job_t *jobs, *fifo = NULL;
+
+    pthread_mutex_lock(&thr->jobs_lock);
+    jobs = thr->jobs_done;
+    thr->jobs_done = NULL;
+    pthread_mutex_unlock(&thr->jobs_lock);
+
+    /* Deliver the jobs in the order of their completion */
+    while (jobs != NULL) {
+        server_job_t *next = jobs->next;
+        jobs->next = fifo;
+        fifo = jobs;
+        jobs = next;
+    }
+    while (fifo != NULL) {
+        server_job_t *job = fifo;
+
+        fifo = job->next;
+        pthread_mutex_lock(&_G.offload.lock);
+        _G.offload.stats.completed++;
+        pthread_mutex_unlock(&_G.offload.lock);
+        server_job_done(job);
+        p_delete(&job);
+    }
+}
+
+/** Prepare a loop to receive the completed jobs.
+ */
+static void server_thread_jobs_init(server_thread_t *thr)
+{
+    pthread_mutex_init(&thr->jobs_lock, NULL);
+    ev_async_init(&thr->jobs_async, server_jobs_cb);
+    ev_async_start(thr->loop, &thr->jobs_async);
+}
+
+static void server_thread_jobs_wipe(server_thread_t *thr)
+{
+    ev_async_stop(thr->loop, &thr->jobs_async);
+    while (thr->jobs_done != NULL) {
+        server_job_t *job = thr->jobs_done;
+        thr->jobs_done = job->next;
+        p_delete(&job);
+    }
+    pthread_mutex_destroy(&thr->jobs_lock);
+}
+
+static bool server_offload_start(void)
+{
+    sigset_t set, old;
+
+    _G.offload.tail = &_G.offload.head;
+    _G.offload.stop = false;
+    _G.offload.epochs = p_new(uint64_t, _G.offload.threads);
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (int i = 0 ; i < _G.offload.threads ; ++i) {
+        pthread_t thread;
+
+        _G.offload.epochs[i] = 0;
+        if (pthread_create(&thread, NULL, server_offload_run,
+                           &_G.offload.epochs[i]) != 0)
+        {
+            UNIXERR("pthread_create");
+            break;
+        }
+        array_add(_G.offload.pool, thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return (int)_G.offload.pool.len == _G.offload.threads;
+}
+
+/** Stop the pool. The jobs still queued are dropped.
+ */
+static void server_offload_stop(void)
+{
+    pthread_mutex_lock(&_G.offload.lock);
+    _G.offload.stop = true;
+    pthread_cond_broadcast(&_G.offload.cond);
+    pthread_mutex_unlock(&_G.offload.lock);
+    foreach (thread, _G.offload.pool) {
+        pthread_join(*thread, NULL);
+    }
+    array_wipe(_G.offload.pool);
+    p_delete(&_G.offload.epochs);
+    while (_G.offload.head != NULL) {
+        server_job_t *job = _G.offload.head;
+        _G.offload.head = job->next;
+        p_delete(&job);
+    }
+    _G.offload.tail = &_G.offload.head;
+}
+
+
+/* Graceful upgrade.
+ */
+
+void server_set_upgrade(const char *path, char *const argv[])
+{
+    _G.upgrade.path = path;
+    _G.upgrade.argv = argv;
+}
+
+void server_set_drain_timeout(int milliseconds)
+{
+    _G.upgrade.drain_timeout = MAX(milliseconds, 0);
+}
+
+/** Pick the sockets passed by the previous process, or by systemd.
+ */
+static void server_upgrade_init(void)
+{
+    const char *fds    = getenv("LISTEN_FDS");
+    const char *pid    = getenv("LISTEN_PID");
+    const char *notify = getenv("SERVER_UPGRADE_FD");
+
+    _G.upgrade.notify   = -1;
+    _G.upgrade.ready.fd = -1;
+    _G.upgrade.drain_timeout = SERVER_DRAIN_TIMEOUT;
+    if (fds != NULL && (pid == NULL || atoi(pid) == getpid())) {
+        for (int i = 0, n = atoi(fds) ; i < n ; ++i) {
+            fcntl(3 + i, F_SETFD, FD_CLOEXEC);
+            array_add(_G.upgrade.inherited, 3 + i);
+        }
+    }
+    if (notify != NULL) {
+        _G.upgrade.notify = atoi(notify);
+        fcntl(_G.upgrade.notify, F_SETFD, FD_CLOEXEC);
+    }
+
+    /* Not for the children of this process */
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDNAMES");
+    unsetenv("SERVER_UPGRADE_FD");
+}
+
+/** Tell the previous process that the loop is about to start, and close
+ * the sockets it passed that no listener took.
+ */
+static void server_upgrade_ready(void)
+{
+    foreach (fd, _G.upgrade.inherited) {
+        notice("closing the unused inherited socket %d", *fd);
+        close(*fd);
+    }
+    array_wipe(_G.upgrade.inherited);
+    if (_G.upgrade.notify >= 0) {
+        if (xwrite(_G.upgrade.notify, "R", 1) < 0) {
+            UNIXERR("write");
+        }
+        close(_G.upgrade.notify);
+        _G.upgrade.notify = -1;
+    }
+}
+
+/** A drained client can be closed once it has nothing to read, to write
+ * or to compute: the peer is then waiting for nothing, and a new request
+ * goes to the new process.
+ */
+static bool client_is_idle(client_t *client)
+{
+    int pending = 0;
+
+    if (client->jobs > 0 || client_has_output(client)
+    ||  client->ibuf.len > client->ibuf_off)
+    {
+        return false;
+    }
+#ifdef HAVE_IO_URING
+    if (client->uring.running || client->uring.writing
+    ||  client->uring.input > 0)
+    {
+        return false;
+    }
+#endif
+    return ioctl(client->io.fd, FIONREAD, &pending) < 0 || pending == 0;
+}
+
+static void server_drain_tick(void *data)
+{
+    bool expired = server_now_usec() >= _T.drain_deadline;
+    client_t *next;
+
+    for (client_t *client = _T.clients ; client != NULL ; client = next) {
+        next = client->live_next;
+        if (expired || client_is_idle(client)) {
+            client_release(client);
+        }
+    }
+    /* The jobs and ring requests of the released clients point to the
+     * loop: it must outlive them.
+     */
+    if (_T.clients == NULL && _T.deferred == 0) {
+        ev_unloop(_T.loop, EVUNLOOP_ALL);
+    } else {
+        start_timer(SERVER_DRAIN_TICK, server_drain_tick, NULL);
+    }
+}
+
+/** Stop accepting in the current loop, and leave it once its clients are
+ * gone.
+ */
+static void server_drain_start(void)
+{
+    foreach (l, *server_loop_listeners()) {
+        listener_stop(*l);
+    }
+    _T.drain_deadline = server_now_usec()
+                      + (uint64_t)_G.upgrade.drain_timeout * 1000;
+    server_drain_tick(NULL);
+}
+
+static void server_drain_cb(EV_P_ struct ev_async *w, int event)
+{
+    server_drain_start();
+}
+
+static void server_upgrade_ready_cb(EV_P_ struct ev_io *w, int events)
+{
+    char c;
+    ssize_t res = read(_G.upgrade.ready.fd, &c, 1);
+
+    if (res < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    server_io_wipe(&_G.upgrade.ready);
+    if (res != 1) {
+        warn("the new process exited before being ready, upgrade aborted");
+        return;
+    }
+
+    notice("the new process is ready, draining the connections");
+    pidfile_release();
+    _G.upgrade.draining = true;
+    foreach (thr, _G.workers) {
+        ev_async_send((*thr)->loop, &(*thr)->drain);
+    }
+    server_drain_start();
+}
+
+/** In the child: put the listening sockets and the readiness pipe at 3 and
+ * after, and run the new program.
+ */
+__attribute__((noreturn))
+static void server_upgrade_exec(int notify, char **envp)
+{
+    int n = array_len(_G.listeners);
+    int tmp[n + 1];
+    sigset_t set;
+
+    /* Move them out of the way first, the targets may be taken */
+    for (int i = 0 ; i < n ; ++i) {
+        tmp[i] = fcntl(array_elt(_G.listeners, i)->io.fd, F_DUPFD_CLOEXEC,
+                       3 + n + 1);
+    }
+    tmp[n] = fcntl(notify, F_DUPFD_CLOEXEC, 3 + n + 1);
+    for (int i = 0 ; i <= n ; ++i) {
+        if (tmp[i] < 0 || dup2(tmp[i], 3 + i) < 0) {
+            _exit(127);
+        }
+    }
+
+    /* The other copies of the sockets must not leak */
+    foreach (l, _G.listeners) {
+        if ((*l)->io.fd > 3 + n) {
+            fcntl((*l)->io.fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    if (_G.stats.control != NULL && _G.stats.control->io.fd > 3 + n) {
+        fcntl(_G.stats.control->io.fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    execve(_G.upgrade.path, _G.upgrade.argv, envp);
+    _exit(127);
+}
+
+bool server_upgrade(void)
+{
+    char listen_fds[32];
+    char notify_fd[32];
+    char **envp;
+    int env_len = 0;
+    int fds[2];
+    pid_t pid;
+
+    if (_G.upgrade.path == NULL) {
+        warn("no program to upgrade to");
+        return false;
+    }
+    if (_G.upgrade.draining || _G.upgrade.ready.fd >= 0) {
+        warn("an upgrade is already in progress");
+        return false;
+    }
+
+    /* The child only runs async-signal-safe code: prepare all it needs */
+    for (char **e = environ ; *e != NULL ; ++e) {
+        env_len++;
+    }
+    envp    = p_new(char *, env_len + 3);
+    env_len = 0;
+    for (char **e = environ ; *e != NULL ; ++e) {
+        if (strncmp(*e, "LISTEN_", 7) != 0
+        &&  strncmp(*e, "SERVER_UPGRADE_FD=", 18) != 0)
+        {
+            envp[env_len++] = *e;
+        }
+    }
+    snprintf(listen_fds, sizeof(listen_fds), "LISTEN_FDS=%d",
+             (int)array_len(_G.listeners));
+    snprintf(notify_fd, sizeof(notify_fd), "SERVER_UPGRADE_FD=%d",
+             3 + (int)array_len(_G.listeners));
+    envp[env_len++] = listen_fds;
+    envp[env_len++] = notify_fd;
+    envp[env_len]   = NULL;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        UNIXERR("pipe");
+        p_delete(&envp);
+        return false;
+    }
+    pid = fork();
+    if (pid == 0) {
+        server_upgrade_exec(fds[1], envp);
+    }
+    p_delete(&envp);
+    close(fds[1]);
+    if (pid < 0) {
+        UNIXERR("fork");
+        close(fds[0]);
+        return false;
+    }
+
+    /* Keep accepting until the new process is ready */
+    notice("upgrading to %s (pid %d)", _G.upgrade.path, (int)pid);
+    setnonblock(fds[0]);
+    _G.upgrade.ready.fd = fds[0];
+    ev_io_init(&_G.upgrade.ready.io, server_upgrade_ready_cb, fds[0],
+               EV_READ);
+    ev_io_start(_T.loop, &_G.upgrade.ready.io);
+    return true;
+}
+
+
+/* Server runtime stuff.
+ */
+
+static int server_init(void)
+{
+    pthread_rwlockattr_t attr;
+
+    server_thread_g = &server_main_g;
+    _T.loop    = ev_default_loop(0);
+    _G.threads = 1;
+    _G.accept_batch = SERVER_ACCEPT_BATCH;
+    _G.timer_resolution = 1;
+    _T.stats   = &_T.stats_local;
+    _G.reload.epoch = 1;
+    server_wheel_init(&_T.wheel, _T.loop);
+    server_upgrade_init();
+
+    /* Readers hold the lock most of the time, the refresh must not starve */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&_G.config_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+static void server_shutdown(void)
+{
+    listener_delete(&_G.stats.control);
+    p_delete(&_G.stats.file);
+    server_io_wipe(&_G.upgrade.ready);
+    array_wipe(_G.upgrade.inherited);
+    array_deep_wipe(_G.listeners, listener_delete);
+    array_deep_wipe(_T.client_pool, client_delete);
+    server_slab_wipe();
+    if (_T.loop != NULL) {
+        server_wheel_wipe(&_T.wheel, _T.loop);
+    }
+    array_deep_wipe(_T.timeout_pool, timeout_delete);
+    array_wipe(_G.workers);
+    if (daemon_process) {
+        ev_default_destroy();
+        _T.loop = NULL;
+    }
+}
+module_init(server_init);
+module_exit(server_shutdown);
+
+
+/* Multi-loop mode.
+ */
+
+void server_set_threads(int threads)
+{
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    _G.threads = MAX(threads, 1);
+}
+
+static void server_loop_release(EV_P)
+{
+    server_epoch_leave(&_T.epoch);
+    pthread_rwlock_unlock(&_G.config_lock);
+}
+
+static void server_loop_acquire(EV_P)
+{
+    pthread_rwlock_rdlock(&_G.config_lock);
+    server_epoch_enter(&_T.epoch);
+}
+
+static void server_thread_stop_cb(EV_P_ struct ev_async *w, int event)
+{
+    ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+/** Open another socket bound to the address of the TCP listener @c l, for
+ * the loop of a worker thread. The sockets of a SO_REUSEPORT group each
+ * have their own backlog, and the kernel spreads the new connections over
+ * them: a connection only wakes the loop that will accept it.
+ * \return -1 if @c l is not a TCP listener, or the socket cannot be opened.
+ */
+static int server_listen_reuseport(const listener_t *l)
+{
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int v = 1;
+    int sock;
+
+    if (getsockname(l->io.fd, (struct sockaddr *)&addr, &len) < 0
+    ||  (addr.ss_family != AF_INET && addr.ss_family != AF_INET6))
+    {
+        return -1;
+    }
+
+    /* The first socket is bound without SO_REUSEPORT, so that a second
+     * instance of the program still fails to bind the port: it only joins
+     * the group now.
+     */
+    if (setsockopt(l->io.fd, SOL_SOCKET, SO_REUSEPORT, &v, sizeof(v)) < 0) {
+        UNIXERR("setsockopt(SO_REUSEPORT)");
+        return -1;
+    }
+    sock = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+    if (sock < 0) {
+        UNIXERR("socket");
+        return -1;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v)) < 0
+    ||  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &v, sizeof(v)) < 0
+    ||  bind(sock, (struct sockaddr *)&addr, len) < 0
+    ||  listen(sock, SOMAXCONN) < 0)
+    {
+        UNIXERR("bind");
+        close(sock);
+        return -1;
+    }
+    return sock;
+#else
+    /* Elsewhere, the sockets of the group do not share the connections */
+    return -1;
+#endif
+}
+
+/** Make the copies of the listeners accepting in the loop of @c thr.
+ */
+static void server_thread_listeners(server_thread_t *thr)
+{
+    foreach (l, _G.listeners) {
+        listener_t *tmp = listener_new();
+
+        tmp->io.fd     = server_listen_reuseport(*l);
+        tmp->reuseport = tmp->io.fd >= 0;
+        if (!tmp->reuseport) {
+            tmp->io.fd = (*l)->io.fd;
+        }
+        tmp->parent    = *l;
+        ev_io_init(&tmp->io.io, listener_cb, tmp->io.fd, EV_READ);
+        array_add(thr->listeners, tmp);
+    }
+}
+
+/** Start accepting from the loop of the current thread.
+ */
+static void server_thread_listen(void)
+{
+    foreach (l, _T.listeners) {
+        listener_start(*l);
+    }
+}
+
+static void *server_thread_run(void *data)
+{
+    server_thread_g = data;
+
+#ifdef HAVE_IO_URING
+    if (_G.uring && !server_uring_start(&_T)) {
+        UNIXERR("io_uring_setup");
+    }
+#endif
+    server_slab_init(_G.max_clients);
+    server_thread_listen();
+    pthread_rwlock_rdlock(&_G.config_lock);
+    server_epoch_enter(&_T.epoch);
+    ev_loop(_T.loop, 0);
+    server_epoch_leave(&_T.epoch);
+    pthread_rwlock_unlock(&_G.config_lock);
+
+#ifdef HAVE_IO_URING
+    server_uring_stop(&_T);
+#endif
+    array_deep_wipe(_T.listeners, listener_delete);
+    array_deep_wipe(_T.client_pool, client_delete);
+    server_slab_wipe();
+    server_wheel_wipe(&_T.wheel, _T.loop);
+    array_deep_wipe(_T.timeout_pool, timeout_delete);
+    ev_async_stop(_T.loop, &_T.stop);
+    ev_async_stop(_T.loop, &_T.drain);
+    server_thread_jobs_wipe(&_T);
+    ev_loop_destroy(_T.loop);
+    _T.loop = NULL;
+    regexp_thread_wipe();
+    return NULL;
+}
+
+/* Metrics.
+ */
+
+void server_set_stats_file(const char *file)
+{
+    p_delete(&_G.stats.file);
+    _G.stats.file = file ? p_dupstr(file, strlen(file)) : NULL;
+}
+
+static size_t server_stats_slot_size(void)
+{
+    return (sizeof(server_stats_t) + 63) & ~63;
+}
+
+static size_t server_stats_slot_offset(void)
+{
+    return (sizeof(server_stats_file_t) + 63) & ~63;
+}
+
+/** Slot of the i-th loop in the stats file, NULL if there is no file.
+ */
+static server_stats_t *server_stats_slot(int i)
+{
+    if (_G.stats.map == NULL) {
+        return NULL;
+    }
+    return (server_stats_t *)((char *)_G.stats.map
+                              + server_stats_slot_offset()
+                              + i * server_stats_slot_size());
+}
+
+/** Map the stats file with a slot per loop, and move the metrics of the
+ * main loop in the first slot.
+ */
+static bool server_stats_map(void)
+{
+    size_t len = server_stats_slot_offset()
+               + _G.threads * server_stats_slot_size();
+    void *map;
+    int fd;
+
+    /* A previous process may still map the file (\ref server_upgrade):
+     * it keeps its copy, this one gets a new file.
+     */
+    unlink(_G.stats.file);
+    fd = open(_G.stats.file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        UNIXERR("open");
+        return false;
+    }
+    if (ftruncate(fd, len) < 0) {
+        UNIXERR("ftruncate");
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        UNIXERR("mmap");
+        return false;
+    }
+    _G.stats.map     = map;
+    _G.stats.map_len = len;
+    *server_stats_slot(0) = _T.stats_local;
+    _T.stats = server_stats_slot(0);
+    return true;
+}
+
+/** Fill the header of the stats file, once the loops are known. The magic
+ * comes last, readers must ignore the file until it is set.
+ */
+static void server_stats_publish(void)
+{
+    server_stats_file_t *hdr = _G.stats.map;
+
+    hdr->version     = SERVER_STATS_VERSION;
+    hdr->pid         = getpid();
+    hdr->threads     = _G.threads;
+    hdr->slot_size   = server_stats_slot_size();
+    hdr->slot_offset = server_stats_slot_offset();
+    hdr->started     = time(NULL);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, SERVER_STATS_MAGIC, sizeof(hdr->magic));
+}
+
+static void server_stats_unmap(void)
+{
+    if (_G.stats.map == NULL) {
+        return;
+    }
+    _T.stats_local = *_T.stats;
+    _T.stats = &_T.stats_local;
+    munmap(_G.stats.map, _G.stats.map_len);
+    _G.stats.map = NULL;
+}
+
+/** Add the metrics of @c src to @c dst, with the gauges if @c gauges.
+ */
+static void server_stats_merge(server_stats_t *dst, const server_stats_t *src,
+                               bool gauges)
+{
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+
+    for (size_t i = 0 ; i < sizeof(server_stats_t) / sizeof(uint64_t) ; ++i) {
+        if (!gauges && (&d[i] == &dst->timers_armed
+                        || &d[i] == &dst->clients_active
+                        || &d[i] == &dst->client_pool
+                        || &d[i] == &dst->timeout_pool))
+        {
+            continue;
+        }
+        d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+    }
+}
+
+void server_get_stats(server_stats_t *stats)
+{
+    p_clear(stats, 1);
+    server_stats_merge(stats, server_main_g.stats, true);
+    foreach (thr, _G.workers) {
+        server_stats_merge(stats, (*thr)->stats, true);
+    }
+}
+
+/** Smallest duration (in usec) above @c ratio of the histogram.
+ */
+static double server_histogram_percentile(const server_histogram_t *h,
+                                          double ratio)
+{
+    uint64_t rank = h->count * ratio;
+    uint64_t seen = 0;
+
+    for (int i = 0 ; i < SERVER_STATS_BUCKETS ; ++i) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            return (double)(2ULL << i) / 1000.;
+        }
+    }
+    return (double)(2ULL << (SERVER_STATS_BUCKETS - 1)) / 1000.;
+}
+
+static void server_histogram_dump(buffer_t *out, const char *name,
+                                  const server_histogram_t *h)
+{
+    buffer_addf(out, "%s.count %llu\n", name, (unsigned long long)h->count);
+    if (h->count == 0) {
+        return;
+    }
+    buffer_addf(out, "%s.avg_usec %.3f\n", name,
+                (double)h->sum_nsec / h->count / 1000.);
+    buffer_addf(out, "%s.p50_usec %.3f\n", name,
+                server_histogram_percentile(h, 0.5));
+    buffer_addf(out, "%s.p99_usec %.3f\n", name,
+                server_histogram_percentile(h, 0.99));
+}
+
+void server_stats_dump(buffer_t *out)
+{
+    server_stats_t st;
+
+    server_get_stats(&st);
+#define DUMP(field)                                                          \
+    buffer_addf(out, #field " %llu\n", (unsigned long long)st.field)
+    buffer_addf(out, "loops %d\n", (int)array_len(_G.workers) + 1);
+    DUMP(clients_opened);
+    DUMP(clients_closed);
+    DUMP(accept_errors);
+    DUMP(accepts_deferred);
+    DUMP(accepts_rejected);
+    DUMP(bytes_in);
+    DUMP(bytes_out);
+    DUMP(timers_started);
+    DUMP(timers_fired);
+    DUMP(timers_armed);
+    DUMP(clients_active);
+    DUMP(client_pool);
+    DUMP(timeout_pool);
+#undef DUMP
+    server_histogram_dump(out, "run", &st.run);
+    server_histogram_dump(out, "accept", &st.accept);
+    server_histogram_dump(out, "timeout", &st.timeout);
+}
+
+static void server_stats_control_cb(EV_P_ struct ev_io *w, int events)
+{
+    listener_t *control = listener_of_io(w);
+    buffer_t buf;
+    int sock;
+
+    buffer_init(&buf);
+    while ((sock = accept_nonblock(control->io.fd)) >= 0) {
+        if (buf.len == 0) {
+            server_stats_dump(&buf);
+        }
+        if (xwrite(sock, buf.data, buf.len) < 0) {
+            UNIXERR("write");
+        }
+        close(sock);
+    }
+    buffer_wipe(&buf);
+}
+
+bool server_start_stats_listener(const char *socketfile)
+{
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    int sock;
+    mode_t old;
+
+    old = umask(0177);
+    strncpy(addr.sun_path, socketfile, sizeof(addr.sun_path) - 1);
+    addr.sun_path[sizeof(addr.sun_path) - 1] = 0;
+    sock = tcp_listen_nonblock((const struct sockaddr *)&addr, sizeof(addr));
+    umask(old);
+
+    if (sock < 0) {
+        return false;
+    }
+
+    /* Served by the main loop only, apart from the listeners of the
+     * clients.
+     */
+    listener_delete(&_G.stats.control);
+    _G.stats.control        = listener_new();
+    _G.stats.control->io.fd = sock;
+    ev_io_init(&_G.stats.control->io.io, server_stats_control_cb, sock,
+               EV_READ);
+    ev_io_start(_T.loop, &_G.stats.control->io.io);
+    return true;
+}
+
+
+/** Start the worker threads, the main thread runs the first loop.
+ */
+static bool server_threads_start(void)
+{
+    sigset_t set, old;
+
+    /* The signals are handled by the loop of the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for (int i = 1 ; i < _G.threads ; ++i) {
+        server_thread_t *thr = p_new(server_thread_t, 1);
+
+        thr->stats = server_stats_slot(i) ?: &thr->stats_local;
+        thr->loop = ev_loop_new(EVFLAG_AUTO);
+        if (thr->loop == NULL) {
+            err("cannot create the event loop of thread %d", i);
+            p_delete(&thr);
+            break;
+        }
+        ev_set_loop_release_cb(thr->loop, server_loop_release,
+                               server_loop_acquire);
+        ev_async_init(&thr->stop, server_thread_stop_cb);
+        ev_async_start(thr->loop, &thr->stop);
+        ev_async_init(&thr->drain, server_drain_cb);
+        ev_async_start(thr->loop, &thr->drain);
+        server_thread_jobs_init(thr);
+        server_wheel_init(&thr->wheel, thr->loop);
+        server_thread_listeners(thr);
+        if (pthread_create(&thr->thread, NULL, server_thread_run, thr) != 0) {
+            UNIXERR("pthread_create");
+            array_deep_wipe(thr->listeners, listener_delete);
+            ev_loop_destroy(thr->loop);
+            p_delete(&thr);
+            break;
+        }
+        array_add(_G.workers, thr);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if ((int)array_len(_G.workers) + 1 < _G.threads) {
+        _G.threads = array_len(_G.workers) + 1;
+        return false;
+    }
+    info("running %d event loops", _G.threads);
+    return true;
+}
+
+static void server_threads_stop(void)
+{
+    /* Drained loops stop by themselves once their clients are gone */
+    foreach (thr, _G.workers) {
+        if (!_G.upgrade.draining) {
+            ev_async_send((*thr)->loop, &(*thr)->stop);
+        }
+    }
+    foreach (thr, _G.workers) {
+        pthread_join((*thr)->thread, NULL);
+        /* Keep the counters of the stopped loops, not their gauges. Their
+         * slots are cleared, or the readers of the stats file would count
+         * them twice.
+         */
+        server_stats_merge(_T.stats, (*thr)->stats, false);
+        p_clear((*thr)->stats, 1);
+        p_delete(thr);
+    }
+    array_wipe(_G.workers);
+}
+
+
+/* Configuration snapshots.
+ */
+
+void server_set_config_loader(load_config_f load, delete_config_f del)
+{
+    _G.reload.load   = load;
+    _G.reload.delete = del;
+}
+
+static bool server_epoch_seen(const uint64_t *epoch, uint64_t retired)
+{
+    uint64_t cur = __atomic_load_n(epoch, __ATOMIC_SEQ_CST);
+
+    return cur == 0 || cur >= retired;
+}
+
+/** Whether no thread can still use a configuration retired at @c retired.
+ * The main loop is not checked: it is between two callbacks.
+ */
+static bool server_epoch_passed(uint64_t retired)
+{
+    foreach (thr, _G.workers) {
+        if (!server_epoch_seen(&(*thr)->epoch, retired)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0 ; i < array_len(_G.offload.pool) ; ++i) {
+        if (!server_epoch_seen(&_G.offload.epochs[i], retired)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void server_reclaim(void *data)
+{
+    uint32_t kept = 0;
+
+    _G.reload.reclaim = NULL;
+    foreach (old, _G.reload.retired) {
+        if (server_epoch_passed(old->epoch)) {
+            _G.reload.delete(old->config);
+        } else {
+            array_elt(_G.reload.retired, kept++) = *old;
+        }
+    }
+    _G.reload.retired.len = kept;
+    if (kept > 0) {
+        _G.reload.reclaim = start_timer(SERVER_RECLAIM_TICK, server_reclaim,
+                                        NULL);
+    }
+}
+
+/** Publish a new configuration, the old one is deleted once no thread
+ * uses it anymore.
+ */
+static void server_config_swap(void *config)
+{
+    server_retired_t old = {
+        .config = _G.config,
+    };
+
+    __atomic_store_n(&_G.config, config, __ATOMIC_SEQ_CST);
+    old.epoch = __atomic_add_fetch(&_G.reload.epoch, 1, __ATOMIC_SEQ_CST);
+    array_add(_G.reload.retired, old);
+    if (_G.reload.reclaim == NULL) {
+        server_reclaim(NULL);
+    }
+}
+
+static void *server_reload_run(void *data)
+{
+    _G.reload.result = _G.reload.load(data);
+    regexp_thread_wipe();
+    ev_async_send(server_main_g.loop, &_G.reload.done);
+    return NULL;
+}
+
+static void server_reload_done_cb(EV_P_ struct ev_async *w, int event)
+{
+    pthread_join(_G.reload.thread, NULL);
+    _G.reload.running = false;
+    if (_G.reload.result == NULL) {
+        err("refreshing failed, keeping the current configuration");
+        return;
+    }
+    server_config_swap(_G.reload.result);
+    _G.reload.result = NULL;
+    notice("refreshing done");
+}
+
+/** Build the new configuration on a thread, the loops keep serving with
+ * the current one meanwhile.
+ */
+static void server_reload_start(void)
+{
+    sigset_t set, old;
+    int res;
+
+    if (_G.reload.running) {
+        notice("a refresh is already running");
+        return;
+    }
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    res = pthread_create(&_G.reload.thread, NULL, server_reload_run,
+                         _G.config);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res != 0) {
+        errno = res;
+        UNIXERR("pthread_create");
+        return;
+    }
+    _G.reload.running = true;
+    notice("refreshing the configuration");
+}
+
+/** Wait for the refresh in progress, and delete all the configurations.
+ * The loops and the offload pool must be stopped.
+ */
+static void server_reload_stop(void)
+{
+    if (_G.reload.running) {
+        pthread_join(_G.reload.thread, NULL);
+        _G.reload.running = false;
+        if (_G.reload.result != NULL) {
+            _G.reload.delete(_G.reload.result);
+            _G.reload.result = NULL;
+        }
+    }
+    ev_async_stop(_T.loop, &_G.reload.done);
+    if (_G.reload.reclaim != NULL) {
+        timer_cancel(_G.reload.reclaim);
+        _G.reload.reclaim = NULL;
+    }
+    foreach (old, _G.reload.retired) {
+        _G.reload.delete(old->config);
+    }
+    array_wipe(_G.reload.retired);
+    _G.reload.delete(_G.config);
+    _G.config = NULL;
+}
+
+static void refresh_cb(EV_P_ struct ev_signal *w, int event)
+{
+    bool ok;
+
+    if (_G.reload.load != NULL) {
+        server_reload_start();
+        return;
+    }
+    log_state = "refreshing ";
+    if (_G.shared) {
+        /* Wait for all the loops and jobs to be idle */
+        pthread_rwlock_unlock(&_G.config_lock);
+        pthread_rwlock_wrlock(&_G.config_lock);
+        ok = _G.config_refresh(_G.config);
+        pthread_rwlock_unlock(&_G.config_lock);
+        pthread_rwlock_rdlock(&_G.config_lock);
+    } else {
+        ok = _G.config_refresh(_G.config);
+    }
+    if (!ok) {
+        ev_unloop(EV_A_ EVUNLOOP_ALL);
+        notice("failed");
+    } else {
+        notice("done");
+    }
+    log_state = "";
+}
+
+static void exit_cb(EV_P_ struct ev_signal *w, int event)
+{
+    _G.upgrade.draining = false;
+    ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+static void upgrade_cb(EV_P_ struct ev_signal *w, int event)
+{
+    server_upgrade();
+}
+
+int server_loop(start_client_f starter, delete_client_f deleter,
+                run_client_f runner, refresh_f refresh, void *config)
+{
+    struct ev_signal ev_sighup;
+    struct ev_signal ev_sigint;
+    struct ev_signal ev_sigterm;
+    struct ev_signal ev_sigusr2;
+
+    _G.client_start   = starter;
+    _G.client_delete  = deleter;
+    _G.client_run     = runner;
+    _G.config_refresh = refresh;
+    _G.config         = config;
+
+    if (refresh != NULL || _G.reload.load != NULL) {
+        ev_signal_init(&ev_sighup, refresh_cb, SIGHUP);
+        ev_signal_start(_T.loop, &ev_sighup);
+    }
+    if (_G.reload.load != NULL) {
+        ev_async_init(&_G.reload.done, server_reload_done_cb);
+        ev_async_start(_T.loop, &_G.reload.done);
+    }
+    ev_signal_init(&ev_sigint, exit_cb, SIGINT);
+    ev_signal_start(_T.loop, &ev_sigint);
+    ev_signal_init(&ev_sigterm, exit_cb, SIGTERM);
+    ev_signal_start(_T.loop, &ev_sigterm);
+    if (_G.upgrade.path != NULL) {
+        ev_signal_init(&ev_sigusr2, upgrade_cb, SIGUSR2);
+        ev_signal_start(_T.loop, &ev_sigusr2);
+    }
+
+    server_thread_jobs_init(&_T);
+    if (_G.clients_cap > 0) {
+        _G.max_clients = (_G.clients_cap + _G.threads - 1) / _G.threads;
+        _G.low_water   = _G.clients_low / _G.threads;
+        server_slab_init(_G.max_clients);
+    }
+#ifdef HAVE_IO_URING
+    if (_G.uring) {
+        if (server_uring_start(&_T)) {
+            info("serving the connections with io_uring");
+            foreach (l, _G.listeners) {
+                listener_start(*l);
+            }
+        } else {
+            notice("io_uring is not available (%m), using libev");
+            _G.uring = false;
+        }
+    }
+#endif
+    if (_G.stats.file != NULL && !server_stats_map()) {
+        warn("cannot publish the metrics in %s", _G.stats.file);
+    }
+    if (_G.offload.threads > 0 && !server_offload_start()) {
+        warn("only %d offload threads could be started",
+             (int)_G.offload.pool.len);
+    }
+    if (_G.threads > 1 && !server_threads_start()) {
+        warn("only %d event loops could be started", _G.threads);
+    }
+    if (_G.stats.map != NULL) {
+        server_stats_publish();
+    }
+    _G.shared = array_len(_G.workers) > 0 || _G.offload.pool.len > 0;
+    if (_G.shared) {
+        ev_set_loop_release_cb(_T.loop, server_loop_release,
+                               server_loop_acquire);
+        pthread_rwlock_rdlock(&_G.config_lock);
+    }
+
+    server_upgrade_ready();
+    log_state = "";
+    notice("entering processing loop");
+    ev_loop(_T.loop, 0);
+    notice("exit requested");
+
+    if (_G.shared) {
+        pthread_rwlock_unlock(&_G.config_lock);
+        /* The pool delivers the jobs to the loops, it stops first. Drained
+         * loops wait for the jobs of their clients: they stop first then.
+         */
+        if (_G.upgrade.draining) {
+            server_threads_stop();
+            server_offload_stop();
+        } else {
+            server_offload_stop();
+            server_threads_stop();
+        }
+        ev_set_loop_release_cb(_T.loop, NULL, NULL);
+        _G.shared = false;
+    }
+#ifdef HAVE_IO_URING
+    server_uring_stop(&_T);
+#endif
+    server_thread_jobs_wipe(&_T);
+    if (_G.reload.load != NULL) {
+        server_reload_stop();
+    }
+    server_stats_unmap();
     return EXIT_SUCCESS;
 }
 
@@ -51,27 +51,279 @@ typedef void *(*start_client_f)(listener_t*);
 typedef int   (*run_client_f)(client_t*, void*);
 typedef void  (*run_timeout_f)(void*);
 typedef bool  (*refresh_f)(void*);
+typedef void *(*load_config_f)(const void *current);
+typedef void  (*delete_config_f)(void *config);
+typedef void  (*run_job_f)(void *data, void *config);
+typedef void  (*release_slice_f)(void *owner);
+typedef int   (*done_job_f)(client_t*, void *data);
 
 
 listener_t *start_tcp_listener(int port);
 listener_t *start_unix_listener(const char *socketfile);
 
+/** Set the maximum number of connections a listener accepts at once
+ * (64 by default).
+ */
+void server_set_accept_batch(int batch);
+
+/** Cap the number of accepted connections served at once (0, the default,
+ * for no cap). The cap is split evenly between the loops: a loop stops
+ * accepting when it reaches its share, the connections then wait in the
+ * backlog, and it resumes once its clients fall to its share of
+ * @c low_water (90% of the cap if 0).
+ *
+ * With a cap, the clients of each loop are preallocated in a single block
+ * when server_loop starts. Must be called before server_loop.
+ */
+void server_set_max_clients(int max_clients, int low_water);
+
 client_t *client_register(int fd, run_client_f runner, void *data);
 void client_delete(client_t **client);
 void client_release(client_t *client);
 
+/** Select the events the client waits for.
+ *
+ * client_io_rw first tries to write the pending output at once: EV_WRITE is
+ * only watched if the socket would block. The watcher is not restarted
+ * when the events do not change.
+ */
 void client_io_none(client_t *client);
 void client_io_rw(client_t *client);
 void client_io_ro(client_t *client);
 
 ssize_t client_read(client_t *client);
 buffer_t *client_input_buffer(client_t *client);
+
+/** Get the part of the input that was not consumed yet.
+ *
+ * Consuming the input with client_input_consume only moves an offset, the
+ * consumed data is dropped by client_read when the buffer runs out of
+ * space: parsing pipelined requests does not move the rest of the input
+ * for each of them. The input buffer must then not be consumed with
+ * buffer_consume.
+ */
+clstr_t client_input_str(client_t *client);
+void client_input_consume(client_t *client, int len);
+
+/** Get the buffer to append the output of the client to. The pointer must
+ * not be kept across calls: with io_uring, the content being written is
+ * moved out of the buffer when it is asked for again.
+ */
 buffer_t *client_output_buffer(client_t *client);
 void *client_data(client_t *client);
 
+/** Queue @c len bytes at @c data to be written to the client after what is
+ * already in its output buffer, without copying them (e.g. a region of a
+ * file_map_t). The data must stay valid until @c release is called with
+ * @c owner (if not NULL), once it is written or the client released.
+ *
+ * The output buffer of the client can still be used afterwards: the output
+ * is written in order, several responses with a single writev.
+ */
+void client_write_slice(client_t *client, const void *data, size_t len,
+                        release_slice_f release, void *owner);
+
+/** Check whether some output of the client is still to be written.
+ */
+bool client_has_output(client_t *client);
+
+/* Clients and timers belong to the event loop of the thread that created
+ * them: they must only be used from that thread.
+ */
 timeout_t *start_timer(int milliseconds, run_timeout_f runner, void *data);
+
+/** Cancel a timer that has not expired yet. The timer must not be used
+ * once it expired or was cancelled.
+ */
 void timer_cancel(timeout_t *timer);
 
+/** Set the resolution of the timers, in milliseconds (1 by default), and
+ * the delay a timer may be late so that close expirations are handled by
+ * a single wake-up (0 by default). Must be called before the first timer
+ * is started.
+ */
+void server_set_timer_resolution(int resolution, int slack);
+
+
+/** Run a CPU-heavy part of a client handler on the offload pool.
+ *
+ * @c run is called with @c data by a thread of the pool. @c done is then
+ * called with @c data in the loop of the client, and can fill the output
+ * buffer of the client: the client is written and read again once it
+ * returns, or released if it returns a negative value. If the client was
+ * released meanwhile, @c done is called with a NULL client to free @c data.
+ *
+ * The client is not read while it has jobs in flight.
+ *
+ * \return false if the pool is not running or its queue is full: the
+ * handler must then do the work inline (or reject the request).
+ */
+bool client_offload(client_t *client, run_job_f run, done_job_f done,
+                    void *data);
+
+typedef struct server_offload_stats_t {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t rejected;          /**< jobs refused because the queue was full */
+    uint32_t queued;            /**< jobs waiting for a thread */
+    uint32_t max_queued;
+    uint64_t queue_usec;        /**< total time spent by the jobs in queue */
+    uint64_t max_queue_usec;
+} server_offload_stats_t;
+
+/** Configure the offload pool started by server_loop: @c threads threads
+ * (none by default), and at most @c queue_depth queued jobs.
+ */
+void server_set_offload(int threads, int queue_depth);
+
+void server_get_offload_stats(server_offload_stats_t *stats);
+
+/** Set the number of event loops run by server_loop, each in its own
+ * thread (0 for one per online core). The default is a single loop, run by
+ * the calling thread.
+ *
+ * On Linux, each loop accepts the connections of a TCP port through its
+ * own socket in a SO_REUSEPORT group, and the kernel spreads them over the
+ * loops. The unix sockets are shared by all the loops. Each connection is
+ * served by the loop that accepted it. The callbacks must then be thread
+ * safe, the configuration is only refreshed when all the loops are idle.
+ * Must be called before server_loop.
+ */
+void server_set_threads(int threads);
+
+/** Serve the connections with io_uring instead of libev (Linux 5.19 and
+ * later, built with make io_uring=1). Each loop then submits the reads,
+ * writes and accepts of its clients at once before it waits for events.
+ * The loops that cannot set up a ring fall back to libev. Must be called
+ * before server_loop.
+ */
+void server_set_io_uring(bool enable);
+
+
+/* Graceful upgrade.
+ *
+ * server_upgrade runs a new instance of the program, and passes it the
+ * listening sockets as systemd socket activation does: as the descriptors
+ * 3 to 3 + LISTEN_FDS - 1. In the new process, start_tcp_listener and
+ * start_unix_listener take the inherited socket bound to their address
+ * instead of binding a new one, so no connection is refused meanwhile.
+ *
+ * The old process keeps accepting until the new one enters server_loop.
+ * It then stops accepting, closes its clients as soon as they are idle
+ * (nothing to read, to write or to compute) and leaves server_loop once
+ * they are all gone, or after the drain timeout.
+ */
+
+/** Set the program run by server_upgrade, and its arguments (e.g. argv of
+ * main, the arrays must remain valid). Once set, SIGUSR2 triggers the
+ * upgrade.
+ */
+void server_set_upgrade(const char *path, char *const argv[]);
+
+/** Set the maximum time given to the clients to finish their requests
+ * when the process is upgraded (in ms, 30s by default).
+ */
+void server_set_drain_timeout(int milliseconds);
+
+/** Start the new process. Must be called from the main loop.
+ * \return false if the new process could not be started.
+ */
+bool server_upgrade(void);
+
+
+/* Metrics.
+ *
+ * Each loop counts its activity in its own slot, with no lock: a slot is
+ * only written by its loop, and is read field by field by the others. With
+ * server_set_stats_file, the slots are in a shared file that monitoring
+ * tools can map and read at any time:
+ *
+ *   server_stats_file_t header;
+ *   server_stats_t      slots[header.threads];  (at header.slot_offset,
+ *                                                header.slot_size apart)
+ *
+ * The gauges (clients, timers, pools) are current values, the other fields
+ * are counters since the start of the server.
+ */
+
+#define SERVER_STATS_MAGIC    "SRVSTATS"
+#define SERVER_STATS_VERSION  2
+#define SERVER_STATS_BUCKETS  32
+
+/** Durations, by powers of 2: bucket i counts the durations d such that
+ * 2^i <= d < 2^(i+1) nanoseconds (bucket 0 also counts d = 0, the last
+ * bucket all the longer durations).
+ */
+typedef struct server_histogram_t {
+    uint64_t count;
+    uint64_t sum_nsec;
+    uint64_t buckets[SERVER_STATS_BUCKETS];
+} server_histogram_t;
+
+typedef struct server_stats_t {
+    uint64_t clients_opened;    /**< connections accepted or registered */
+    uint64_t clients_closed;
+    uint64_t accept_errors;
+    uint64_t accepts_deferred;  /**< accepting suspended at the cap */
+    uint64_t accepts_rejected;  /**< connections closed at once */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t timers_started;
+    uint64_t timers_fired;
+    uint64_t timers_armed;      /**< gauge */
+    uint64_t clients_active;    /**< gauge: accepted clients being served */
+    uint64_t client_pool;       /**< gauge: clients kept for reuse */
+    uint64_t timeout_pool;      /**< gauge: timers kept for reuse */
+
+    server_histogram_t run;     /**< run_client_f calls */
+    server_histogram_t accept;  /**< accept batches of the listeners */
+    server_histogram_t timeout; /**< timer callbacks */
+} server_stats_t;
+
+typedef struct server_stats_file_t {
+    char     magic[8];          /**< SERVER_STATS_MAGIC */
+    uint32_t version;           /**< SERVER_STATS_VERSION */
+    uint32_t pid;
+    uint32_t threads;           /**< number of slots */
+    uint32_t slot_size;
+    uint32_t slot_offset;
+    uint32_t pad;
+    uint64_t started;           /**< start of the server (Unix time) */
+} server_stats_file_t;
+
+/** Publish the metrics in @c file, created when server_loop starts.
+ * Must be called before server_loop.
+ */
+void server_set_stats_file(const char *file);
+
+/** Sum the metrics of all the loops.
+ */
+void server_get_stats(server_stats_t *stats);
+
+/** Append a text dump of the metrics to @c out.
+ */
+void server_stats_dump(buffer_t *out);
+
+/** Dump the metrics to each connection to the unix socket @c socketfile.
+ */
+bool server_start_stats_listener(const char *socketfile);
+
+
+/** Refresh the configuration by building a new one on a background thread
+ * on SIGHUP, instead of calling the refresh_f of server_loop in the loop.
+ *
+ * @c load gets the current configuration (read-only) and returns the new
+ * one, or NULL on error, the current one being then kept. The new
+ * configuration is published atomically: the callbacks that are running
+ * finish with the one they got, the next ones get the new one. A replaced
+ * configuration is deleted with @c del once no callback can use it, the
+ * callbacks must thus not keep it after they return.
+ *
+ * The server then owns the configuration given to server_loop, and deletes
+ * the last one when server_loop returns.
+ */
+void server_set_config_loader(load_config_f load, delete_config_f del);
+
 
 int server_loop(start_client_f starter, delete_client_f deleter,
                 run_client_f runner, refresh_f refresh, void *config);
@@ -0,0 +1,248 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Benchmark of the event loops of the server.
+ *
+ * The server answers policy-like requests on a TCP port of the loopback
+ * with the given number of event loops, while forked loaders keep a number
+ * of connections busy, one request in flight on each. The throughput and
+ * the connections accepted by each loop are reported: run it with 1, 2,
+ * 4... loops up to the number of cores to see how the server scales.
+ *
+ *     server_bench [loops [connections [requests [port]]]]
+ */
+
+#define _GNU_SOURCE /* memmem */
+#include <poll.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "server.h"
+
+#define BENCH_LOADERS    4
+#define BENCH_LOOPS_MAX  256
+
+static const char bench_request_g[] =
+    "request=smtpd_access_policy\nprotocol_state=RCPT\n"
+    "sender=foo@example.com\nrecipient=bar@example.net\n"
+    "client_address=192.0.2.1\n\n";
+static const char bench_answer_g[] = "action=DUNNO\n\n";
+
+static int bench_connections_g;
+static int bench_closed_g;
+static int bench_loops_g;
+static uint64_t bench_served_g;
+static int bench_accepted_g[BENCH_LOOPS_MAX];
+static __thread int bench_loop_t = -1;
+
+static void *bench_start(listener_t *l)
+{
+    if (bench_loop_t < 0) {
+        bench_loop_t = __sync_fetch_and_add(&bench_loops_g, 1);
+    }
+    if (bench_loop_t < BENCH_LOOPS_MAX) {
+        __sync_fetch_and_add(&bench_accepted_g[bench_loop_t], 1);
+    }
+    return &bench_loop_t;
+}
+
+static void bench_delete(void *data)
+{
+    if (__sync_add_and_fetch(&bench_closed_g, 1) == bench_connections_g) {
+        kill(getpid(), SIGTERM);
+    }
+}
+
+static int bench_run(client_t *client, void *config)
+{
+    ssize_t res = client_read(client);
+    uint64_t served = 0;
+
+    if (res <= 0) {
+        return res < 0 && errno == EAGAIN ? 0 : -1;
+    }
+    for (;;) {
+        clstr_t in = client_input_str(client);
+        const char *end = memmem(in.str, in.len, "\n\n", 2);
+
+        if (end == NULL) {
+            break;
+        }
+        client_input_consume(client, end + 2 - in.str);
+        buffer_addstr(client_output_buffer(client), bench_answer_g);
+        served++;
+    }
+    __sync_fetch_and_add(&bench_served_g, served);
+    client_io_rw(client);
+    return 0;
+}
+
+static bool bench_send(int fd)
+{
+    const ssize_t len = sizeof(bench_request_g) - 1;
+
+    return write(fd, bench_request_g, len) == len;
+}
+
+/** Run @c connections connections of @c requests requests each.
+ */
+static int bench_load(int port, int connections, int requests)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr   = { htonl(INADDR_LOOPBACK) },
+        .sin_port   = htons(port),
+    };
+    struct pollfd *fds = p_new(struct pollfd, connections);
+    int *left = p_new(int, connections);
+    int done = 0;
+
+    for (int i = 0 ; i < connections ; ++i) {
+        fds[i].fd     = socket(AF_INET, SOCK_STREAM, 0);
+        fds[i].events = POLLIN;
+        left[i]       = requests;
+        if (fds[i].fd < 0
+        ||  connect(fds[i].fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        ||  !bench_send(fds[i].fd))
+        {
+            UNIXERR("connect");
+            return EXIT_FAILURE;
+        }
+    }
+    while (done < connections) {
+        if (poll(fds, connections, 5000) <= 0) {
+            err("the server stalled, %d connections done", done);
+            return EXIT_FAILURE;
+        }
+        for (int i = 0 ; i < connections ; ++i) {
+            char buf[BUFSIZ];
+            ssize_t res;
+
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            res = read(fds[i].fd, buf, sizeof(buf));
+            if (res != (ssize_t)sizeof(bench_answer_g) - 1
+            ||  memcmp(buf, bench_answer_g, res) != 0)
+            {
+                err("unexpected answer of the server");
+                return EXIT_FAILURE;
+            }
+            if (--left[i] == 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                done++;
+                continue;
+            }
+            if (!bench_send(fds[i].fd)) {
+                UNIXERR("write");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    p_delete(&fds);
+    p_delete(&left);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    int loops = argc > 1 ? atoi(argv[1]) : 1;
+    int connections = argc > 2 ? atoi(argv[2]) : 400;
+    int requests = argc > 3 ? atoi(argv[3]) : 500;
+    int port = argc > 4 ? atoi(argv[4]) : 10029;
+    struct timespec start, end;
+    int done[2];
+    int succeeded = 0;
+    char res;
+    double elapsed;
+
+    connections = MAX(connections, BENCH_LOADERS);
+    bench_connections_g = connections;
+    log_level = LOG_WARNING;
+    server_set_threads(loops);
+    if (start_tcp_listener(port) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    /* The loop of the server reaps the children: the loaders report their
+     * result through a pipe instead.
+     */
+    if (pipe(done) < 0) {
+        UNIXERR("pipe");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0 ; i < BENCH_LOADERS ; ++i) {
+        int share = connections / BENCH_LOADERS
+                  + (i < connections % BENCH_LOADERS);
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            UNIXERR("fork");
+            return EXIT_FAILURE;
+        }
+        if (pid == 0) {
+            res = bench_load(port, share, requests) == EXIT_SUCCESS;
+            _exit(write(done[1], &res, 1) == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    close(done[1]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    server_loop(bench_start, bench_delete, bench_run, NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    while (read(done[0], &res, 1) == 1) {
+        succeeded += res;
+    }
+    close(done[0]);
+
+    elapsed = (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d loops, %d connections, %llu requests: %.3fs, %.0f req/s\n",
+           loops, connections, (unsigned long long)bench_served_g, elapsed,
+           bench_served_g / elapsed);
+    printf("connections accepted by each loop:");
+    for (int i = 0 ; i < MIN(bench_loops_g, BENCH_LOOPS_MAX) ; ++i) {
+        printf(" %d", bench_accepted_g[i]);
+    }
+    printf("\n");
+    if (succeeded < BENCH_LOADERS) {
+        err("%d loaders failed", BENCH_LOADERS - succeeded);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
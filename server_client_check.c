@@ -0,0 +1,329 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Check of the input and output of the clients of the server.
+ *
+ * Clients are registered on one end of socket pairs, and served by the
+ * default loop of libev, the check playing the other end:
+ *  - the output, made of the output buffer and of slices written without
+ *    copy, must reach the socket in order and the slices be released,
+ *    whatever the size of the socket buffer and the number of slices;
+ *  - the input, consumed by moving an offset, must be read back in order;
+ *  - a response written by the handler must be sent at once, without
+ *    waiting for the socket to be writable;
+ *  - the pool of released clients must stay bounded.
+ *
+ *     server_client_check [seed]
+ */
+
+#define _GNU_SOURCE /* memmem */
+#include "regexp_check.h"
+#include "server.h"
+#include <ev.h>
+
+#define CHECK_OUTPUT_MAX  (1 << 21)
+
+static int check_pair(int sv[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        UNIXERR("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    setnonblock(sv[0]);
+    setnonblock(sv[1]);
+    return sv[0];
+}
+
+static void check_loop(void)
+{
+    ev_loop(ev_default_loop(0), EVLOOP_NONBLOCK);
+}
+
+static int check_idle(client_t *client, void *data)
+{
+    return 0;
+}
+
+
+/* Output {{{1
+ */
+
+static int check_released_g;
+
+static void check_release(void *owner)
+{
+    check_released_g += (intptr_t)owner;
+}
+
+static void check_add(client_t *client, buffer_t *expect, const char *data,
+                      int len, bool slice)
+{
+    if (slice) {
+        client_write_slice(client, data, len, check_release, (void *)1);
+    } else {
+        buffer_add(client_output_buffer(client), data, len);
+    }
+    buffer_add(expect, data, len);
+}
+
+/** Write random output through a small socket buffer, as a mix of the
+ * output buffer and of slices, and read it back.
+ */
+static void check_output(int rounds, int slice_len, int sndbuf)
+{
+    static char slices[CHECK_OUTPUT_MAX];
+    buffer_t expect = BUFFER_INIT;
+    buffer_t got = BUFFER_INIT;
+    client_t *client;
+    int sv[2], used = 0, slices_count = 0, iter = 0;
+
+    check_pair(sv);
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    client = client_register(sv[0], check_idle, NULL);
+    check_released_g = 0;
+
+    for (int k = 0 ; k < rounds ; ++k) {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "<%d:%d>", k, check_rand(1000));
+
+        check_add(client, &expect, buf, len, false);
+        if (check_rand(2) && used + slice_len <= CHECK_OUTPUT_MAX) {
+            for (int j = 0 ; j < slice_len ; ++j) {
+                slices[used + j] = 'A' + (k + j) % 26;
+            }
+            check_add(client, &expect, slices + used, slice_len, true);
+            used += slice_len;
+            slices_count++;
+        }
+    }
+    client_io_rw(client);
+
+    while (client_has_output(client) && iter++ < 100000) {
+        check_loop();
+        buffer_read(&got, sv[1], -1);
+
+        /* Output appended while the rest is being written */
+        if (iter == 3) {
+            check_add(client, &expect, "TAIL", 4, false);
+            client_io_rw(client);
+        }
+    }
+    while (buffer_read(&got, sv[1], -1) > 0) {
+    }
+
+    if (got.len != expect.len || memcmp(got.data, expect.data, got.len)) {
+        printf("output of %d rounds of slices of %d bytes: %d bytes "
+               "written, %d expected\n", rounds, slice_len, got.len,
+               expect.len);
+        check_failures_g++;
+    }
+    CHECK(check_released_g == slices_count);
+    client_release(client);
+    close(sv[1]);
+    buffer_wipe(&expect);
+    buffer_wipe(&got);
+}
+
+
+/* Input {{{1
+ */
+
+static int check_records_g;
+static int check_record_fails_g;
+
+/** Consume the records of the input, only some of them at a time.
+ */
+static int check_consume(client_t *client, void *data)
+{
+    ssize_t res;
+
+    while ((res = client_read(client)) > 0) {
+    }
+    if (res == 0) {
+        return -1;
+    }
+    for (;;) {
+        clstr_t in = client_input_str(client);
+        const char *nl = memchr(in.str, '\n', in.len);
+        char want[32];
+        int len;
+
+        if (nl == NULL) {
+            break;
+        }
+        len = snprintf(want, sizeof(want), "record %d", check_records_g++);
+        if (nl - in.str != len || memcmp(in.str, want, len) != 0) {
+            check_record_fails_g++;
+        }
+        client_input_consume(client, nl - in.str + 1);
+        if (check_rand(7) == 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+static void check_input(void)
+{
+    client_t *client;
+    int sv[2], written = 0;
+
+    check_pair(sv);
+    client = client_register(sv[0], check_consume, NULL);
+    check_records_g = check_record_fails_g = 0;
+
+    for (int round = 0 ; round < 2000 ; ++round) {
+        int records = 1 + check_rand(40);
+
+        for (int k = 0 ; k < records ; ++k) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "record %d\n", written++);
+
+            if (write(sv[1], buf, len) != len) {
+                UNIXERR("write");
+                check_failures_g++;
+            }
+        }
+        check_loop();
+    }
+    check_loop();
+
+    /* The handler leaves some records in the input, with nothing new to
+     * read: they are parsed by calling it again.
+     */
+    for (int i = 0 ; i < 10000 && check_records_g < written ; ++i) {
+        check_consume(client, NULL);
+    }
+
+    CHECK(check_record_fails_g == 0);
+    CHECK(check_records_g == written);
+    client_release(client);
+    close(sv[1]);
+}
+
+
+/* Responses {{{1
+ */
+
+static int check_answer(client_t *client, void *data)
+{
+    for (;;) {
+        clstr_t in;
+        const char *end;
+
+        if (client_read(client) <= 0 && errno != EAGAIN) {
+            return -1;
+        }
+        in  = client_input_str(client);
+        end = memmem(in.str, in.len, "\n\n", 2);
+        if (end == NULL) {
+            return 0;
+        }
+        client_input_consume(client, end + 2 - in.str);
+        buffer_addstr(client_output_buffer(client), "action=DUNNO\n\n");
+        client_io_rw(client);
+    }
+}
+
+static void check_responses(void)
+{
+    static const char request[] = "request=smtpd_access_policy\n\n";
+    static const char answer[]  = "action=DUNNO\n\n";
+    client_t *client;
+    int sv[2];
+
+    check_pair(sv);
+    client = client_register(sv[0], check_answer, NULL);
+    for (int k = 0 ; k < 1000 ; ++k) {
+        char buf[64];
+
+        if (write(sv[1], request, sizeof(request) - 1)
+            != sizeof(request) - 1)
+        {
+            UNIXERR("write");
+            check_failures_g++;
+            break;
+        }
+
+        /* A single iteration runs the handler and sends the answer */
+        check_loop();
+        CHECK(!client_has_output(client));
+        if (read(sv[1], buf, sizeof(buf)) != sizeof(answer) - 1) {
+            printf("answer %d not sent at once\n", k);
+            check_failures_g++;
+            break;
+        }
+    }
+    client_release(client);
+    close(sv[1]);
+}
+
+
+/* Pool {{{1
+ */
+
+static void check_pool(void)
+{
+    client_t *clients[600];
+    server_stats_t stats;
+
+    for (int i = 0 ; i < countof(clients) ; ++i) {
+        int sv[2];
+
+        clients[i] = client_register(check_pair(sv), check_idle, NULL);
+        close(sv[1]);
+    }
+    for (int i = 0 ; i < countof(clients) ; ++i) {
+        client_release(clients[i]);
+    }
+    server_get_stats(&stats);
+    CHECK(stats.client_pool <= 256);
+    CHECK(stats.clients_opened == stats.clients_closed);
+}
+
+int main(int argc, char *argv[])
+{
+    check_seed(argc, argv);
+    check_output(200, 3000, 4096);
+    check_output(100, 3, 65536);
+    check_output(1000, 1, 1024);
+    check_input();
+    check_responses();
+    check_pool();
+    printf("server clients: %d failures\n", check_failures_g);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
@@ -0,0 +1,282 @@
+/****************************************************************************/
+/*          pfixtools: a collection of postfix related tools                */
+/*          ~~~~~~~~~                                                       */
+/*  ______________________________________________________________________  */
+/*                                                                          */
+/*  Redistribution and use in source and binary forms, with or without      */
+/*  modification, are permitted provided that the following conditions      */
+/*  are met:                                                                */
+/*                                                                          */
+/*  1. Redistributions of source code must retain the above copyright       */
+/*     notice, this list of conditions and the following disclaimer.        */
+/*  2. Redistributions in binary form must reproduce the above copyright    */
+/*     notice, this list of conditions and the following disclaimer in      */
+/*     the documentation and/or other materials provided with the           */
+/*     distribution.                                                        */
+/*  3. The names of its contributors may not be used to endorse or promote  */
+/*     products derived from this software without specific prior written   */
+/*     permission.                                                          */
+/*                                                                          */
+/*  THIS SOFTWARE IS PROVIDED BY THE CONTRIBUTORS ``AS IS'' AND ANY         */
+/*  EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE       */
+/*  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR      */
+/*  PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE CONTRIBUTORS BE LIABLE   */
+/*  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR            */
+/*  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF    */
+/*  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR         */
+/*  BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,   */
+/*  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE    */
+/*  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,       */
+/*  EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                      */
+/*                                                                          */
+/*   Copyright (c) 2006-2014 the Authors                                    */
+/*   see AUTHORS and source files for details                               */
+/****************************************************************************/
+
+/* Check of the timing wheel on a simulated clock.
+ *
+ * server.c is built in this program with the clock and the timers of libev
+ * replaced by a simulated clock, which only moves when the check says so:
+ * the check jumps from one expiration of the ticker of the wheel to the
+ * next one, and can run hours of timers in a fraction of a second. Random
+ * timers, from immediate ones to timers of several days, are started,
+ * cancelled (also from the callbacks) and started again from the
+ * callbacks. Each timer must fire exactly once, never before its delay, at
+ * most the resolution and the slack after it, and never once cancelled.
+ *
+ *     server_wheel_check [seed [timers]]
+ */
+
+#define _GNU_SOURCE /* server.c */
+#include "regexp_check.h"
+#include <ev.h>
+
+/* Simulated clock {{{1
+ */
+
+#define CHECK_ARMED  16
+
+static ev_tstamp check_now_g;
+static ev_timer *check_armed_g[CHECK_ARMED];
+static int check_narmed_g;
+
+static ev_tstamp check_ev_now(struct ev_loop *loop)
+{
+    return check_now_g;
+}
+
+static void check_timer_stop(struct ev_loop *loop, ev_timer *w)
+{
+    for (int i = 0 ; i < check_narmed_g ; ++i) {
+        if (check_armed_g[i] == w) {
+            check_armed_g[i] = check_armed_g[--check_narmed_g];
+            break;
+        }
+    }
+    w->active = 0;
+}
+
+static void check_timer_start(struct ev_loop *loop, ev_timer *w)
+{
+    /* The watcher keeps its expiration date in "at", as libev does */
+    check_timer_stop(loop, w);
+    w->at += check_now_g;
+    w->active = 1;
+    check_armed_g[check_narmed_g++] = w;
+}
+
+#define ev_now          check_ev_now
+#define ev_timer_start  check_timer_start
+#define ev_timer_stop   check_timer_stop
+#include "server.c"
+#undef ev_now
+#undef ev_timer_start
+#undef ev_timer_stop
+
+/** Get the first armed watcher, NULL if none is.
+ */
+static ev_timer *check_next(void)
+{
+    ev_timer *next = NULL;
+
+    for (int i = 0 ; i < check_narmed_g ; ++i) {
+        if (next == NULL || check_armed_g[i]->at < next->at) {
+            next = check_armed_g[i];
+        }
+    }
+    return next;
+}
+
+/** Move the clock to @c to, running the watchers that expire meanwhile at
+ * their expiration date.
+ */
+static void check_advance(ev_tstamp to)
+{
+    ev_timer *w;
+
+    while ((w = check_next()) != NULL && w->at <= to) {
+        check_now_g = MAX(check_now_g, w->at);
+        check_timer_stop(NULL, w);
+        w->cb(_T.loop, w, EV_TIMER);
+    }
+    check_now_g = MAX(check_now_g, to);
+}
+
+
+/* Timers {{{1
+ */
+
+typedef struct check_timer_t {
+    timeout_t *timer;
+    ev_tstamp  due;
+    ev_tstamp  fired_at;
+    int        fired;
+    bool       cancelled;
+} check_timer_t;
+
+static check_timer_t *check_timers_g;
+static int check_started_g;
+static int check_max_g;
+static ev_tstamp check_late_g;
+
+static void check_start(int milliseconds);
+
+/** Cancel a random timer that is still pending.
+ */
+static void check_cancel(void)
+{
+    check_timer_t *t = &check_timers_g[check_rand(check_started_g)];
+
+    if (!t->fired && !t->cancelled) {
+        timer_cancel(t->timer);
+        t->cancelled = true;
+    }
+}
+
+static void check_run(void *data)
+{
+    check_timer_t *t = &check_timers_g[(intptr_t)data];
+
+    t->fired++;
+    t->fired_at = check_now_g;
+    if (check_rand(50) == 0) {
+        check_start(check_rand(3) ? check_rand(100) : 0);
+    }
+    if (check_rand(50) == 0) {
+        check_cancel();
+    }
+}
+
+static void check_start(int milliseconds)
+{
+    check_timer_t *t;
+
+    if (check_started_g >= check_max_g) {
+        return;
+    }
+    t = &check_timers_g[check_started_g];
+    t->due   = check_now_g + milliseconds / 1000.;
+    t->timer = start_timer(milliseconds, check_run,
+                           (void *)(intptr_t)check_started_g);
+    check_started_g++;
+}
+
+static int check_delay(void)
+{
+    switch (check_rand(10)) {
+      case 0 ... 5:
+        return check_rand(2000);
+      case 6 ... 7:
+        return check_rand(600000);
+      case 8:
+        return check_rand(86400000);
+      default:
+        return 20000000 + check_rand(2100000000);
+    }
+}
+
+/** Run @c count timers with the given resolution and slack, and check
+ * their expirations.
+ */
+static void check_wheel(int count, int resolution, int slack)
+{
+    /* The dates are compared to the microsecond, as in the wheel */
+    const ev_tstamp late = (resolution + slack) / 1000. + 1e-6;
+    server_stats_t stats;
+    ev_tstamp next;
+    int fired = 0;
+
+    /* Start from an empty wheel, the resolution can only be changed before
+     * the first timer.
+     */
+    server_wheel_wipe(&_T.wheel, _T.loop);
+    p_clear(&_T.wheel, 1);
+    p_clear(&_T.stats_local, 1);
+    server_set_timer_resolution(resolution, slack);
+    server_wheel_init(&_T.wheel, _T.loop);
+
+    check_timers_g  = p_new(check_timer_t, count);
+    check_max_g     = count;
+    check_started_g = 0;
+    check_late_g    = 0;
+    while (check_started_g < count * 9 / 10) {
+        check_start(check_rand(97) == 0 ? 0 : check_delay());
+        if (check_rand(5) == 0) {
+            check_cancel();
+        }
+        if (check_rand(4) == 0) {
+            check_advance(check_now_g + check_rand(50) / 1000.);
+        }
+    }
+    while (check_next() != NULL) {
+        next = check_next()->at;
+        check_advance(next);
+    }
+
+    for (int i = 0 ; i < check_started_g ; ++i) {
+        const check_timer_t *t = &check_timers_g[i];
+
+        if (t->cancelled) {
+            CHECK(t->fired == 0);
+            continue;
+        }
+        if (t->fired != 1) {
+            printf("timer %d due at %f fired %d times\n", i, t->due,
+                   t->fired);
+            check_failures_g++;
+            continue;
+        }
+        fired++;
+        if (t->fired_at < t->due - 1e-6 || t->fired_at > t->due + late) {
+            printf("timer %d due at %f fired at %f\n", i, t->due,
+                   t->fired_at);
+            check_failures_g++;
+        }
+        check_late_g = MAX(check_late_g, t->fired_at - t->due);
+    }
+
+    server_get_stats(&stats);
+    CHECK(_T.wheel.count == 0);
+    CHECK(stats.timers_armed == 0);
+    CHECK(stats.timers_started == (uint64_t)check_started_g);
+    CHECK(stats.timers_fired == (uint64_t)fired);
+    printf("wheel %dms slack %dms: %d timers, %d fired, late by %.4fs "
+           "at most\n", resolution, slack, check_started_g, fired,
+           check_late_g);
+    p_delete(&check_timers_g);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 2 ? atoi(argv[2]) : 100000;
+
+    check_seed(argc, argv);
+    check_wheel(count, 1, 0);
+    check_wheel(count, 10, 0);
+    check_wheel(count, 1, 25);
+    check_wheel(count, 100, 50);
+    printf("timing wheel: %d failures\n", check_failures_g);
+    return check_failures_g ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim:set et sw=4 sts=4 sws=4: */
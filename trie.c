@@ -62,6 +62,14 @@ ARRAY(trie_key_t)
                                 array_elt((trie)->keys_offset, (id)).offset)
 #define rek(trie, id) (array_elt((trie)->keys_offset, (id)).regexp)
 
+/* Wildcards are stored in the keys as control characters. They sort before
+ * any printable character and are thus the first children of a node (just
+ * after the end-of-key marker).
+ */
+#define TRIE_WILDCARD_LABEL  '\001'
+#define TRIE_WILDCARD_ANY    '\002'
+#define TRIE_LABEL_SEPARATOR '.'
+
 struct trie_t {
     A(trie_entry_t) entries;
     A(char)         c;
@@ -70,8 +78,12 @@ struct trie_t {
     /* Build stuff */
     A(char)         keys;
     A(trie_key_t)   keys_offset;
+    A(char)         regexps_src;
+    A(int)          regexps_src_offset;
 
+    trie_regexp_mode_t regexp_mode;
     bool locked;
+    bool wildcards;
 };
 
 DO_INIT(trie_t, trie)
@@ -84,6 +96,8 @@ static inline void trie_wipe_build_data(trie_t *trie)
 {
     array_wipe(trie->keys);
     array_wipe(trie->keys_offset);
+    array_wipe(trie->regexps_src);
+    array_wipe(trie->regexps_src_offset);
 }
 
 static inline void trie_wipe(trie_t *trie)
@@ -245,27 +259,58 @@ static inline void trie_entry_split(trie_t *trie, uint32_t id, uint16_t pos)
     entry->regexp_offset   = -1;
 }
 
-bool trie_insert_regexp_str(trie_t *trie, const clstr_t *key,
-                            const clstr_t *regexp)
+static bool trie_insert_key(trie_t *trie, const clstr_t *key,
+                            const clstr_t *regexp, bool wildcards)
 {
     assert(trie->entries.len == 0 && "Trie already compiled");
 
     trie_key_t key_pos = { trie->keys.len, -1 };
-    if (regexp != NULL) {
+    if (regexp != NULL && trie->regexp_mode == TRIE_REGEXP_BULK) {
+        /* Only keep the source, the regexps are compiled by trie_compile
+         * in the order of insertion.
+         */
+        key_pos.regexp = trie->regexps_src_offset.len;
+        array_add(trie->regexps_src_offset, trie->regexps_src.len);
+        array_append(trie->regexps_src, regexp->str, regexp->len);
+        array_add(trie->regexps_src, '\0');
+    } else if (regexp != NULL) {
         key_pos.regexp = trie->regexps.len;
 
         regexp_t re;
-        if (!regexp_compile_str(&re, regexp, false)) {
+        if (trie->regexp_mode == TRIE_REGEXP_LAZY) {
+            regexp_intern_lazy_str(&re, regexp, false);
+        } else if (!regexp_intern_str(&re, regexp, false)) {
             return false;
         }
         array_add(trie->regexps, re);
     }
     array_add(trie->keys_offset, key_pos);
-    array_append(trie->keys, key->str, key->len);
+    if (!wildcards) {
+        array_append(trie->keys, key->str, key->len);
+    } else {
+        for (ssize_t i = 0 ; i < key->len ; ++i) {
+            if (key->str[i] != '*') {
+                array_add(trie->keys, key->str[i]);
+            } else if (i + 1 < key->len && key->str[i + 1] == '*') {
+                array_add(trie->keys, TRIE_WILDCARD_ANY);
+                trie->wildcards = true;
+                ++i;
+            } else {
+                array_add(trie->keys, TRIE_WILDCARD_LABEL);
+                trie->wildcards = true;
+            }
+        }
+    }
     array_add(trie->keys, '\0');
     return true;
 }
 
+bool trie_insert_regexp_str(trie_t *trie, const clstr_t *key,
+                            const clstr_t *regexp)
+{
+    return trie_insert_key(trie, key, regexp, false);
+}
+
 bool trie_insert_regexp(trie_t *trie, const char *key, const char *regexp)
 {
     clstr_t skey = { key, m_strlen(key) };
@@ -284,6 +329,17 @@ bool trie_insert(trie_t *trie, const char *key)
     return trie_insert_regexp_str(trie, &skey, NULL);
 }
 
+bool trie_insert_wildcard_str(trie_t *trie, const clstr_t *key)
+{
+    return trie_insert_key(trie, key, NULL, true);
+}
+
+bool trie_insert_wildcard(trie_t *trie, const char *key)
+{
+    clstr_t skey = { key, m_strlen(key) };
+    return trie_insert_wildcard_str(trie, &skey);
+}
+
 static bool trie_compile_aux(trie_t *trie, uint32_t id,
                              uint32_t first_key, uint32_t last_key,
                              int offset, int initial_diff)
@@ -367,11 +423,51 @@ static bool trie_compile_aux(trie_t *trie, uint32_t id,
     return true;
 }
 
+void trie_set_regexp_mode(trie_t *trie, trie_regexp_mode_t mode)
+{
+    assert(trie->keys_offset.len == 0 && "Trie not empty");
+    trie->regexp_mode = mode;
+}
+
+/** Compile the regexps collected by the insertion in bulk mode. The index
+ * of each regexp is its insertion rank, whatever the thread that compiled
+ * it.
+ */
+static bool trie_compile_regexps(trie_t *trie)
+{
+    const uint32_t len = trie->regexps_src_offset.len;
+    clstr_t *regexps = p_new(clstr_t, len);
+    int failures;
+
+    for (uint32_t i = 0 ; i < len ; ++i) {
+        const int offset = array_elt(trie->regexps_src_offset, i);
+        const int end = i + 1 < len
+                      ? array_elt(trie->regexps_src_offset, i + 1)
+                      : (int)trie->regexps_src.len;
+        regexps[i].str = array_ptr(trie->regexps_src, offset);
+        regexps[i].len = end - offset - 1;
+    }
+    array_ensure_exact_capacity(trie->regexps, len);
+    failures = regexp_compile_many(trie->regexps.data, regexps, len,
+                                   false, true);
+    trie->regexps.len = len;
+    p_delete(&regexps);
+    if (failures > 0) {
+        err("%d regexps of the trie could not be compiled", failures);
+        return false;
+    }
+    return true;
+}
+
 bool trie_compile(trie_t *trie, bool memlock)
 {
     assert(trie->entries.len == 0 && "Trie already compiled");
     assert(trie->keys.len != 0 && "Trying to compile an empty trie");
 
+    if (trie->regexps_src_offset.len > 0 && !trie_compile_regexps(trie)) {
+        return false;
+    }
+
     /* First of all, sort all the entries
      */
     {
@@ -413,10 +509,203 @@ bool trie_compile(trie_t *trie, bool memlock)
         match->regexp  = (RES);                                              \
     }
 
+/* State of a lookup in a trie with wildcards.
+ *
+ * The result of the walk from a wildcard only depends on the position of
+ * the wildcard and on the position in the key: the failures are remembered,
+ * so that the backtracking of the previous wildcards does not walk them
+ * again. This bounds the lookup to a polynomial of the length of the key
+ * instead of an exponential in the number of wildcards.
+ */
+typedef struct trie_walk_t {
+    const trie_t *trie;
+    const char   *key;          /**< beginning of the key */
+    const char   *end;          /**< end of the match on success */
+    bool          prefix;
+
+    /* Open addressing set of the failed (wildcard, key position) pairs */
+    uint64_t     *failed;
+    uint32_t      failed_size;
+    uint32_t      failed_len;
+    uint64_t      failed_buf[64];
+} trie_walk_t;
+
+static void trie_walk_init(trie_walk_t *walk, const trie_t *trie,
+                           const char *key, bool prefix)
+{
+    walk->trie        = trie;
+    walk->key         = key;
+    walk->end         = key;
+    walk->prefix      = prefix;
+    walk->failed      = walk->failed_buf;
+    walk->failed_size = countof(walk->failed_buf);
+    walk->failed_len  = 0;
+    p_clear(walk->failed_buf, countof(walk->failed_buf));
+}
+
+static void trie_walk_wipe(trie_walk_t *walk)
+{
+    if (walk->failed != walk->failed_buf) {
+        p_delete(&walk->failed);
+    }
+}
+
+static inline uint64_t trie_walk_state(const trie_walk_t *walk,
+                                       const trie_entry_t *entry, int pos,
+                                       const char *key)
+{
+    /* 0 marks the free slots of the set */
+    return ((uint64_t)(entry->c_offset + pos + 1) << 32)
+         | (uint32_t)(key - walk->key);
+}
+
+static inline uint32_t trie_walk_slot(const trie_walk_t *walk,
+                                      uint64_t state)
+{
+    const uint32_t mask = walk->failed_size - 1;
+    uint32_t slot = (uint32_t)((state * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+
+    while (walk->failed[slot] != 0 && walk->failed[slot] != state) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void trie_walk_fail(trie_walk_t *walk, uint64_t state)
+{
+    if (2 * (walk->failed_len + 1) > walk->failed_size) {
+        uint64_t *old     = walk->failed;
+        uint32_t old_size = walk->failed_size;
+
+        walk->failed_size *= 2;
+        walk->failed       = p_new(uint64_t, walk->failed_size);
+        for (uint32_t i = 0 ; i < old_size ; ++i) {
+            if (old[i] != 0) {
+                walk->failed[trie_walk_slot(walk, old[i])] = old[i];
+            }
+        }
+        if (old != walk->failed_buf) {
+            p_delete(&old);
+        }
+    }
+    walk->failed[trie_walk_slot(walk, state)] = state;
+    walk->failed_len++;
+}
+
+/** Match the key against the entry starting at position \p pos in the
+ * string of the entry, resolving the wildcards.
+ *
+ * Exact children are tried first, then the wildcard ones, backtracking on
+ * failure. A wildcard matches at least one character. If the walk is a
+ * prefix one, an entry matches as soon as its string is a prefix of the
+ * key. On success, the matching leaf is returned and the end of the walk
+ * points after the matched part of the key.
+ */
+static const trie_entry_t *trie_wildcard_walk(trie_walk_t *walk,
+                                              const trie_entry_t *entry,
+                                              int pos, const char *key)
+{
+    const trie_t *trie = walk->trie;
+    const char *c = str(trie, entry);
+
+    for (; pos < entry->c_len ; ++pos) {
+        switch (c[pos]) {
+          case TRIE_WILDCARD_LABEL:
+          case TRIE_WILDCARD_ANY: {
+            const bool any = (c[pos] == TRIE_WILDCARD_ANY);
+            const uint64_t state = trie_walk_state(walk, entry, pos, key);
+
+            if (walk->failed[trie_walk_slot(walk, state)] == state) {
+                return NULL;
+            }
+            while (*key != '\0' && (any || *key != TRIE_LABEL_SEPARATOR)) {
+                const trie_entry_t *leaf;
+
+                ++key;
+                leaf = trie_wildcard_walk(walk, entry, pos + 1, key);
+                if (leaf != NULL) {
+                    return leaf;
+                }
+            }
+            trie_walk_fail(walk, state);
+            return NULL;
+          }
+
+          case '\0':
+            if (walk->prefix || *key == '\0') {
+                walk->end = key;
+                return entry;
+            }
+            return NULL;
+
+          default:
+            if (c[pos] != *key) {
+                return NULL;
+            }
+            ++key;
+            break;
+        }
+    }
+
+    const trie_entry_t *exact = trie_entry_child(trie, entry, key[0]);
+    if (exact != NULL) {
+        const trie_entry_t *leaf = trie_wildcard_walk(walk, exact, 0, key);
+        if (leaf != NULL) {
+            return leaf;
+        }
+    }
+    for (uint32_t i = 0 ; i < entry->children_len ; ++i) {
+        const trie_entry_t *child
+            = array_ptr(trie->entries, entry->children_offset + i);
+        const char c2 = str(trie, child)[0];
+        if (c2 > TRIE_WILDCARD_ANY) {
+            break;
+        }
+        if (child == exact || (c2 == '\0' && !walk->prefix)) {
+            continue;
+        }
+        const trie_entry_t *leaf = trie_wildcard_walk(walk, child, 0, key);
+        if (leaf != NULL) {
+            return leaf;
+        }
+    }
+    return NULL;
+}
+
+static bool trie_wildcard_match(const trie_t *trie, const char *key,
+                                bool prefix, trie_match_t *match)
+{
+    const trie_entry_t *root = array_ptr(trie->entries, 0);
+    const trie_entry_t *leaf;
+    trie_walk_t walk;
+
+    trie_walk_init(&walk, trie, key, false);
+    leaf = trie_wildcard_walk(&walk, root, 0, key);
+    trie_walk_wipe(&walk);
+    if (leaf != NULL) {
+        FILL_MATCH(walk.end - key, true, true, rex(trie, leaf));
+        return true;
+    }
+    if (prefix || match != NULL) {
+        trie_walk_init(&walk, trie, key, true);
+        leaf = trie_wildcard_walk(&walk, root, 0, key);
+        trie_walk_wipe(&walk);
+        if (leaf != NULL) {
+            FILL_MATCH(walk.end - key, false, true, rex(trie, leaf));
+            return prefix;
+        }
+    }
+    FILL_MATCH(0, false, false, NULL);
+    return false;
+}
+
 bool trie_lookup_match(const trie_t *trie, const char *key,
                        trie_match_t *match)
 {
     assert(trie->keys.len == 0L && "Can't lookup: trie not compiled");
+    if (unlikely(trie->wildcards) && trie->entries.len != 0) {
+        return trie_wildcard_match(trie, key, false, match);
+    }
     if (trie->entries.len == 0) {
         FILL_MATCH(0, false, false, NULL);
         return false;
@@ -465,6 +754,9 @@ bool trie_prefix_match(const trie_t *trie, const char *key,
                        trie_match_t *match)
 {
     assert(trie->keys.len == 0L && "Can't lookup: trie not compiled");
+    if (unlikely(trie->wildcards) && trie->entries.len != 0) {
+        return trie_wildcard_match(trie, key, true, match);
+    }
     if (trie->entries.len == 0) {
         FILL_MATCH(0, false, false, NULL);
         return false;
@@ -504,6 +796,51 @@ bool trie_prefix_match(const trie_t *trie, const char *key,
     }
 }
 
+void trie_prefix_foreach(const trie_t *trie, const char *key,
+                         trie_match_f cb, void *data)
+{
+    assert(trie->keys.len == 0L && "Can't lookup: trie not compiled");
+    if (trie->entries.len == 0) {
+        return;
+    } else {
+        const char * const orig = key;
+        const trie_entry_t *current = array_ptr(trie->entries, 0);
+        trie_match_t match;
+
+        while (true) {
+            if (trie_entry_is_leaf(current)) {
+                if (trie_entry_prefix(trie, current, key)) {
+                    match.match_len    = key - orig + current->c_len - 1;
+                    match.match_all    = key[current->c_len - 1] == '\0';
+                    match.match_prefix = true;
+                    match.regexp       = rex(trie, current);
+                    cb(&match, data);
+                }
+                return;
+            } else if (trie_entry_c_match(trie, current, key)) {
+                key += current->c_len;
+                const trie_entry_t *end = trie_entry_child(trie, current, '\0');
+                if (end != NULL) {
+                    match.match_len    = key - orig;
+                    match.match_all    = key[0] == '\0';
+                    match.match_prefix = true;
+                    match.regexp       = rex(trie, end);
+                    cb(&match, data);
+                }
+                if (key[0] == '\0') {
+                    return;
+                }
+                current = trie_entry_child(trie, current, key[0]);
+                if (current == NULL) {
+                    return;
+                }
+            } else {
+                return;
+            }
+        }
+    }
+}
+
 void trie_lock(trie_t *trie)
 {
     if (trie->locked) {
@@ -565,7 +902,11 @@ static void trie_entry_inspect(const trie_t *trie, bool show_content,
             const char *c = str(trie, entry);
             printf("(%d) ", entry->c_len);
             for (int i = 0 ; i < entry->c_len ; ++i) {
-                if (c[i]) {
+                if (c[i] == TRIE_WILDCARD_LABEL) {
+                    fputs("* ", stdout);
+                } else if (c[i] == TRIE_WILDCARD_ANY) {
+                    fputs("** ", stdout);
+                } else if (c[i]) {
                     printf("%c ", c[i]);
                 } else {
                     fputs("\\0 ", stdout);
@@ -53,6 +53,30 @@ typedef struct trie_match_t {
 trie_t *trie_new(void);
 void trie_delete(trie_t **trie);
 
+/** How the regexps associated with the keys are compiled.
+ */
+typedef enum trie_regexp_mode_t {
+    /** The regexp is compiled by trie_insert_regexp (default).
+     */
+    TRIE_REGEXP_EAGER,
+
+    /** The regexps are collected by trie_insert_regexp and compiled in
+     * parallel by trie_compile, which fails if any of them is invalid.
+     */
+    TRIE_REGEXP_BULK,
+
+    /** The regexps are compiled by the first lookup that reaches them
+     * (\ref regexp_intern_lazy). An invalid regexp never matches.
+     */
+    TRIE_REGEXP_LAZY,
+} trie_regexp_mode_t;
+
+/** Select how the regexps are compiled. Must be called before the first
+ * insertion.
+ */
+__attribute__((nonnull(1)))
+void trie_set_regexp_mode(trie_t *trie, trie_regexp_mode_t mode);
+
 /** Add a string in the trie.
  * \ref trie_compile.
  */
@@ -78,6 +102,28 @@ __attribute__((nonnull(1,2)))
 bool trie_insert_regexp_str(trie_t *trie, const clstr_t *key,
                             const clstr_t *regexp);
 
+/** Add a string containing wildcard labels in the trie.
+ *
+ * Labels are separated by dots. In the key:
+ *  * a '*' matches a non-empty sequence of characters within a label (e.g.
+ *  *.example.com or mx*.example.net),
+ *  * a '**' matches a non-empty sequence of characters, dots included (e.g.
+ *  **.example.com matches any subdomain of example.com, but not
+ *  .example.com).
+ *
+ * Wildcards are compiled in the trie and resolved during the lookup, no
+ * regexp is involved. Exact entries take precedence over wildcard ones.
+ *
+ * \ref trie_insert
+ */
+__attribute__((nonnull(1,2)))
+bool trie_insert_wildcard(trie_t *trie, const char *key);
+
+/** Insert a string containing wildcard labels in the trie.
+ */
+__attribute__((nonnull(1,2)))
+bool trie_insert_wildcard_str(trie_t *trie, const clstr_t *key);
+
 /** Compile the trie.
  * A trie must be compiled before lookup is possible. Compiling the trie
  * consists in building the tree.
@@ -124,6 +170,17 @@ bool trie_prefix_match(const trie_t *trie, const char *key,
                        trie_match_t *match);
 #define trie_prefix(trie, key) (trie_prefix_match(trie, key, NULL))
 
+typedef void (*trie_match_f)(const trie_match_t *match, void *data);
+
+/** Call \p cb for each key of the trie that is a prefix of \p key, from
+ * the shortest to the longest one.
+ *
+ * Wildcards are not resolved by this function.
+ */
+__attribute__((nonnull(1,2,3)))
+void trie_prefix_foreach(const trie_t *trie, const char *key,
+                         trie_match_f cb, void *data);
+
 /** Show the content of the trie and computes statistics.
  */
 __attribute__((nonnull(1)))